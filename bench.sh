@@ -0,0 +1,91 @@
+#!/bin/sh
+# bench.sh - times tiff2png on each case of a corpus written by mkcorpus
+#
+# Usage:  bench.sh <tiff2png> <corpus dir> [<baseline>]
+#
+# Converts the files of each case with one tiff2png run, BENCH_REPEAT times
+# (default 3), and keeps the fastest.  BENCH_FLAGS is passed to tiff2png
+# (e.g. "-threads 4").  Prints one tab-separated line per case, after a
+# "#" header:  the case, its files, megabytes of uncompressed image data,
+# seconds, MB/s and files/s.  Given a baseline (an earlier output of this
+# script), the baseline's MB/s and the change in percent are added.  The
+# last line, "total", is for the whole corpus.
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+  echo "Usage:  bench.sh <tiff2png> <corpus dir> [<baseline>]" >&2
+  exit 1
+fi
+tiff2png=$1
+corpus=$2
+baseline=${3:-/dev/null}
+repeat=${BENCH_REPEAT:-3}
+
+if [ ! -f "$corpus/cases" ]; then
+  echo "bench.sh error:  $corpus/cases not found (run mkcorpus)" >&2
+  exit 1
+fi
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp/png" || exit 1
+
+# nanoseconds, for GNU date; whole seconds elsewhere
+now () {
+  date +%s%N | sed 's/N$/000000000/'
+}
+
+while read -r name files bytes; do
+  best=
+  i=0
+  while [ $i -lt "$repeat" ]; do
+    t0=$(now)
+    if ! "$tiff2png" -force -destdir "$tmp/png" $BENCH_FLAGS \
+        "$corpus/$name"-*.tif 2>/dev/null; then
+      echo "bench.sh error:  tiff2png failed on $name" >&2
+      exit 1
+    fi
+    t1=$(now)
+    t=$((t1 - t0))
+    if [ -z "$best" ] || [ $t -lt "$best" ]; then
+      best=$t
+    fi
+    i=$((i + 1))
+  done
+  echo "$name $files $bytes $best"
+done < "$corpus/cases" > "$tmp/times" || exit 1
+
+awk -v baseline="$baseline" '
+  BEGIN {
+    while ((getline line < baseline) > 0) {
+      split(line, f, "\t")
+      if (f[1] !~ /^#/)
+        base[f[1]] = f[5]
+    }
+    printf "#case\tfiles\tMB\tseconds\tMB/s\tfiles/s"
+    if (baseline != "/dev/null")
+      printf "\tbase_MB/s\tchange_%%"
+    printf "\n"
+  }
+  function report(name, files, mb, s) {
+    if (s <= 0)
+      s = 1e-9
+    printf "%s\t%d\t%.3f\t%.4f\t%.2f\t%.2f", name, files, mb, s, mb / s,
+      files / s
+    if (baseline != "/dev/null") {
+      if (name in base && base[name] > 0)
+        printf "\t%.2f\t%+.1f", base[name], (mb / s / base[name] - 1) * 100
+      else
+        printf "\t-\t-"
+    }
+    printf "\n"
+  }
+  {
+    mb = $3 / 1e6
+    s = $4 / 1e9
+    report($1, $2, mb, s)
+    nfiles += $2
+    tmb += mb
+    ts += s
+  }
+  END {
+    report("total", nfiles, tmb, ts)
+  }' "$tmp/times"
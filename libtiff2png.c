@@ -0,0 +1,6115 @@
+/*
+** libtiff2png.c - converts Tagged Image File Format to Portable Network
+**                 Graphics (the library behind tiff2png; see tiff2png.h)
+**
+** Copyright 1996,2000 Willem van Schaik, Calgary (willem@schaik.com)
+** Copyright 1999-2002 Greg Roelofs (newt@pobox.com)
+**
+** Lots of material was stolen from libtiff, tifftopnm, pnmtopng, which
+** programs had also done a fair amount of "borrowing", so the credit for
+** this program goes besides the author also to:
+**         Sam Leffler
+**         Jef Poskanzer
+**         Alexander Lehmann
+**         Patrick Naughton
+**         Marcel Wijkstra
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted,
+** provided that the above copyright notice appear in all copies and that
+** both that copyright notice and this permission notice appear in
+** supporting documentation.
+**
+** This file is provided AS IS with no warranties of any kind.  The author
+** shall have no liability with respect to the infringement of copyrights,
+** trade secrets or any patents by this file or any part thereof.  In no
+** event will the author be liable for any lost revenue or profits or
+** other special, indirect and consequential damages.
+*/
+
+/* To do:  add testing/support for associated vs. unassociated alpha channel
+**         add support for iCCP profiles (and autodetect sRGB?)
+**       / add support for text annotations
+**       \ incorporate Willem's remaining 0.82 changes
+**         check various "XXX" items (MINISWHITE RGB? ...)
+**         create a man page
+**         [maybe switch to equivalent (OSS Certified) libpng or zlib license?]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tiff.h"
+#include "tiffio.h"
+#include "png.h"
+
+#include "zlib.h"
+#ifdef HAVE_LIBDEFLATE
+#  include <libdeflate.h>
+#endif
+
+#include "tiff2png.h"
+
+#ifndef _WIN32	/* for -mmap and -cache */
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  define HAVE_MMAP
+#  define HAVE_CACHE
+#endif
+
+/* SIMD versions of the 16-bit row kernels; SSE2 is always there on x86-64,
+ * AVX2 is compiled in with a target attribute and used if the CPU has it */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#  define SIMD_SSE2
+#  include <emmintrin.h>
+#  if (__GNUC__ >= 5 || defined(__clang__))
+#    define SIMD_AVX2
+#    include <immintrin.h>
+#  endif
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define SIMD_NEON
+#  include <arm_neon.h>
+#endif
+
+#ifndef TRUE
+#  define TRUE 1
+#endif
+#ifndef FALSE
+#  define FALSE 0
+#endif
+#ifndef NONE
+#  define NONE 0
+#endif
+
+#define MAXCOLORS 256
+
+#ifndef PHOTOMETRIC_DEPTH
+#  define PHOTOMETRIC_DEPTH 32768
+#endif
+
+#ifndef PNG_ROW_IN_INTERLACE_PASS	/* libpng before 1.5 */
+#  define PNG_ROW_IN_INTERLACE_PASS(y, pass) \
+     ((((y) & (0x7 >> ((pass) == 0? 0 : ((pass) - 1) >> 1))) == \
+       (((pass) == 2)? 4 : ((pass) == 4)? 2 : ((pass) == 6)? 1 : 0)))
+#endif
+
+/* -filter auto / -strategy auto try the candidates on this many bytes of
+ * the first rows, and settle for the cheapest one within TUNE_SLACK parts
+ * per thousand of the smallest output */
+#define TUNE_SAMPLE_SIZE (256L << 10)
+#define TUNE_SLACK	10
+
+typedef unsigned char  uch;
+typedef unsigned short ush;
+typedef unsigned long  ulg;
+
+/* a minimal pthreads work queue:  jobs are run in FIFO order by a fixed set
+ * of workers, each of which pulls the next queued job as soon as it is idle.
+ * With no workers at all, jobs simply run inline in workq_submit(). */
+
+typedef struct _workq_job {
+  void (*fn) (void *arg);
+  void *arg;
+  int done;
+  struct _workq_job *next;
+} workq_job;
+
+typedef struct _workq {
+  pthread_mutex_t lock;
+  pthread_cond_t more;		/* a job was queued, or shutting down */
+  pthread_cond_t finished;	/* some job has completed */
+  workq_job *head, *tail;
+  pthread_t *threads;
+  int nthreads;
+  int shutdown;
+} workq;
+
+/* multi-threaded IDAT encoding, pigz-style:  the filtered image data is cut
+ * into bands of whole rows, each band is deflated on its own (primed with
+ * the last 32K of the band before it), and the raw deflate streams are
+ * stitched back together into a single zlib stream.  Band boundaries depend
+ * only on the image (and a small -max-memory), so the output is identical
+ * for any number of threads. */
+
+#define IDAT_BAND_SIZE	(1L << 20)	/* filtered bytes per band (roughly) */
+#define IDAT_WINDOW	32768		/* deflate window and preset dictionary */
+
+typedef struct _idat_band {
+  workq_job job;
+  struct _idat_encoder *enc;
+  uch *data;			/* filtered rows, each with its filter byte */
+  size_t size;
+  uch dict[IDAT_WINDOW];	/* tail of the previous band's data */
+  size_t dictsize;
+  uch *zbuf;			/* zlib header + raw deflate data + adler32 */
+  size_t zsize;
+  uLong adler;			/* adler32 of data */
+  int last;
+  int status;			/* Z_OK or a zlib error code */
+  struct _idat_band *next;
+} idat_band;
+
+/* deflate backends:  each turns the filtered rows of one band into raw
+ * deflate data in zbuf (at zbuf+2, leaving room for the zlib header in
+ * front and the adler32 behind), which must end on a byte boundary and,
+ * unless the band is the last one, without a final block, so that the
+ * bands can be stitched together.  Returns Z_OK or a zlib error code. */
+
+typedef struct _deflate_backend {
+  char *name;
+  int (*deflate_band) (idat_band *band);
+} deflate_backend;
+
+typedef struct _idat_encoder {
+  struct _tiff2png_context *ctx;	/* for -stats */
+  png_structp png_ptr;
+  workq *wq;
+  deflate_backend *backend;
+  int level, strategy;
+  int bit_depth;
+  int filters;			/* PNG_FILTER_* mask to choose from */
+  png_uint_32 width;
+  size_t rowbytes;		/* packed bytes per row, without filter byte */
+  size_t bandsize;		/* bytes per band, a multiple of rowbytes+1 */
+  int bpp;			/* filter offset:  bytes per pixel, at least 1 */
+  uch *prev, *cur;		/* packed, unfiltered rows */
+  uch *trial[5];		/* one candidate row per filter type */
+  idat_band *band;		/* band being filled */
+  idat_band *head, *tail;	/* bands being deflated, oldest first */
+  idat_band *writing;		/* band being written out */
+  int inflight, maxinflight;
+  uLong adler;			/* adler32 of everything written so far */
+  int wrote_header;
+} idat_encoder;
+
+/* parallel decoding of TIFF image data ("strile" is libtiff's word for a
+ * strip or a tile):  the image is read a band at a time, a band being one
+ * strip or one row of tiles (of every plane, for separated planes).  Each
+ * strile of a band is a job on the work queue, each worker using a TIFF
+ * handle of its own, and the bands after the current one are read ahead. */
+
+#define STRILE_READAHEAD (64L << 20)	/* most bytes of bands to read ahead */
+
+#define SPOOL_MEMORY (64L << 20)	/* most of a piped TIFF kept in memory */
+
+/* -mmap:  the input file is mapped once and every TIFF handle on it reads
+ * from the mapping through TIFFClientOpen(), each at its own position.  The
+ * last handle to be closed unmaps the file.  A TIFF piped to stdin is read
+ * the same way, from memory or from a mapped temporary file, and so is a
+ * TIFF handed over in a buffer. */
+
+typedef struct _tiff_map {
+  pthread_mutex_t lock;		/* protects refs */
+  int refs;
+  int fd;			/* or -1 if base is in memory: */
+  int own;			/*  malloc()ed, to be freed, or the caller's */
+  uch *base;
+  size_t size;
+} tiff_map;
+
+typedef struct _tiff_map_handle {
+  tiff_map *map;
+  toff_t pos;
+} tiff_map_handle;
+
+typedef struct _tiff_handle {
+  TIFF *tif;
+  uch *buf;			/* one decoded tile (strips need none) */
+  int busy;
+} tiff_handle;
+
+typedef struct _strile_job {
+  workq_job job;
+  struct _strile_reader *sr;
+  uint32_t strile;		/* strip or tile number */
+  uch *dest;			/* top left corner of the strile in the band */
+  size_t nbytes;		/* bytes to copy per row (less at right edge) */
+  int skip;			/* rows of the tile above the band */
+  int nrows;			/* rows in this band (less at the bottom) */
+  int ok;
+} strile_job;
+
+typedef struct _strile_band {
+  uch *buf;			/* planes one after the other */
+  long brow;			/* band held or being read, -1 for none */
+  int pending;			/* jobs submitted but not yet waited for */
+  strile_job *jobs;
+} strile_band;
+
+typedef struct _strile_reader {
+  struct _tiff2png_context *ctx;	/* for the decoding threads */
+  char *tiffname;
+  workq *wq;
+  tiff_map *map;		/* or NULL if not reading with -mmap */
+  int page;			/* directory the image is in */
+  uint64_t *offsets;		/* where each strile is in the file, */
+  uint64_t *bytecounts;		/*  for the -mmap read-ahead hints */
+  int jpegcolormode;		/* pseudo-tags to set on extra handles, */
+  int sgilogdatafmt;		/*  or -1 to leave them alone */
+  pthread_mutex_t lock;		/* protects handles[].busy */
+  tiff_handle *handles;
+  int nhandles;
+  int tiled;
+  png_uint_32 rows;
+  png_uint_32 band_height;	/* rows per strip or tile */
+  png_uint_32 slice;		/* rows per band:  band_height, or less to
+				 * keep a row of tiles within -max-memory */
+  int slices;			/* bands per strip or row of tiles */
+  int tiles_across;		/* striles across the image (1 for strips) */
+  int ndown;			/* striles down the image */
+  int col0, nacross;		/* the striles across that are read */
+  int bottom;			/* the band after the last one read */
+  png_uint_32 xoff;		/* pixels of each line left of the window */
+  int nplanes;			/* 1, or spp for separated planes */
+  size_t linebytes;		/* bytes per scanline of a plane (of the
+				 * striles read) */
+  size_t tilerowbytes;		/* bytes per tile scanline */
+  size_t planebytes;		/* bytes per band of a plane */
+  tmsize_t tilesz;
+  strile_band *band;		/* ring of bands; band n is in band[n % nbands] */
+  int nbands;
+} strile_reader;
+
+/* the converted image, kept for the later passes of interlaced output (and
+ * for -reduce):  in memory, or in a temporary file once it would take more
+ * than INTERLACE_MEMORY bytes */
+
+#define INTERLACE_MEMORY (256L << 20)
+
+typedef struct _row_store {
+  uch *mem;
+  FILE *spill;
+  size_t rowbytes;
+} row_store;
+
+/* names of the -filter and -strategy settings */
+
+typedef struct _named_value {
+  char *name;
+  int value;
+} named_value;
+
+static named_value filter_names[] = {
+  { "none",	PNG_FILTER_NONE },
+  { "sub",	PNG_FILTER_SUB },
+  { "up",	PNG_FILTER_UP },
+  { "avg",	PNG_FILTER_AVG },
+  { "paeth",	PNG_FILTER_PAETH },
+  { "all",	PNG_ALL_FILTERS },
+  { NULL,	0 }
+};
+
+static named_value strategy_names[] = {
+  { "default",	Z_DEFAULT_STRATEGY },
+  { "filtered",	Z_FILTERED },
+  { "huffman",	Z_HUFFMAN_ONLY },
+  { "rle",	Z_RLE },
+  { "fixed",	Z_FIXED },
+  { NULL,	0 }
+};
+
+/* converts one row of cols TIFF pixels to a libpng row */
+typedef void (*row_kernel) (uch *src, png_byte *dst, png_uint_32 cols);
+
+/* where the rows of a conversion come from:  the strile reader, through
+ * the row kernel (and -faxpect) */
+
+typedef struct _row_source {
+  struct _tiff2png_context *ctx;
+  strile_reader *sr;
+  int planar;			/* 1 for contiguous samples */
+  int spp, bps;
+  int cols;
+  int fax_across, fax_down;	/* -faxpect runs across or down, or 0 */
+  int fax_width;		/* -faxpect output width */
+  int fax_flip;			/* 0xff if a 1 bit is black */
+  int y0;			/* the first TIFF row (of the -crop window) */
+  png_uint_32 xoff;		/* pixels left of the window in each line */
+  size_t linebytes;		/* of each line (of a plane) */
+  uch *shifted;			/* lines moved to start on a byte, if the
+				 * window doesn't */
+  row_kernel convert_row;
+  uch *tiffline;		/* the planes interleaved, if separate */
+  png_byte *pngline;		/* the converted row */
+} row_source;
+
+/* what -reduce has found out about the image so far, and what it comes to;
+ * colors are counted (in a hash table of 0xRRGGBBAA keys) up to 256 */
+
+#define REDUCE_HASH_BITS 10
+
+typedef struct _reduce_info {
+  png_uint_32 width;
+  int color_type, bit_depth;	/* of the rows looked over */
+  int channels;
+  int to8;			/* every 16-bit sample is two equal bytes */
+  int opaque;			/* every alpha sample is at its maximum */
+  int gray;			/* every pixel has red = green = blue */
+  int fits1, fits2, fits4;	/* every first sample fits in so many bits */
+  int ncolors;			/* 257 once there are too many */
+  png_uint_32 colors[256];	/* in order of appearance */
+  png_uint_32 keys[1 << REDUCE_HASH_BITS];
+  short index[1 << REDUCE_HASH_BITS];	/* into colors (or the palette), or -1 */
+  png_uint_32 last_key;		/* the last pixel looked up, */
+  int last_index;		/*  for runs of one color */
+  int out_type, out_depth;	/* what reduce_decide() settled on */
+  int keep_alpha;
+  png_byte *out;		/* a reduced row */
+} reduce_info;
+
+/* a conversion context (see tiff2png.h).  While it is converting, it is
+ * also the current context of each thread working for it, which is how the
+ * messages of libtiff, which has no handlers per TIFF handle, find it. */
+
+#define ERROR_SIZE 256		/* longest message passed on */
+
+struct _tiff2png_context {
+  tiff2png_options opts;
+  deflate_backend *backend;	/* or NULL to leave compression to libpng */
+  tiff2png_message_fn message;	/* or NULL to print messages */
+  void *message_arg;
+  char error[ERROR_SIZE];	/* what stopped the conversion, or "" */
+  jmp_buf jmpbuf;		/* for libpng errors */
+  tiff2png_stats stats;
+  pthread_mutex_t stats_lock;	/* protects the CPU times and mem */
+  uint64_t mem;			/* bytes of image data buffered right now */
+  pthread_t thread;		/* the converting thread */
+};
+
+/* -stats:  the converting thread measures the wall-clock and CPU time of
+ * each phase between stats_start() and stats_stop(), less the time spent
+ * writing output in between; worker threads add the CPU time of what they
+ * do for a phase with stats_worker() */
+
+typedef struct _stats_mark {
+  double wall, cpu;
+  double output_wall, output_cpu;
+} stats_mark;
+
+/* where libpng's output goes:  a file or a tiff2png_buffer */
+
+typedef struct _png_sink {
+  struct _tiff2png_context *ctx;
+  FILE *png;
+  tiff2png_buffer *out;		/* if png is NULL */
+} png_sink;
+
+/* a smaller copy of the image for -sizes, which each row of the image is
+ * added into as it goes by.  A pixel of the image is width units of the
+ * thumbnail wide and height units high, a pixel of the thumbnail
+ * src_width by src_height, and each image pixel is weighted by how many
+ * units of each thumbnail pixel it covers (at most two across and two
+ * down).  Colors are weighted by alpha, too. */
+
+typedef struct _thumb {
+  struct _tiff2png_context *ctx;
+  int size;			/* the longest side asked for */
+  char *name;
+  FILE *fp;
+  png_sink sink;
+  png_struct *png_ptr;
+  png_info *info_ptr;
+  png_uint_32 width, height;
+  png_uint_32 src_width, src_height;
+  int color_type, bit_depth;	/* of the image rows */
+  png_color *palette;		/* a copy of the image's, or NULL */
+  int channels;			/* of the thumbnail */
+  int alpha;			/* the last channel is alpha */
+  png_uint_32 *col_to;		/* thumbnail column each image column starts */
+  png_uint_32 *col_w;		/* in, and its weight there */
+  double *hrow;			/* an image row, added up across */
+  double *acc;			/* the thumbnail row being added up */
+  png_uint_32 src_row;		/* the next image row */
+  png_byte *line;
+  row_store *rs;		/* with -interlace, until the end */
+  int done;			/* the PNG is complete */
+} thumb;
+
+#ifdef HAVE_CACHE
+typedef struct _sha256 {
+  uint32_t h[8];
+  uint64_t len;			/* bytes hashed */
+  uch buf[64];			/* the partial block */
+  size_t n;			/* bytes in buf */
+} sha256;
+#endif
+
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+static pthread_key_t context_key;	/* the thread's current context */
+static TIFFErrorHandler tiff_error_chain;	/* libtiff's handlers from */
+static TIFFErrorHandler tiff_warning_chain;	/*  before context_init() */
+
+
+/* local prototypes */
+
+static void context_init (void);
+static tiff2png_context *context_enter (tiff2png_context *ctx);
+static void tiff2png_vmessage (tiff2png_context *ctx, int level, char *fmt,
+                               va_list ap);
+static void tiff2png_message (tiff2png_context *ctx, int level, char *fmt,
+                              ...);
+static void tiff2png_tiff_message (int level, TIFFErrorHandler chain,
+                                   const char *module, const char *fmt,
+                                   va_list ap);
+static void tiff2png_tiff_error (const char *module, const char *fmt,
+                                 va_list ap);
+static void tiff2png_tiff_warning (const char *module, const char *fmt,
+                                   va_list ap);
+static void tiff2png_error_handler (png_structp png_ptr, png_const_charp msg);
+static void tiff2png_warning_handler (png_structp png_ptr,
+                                      png_const_charp msg);
+static double stats_wall (void);
+static double stats_cpu (void);
+static void stats_begin (tiff2png_context *ctx, stats_mark *mark);
+static void stats_end (tiff2png_context *ctx, stats_mark *mark);
+static void stats_start (tiff2png_context *ctx, stats_mark *mark);
+static void stats_stop (tiff2png_context *ctx, stats_mark *mark,
+                        double *wall, double *cpu);
+static void stats_worker (tiff2png_context *ctx, double cpu0, double *cpu);
+static void stats_mem (tiff2png_context *ctx, int64_t delta);
+static int size_mul (size_t a, size_t b, size_t *prod);
+static size_t mem_budget (tiff2png_context *ctx, size_t dflt, int share);
+static void *workq_worker (void *arg);
+static workq *workq_create (int nthreads);
+static void workq_submit (workq *wq, workq_job *job, void (*fn) (void *),
+                          void *arg);
+static void workq_wait (workq *wq, workq_job *job);
+static void workq_destroy (workq *wq);
+static idat_encoder *idat_encoder_create (png_structp png_ptr, workq *wq,
+                                          deflate_backend *backend,
+                                          png_uint_32 width, int bit_depth,
+                                          int color_type, int level);
+static int idat_zlib (idat_band *band, int level, int memlevel,
+                      int strategy, uch **zbuf, size_t *zsize);
+static int idat_backend_zlib (idat_band *band);
+static int idat_backend_exhaustive (idat_band *band);
+#ifdef HAVE_LIBDEFLATE
+static int idat_libdeflate (idat_band *band, int level, uch **zbuf,
+                            size_t *zsize);
+static int idat_backend_libdeflate (idat_band *band);
+#endif
+static void pack_row (png_bytep row, uch *out, png_uint_32 width,
+                      int bit_depth, size_t rowbytes);
+static void filter_row (int filters, int bpp, size_t n, uch *cur, uch *prev,
+                        uch **trial, uch *out);
+static void idat_write_row (idat_encoder *enc, png_bytep row);
+static void idat_encoder_finish (idat_encoder *enc);
+static void idat_encoder_destroy (idat_encoder *enc);
+static void tune_compression (png_bytep rows, png_uint_32 nrows,
+                              png_uint_32 width, int channels, int bit_depth,
+                              int color_type, int photometric, int level,
+                              int *filters, int *strategy);
+static void set_compression (png_structp png_ptr, idat_encoder *enc,
+                             int filters, int strategy);
+static tiff_map *tiff_map_create (char *tiffname);
+static tiff_map *tiff_map_fd (int fd);
+static tiff_map *tiff_map_stdin (size_t limit);
+static tiff_map *tiff_map_memory (const void *base, size_t size);
+static TIFF *tiff_map_open (char *tiffname, tiff_map *map);
+static void tiff_map_release (tiff_map *map);
+static void tiff_map_advise (tiff_map *map, int tiled);
+static void tiff_map_willneed (tiff_map *map, uint64_t offset,
+                               uint64_t count);
+static TIFF *tiff2png_reopen (char *tiffname, tiff_map *map, int page,
+                              int jpegcolormode, int sgilogdatafmt);
+static strile_reader *strile_reader_create (TIFF *tif, char *tiffname,
+                                            tiff_map *map, workq *wq,
+                                            int jpegcolormode,
+                                            int sgilogdatafmt,
+                                            png_uint_32 x, png_uint_32 y,
+                                            png_uint_32 w, png_uint_32 h,
+                                            size_t budget, size_t *need);
+static long strile_reader_band (strile_reader *sr, png_uint_32 row);
+static uch *strile_reader_row (strile_reader *sr, int row, int plane);
+static void strile_reader_destroy (strile_reader *sr);
+static void tiff2png_stop_workers (idat_encoder *enc, strile_reader *sr,
+                                   workq *wq);
+static row_store *row_store_create (png_uint_32 rows, size_t rowbytes,
+                                    size_t budget);
+static int row_store_put (row_store *rs, png_uint_32 row, png_byte *data);
+static png_byte *row_store_get (row_store *rs, png_uint_32 row,
+                                png_byte *buf);
+static void row_store_destroy (row_store *rs);
+static reduce_info *reduce_create (png_uint_32 width, int color_type,
+                                   int bit_depth);
+static void reduce_destroy (reduce_info *ri);
+static int reduce_slot (reduce_info *ri, png_uint_32 key);
+static png_uint_32 reduce_key (reduce_info *ri, png_bytep p);
+static void reduce_scan (reduce_info *ri, png_bytep row);
+static void reduce_decide (reduce_info *ri, png_color *palette, int *colors,
+                           png_byte *trans, int *ntrans);
+static size_t reduce_rowbytes (reduce_info *ri);
+static png_byte *reduce_row (reduce_info *ri, png_bytep row);
+static row_kernel row_kernel_lookup (int color_type, int spp, int bps,
+                                     int invert_first, int invert_rest,
+                                     int bigendian);
+static void swab16_init (void);
+static void unpack_init (void);
+static void unpack_row (int bps, uch *src, png_byte *dst, size_t nsamples,
+                        int scale, int inv_even, int inv_odd);
+static int fax_factor (double ratio);
+static void fax_init (void);
+static void fax_across (uch *src, png_byte *dst, png_uint_32 width, int n,
+                        int flip);
+static void fax_down (uch *src, png_byte *dst, png_uint_32 cols, int first,
+                      int flip);
+static void interleave_planes (uch **planes, uch *dst, png_uint_32 cols,
+                               int spp, int bps);
+static void swab16_row_c (uch *src, png_byte *dst, size_t nsamples,
+                          int x0, int x1);
+#ifdef SIMD_SSE2
+static void swab16_row_sse2 (uch *src, png_byte *dst, size_t nsamples,
+                             int x0, int x1);
+#endif
+#ifdef SIMD_AVX2
+static void swab16_row_avx2 (uch *src, png_byte *dst, size_t nsamples,
+                             int x0, int x1);
+#endif
+#ifdef SIMD_NEON
+static void swab16_row_neon (uch *src, png_byte *dst, size_t nsamples,
+                             int x0, int x1);
+#endif
+static TIFF *tiff2png_open (tiff2png_context *ctx, char *tiffname,
+                            tiff_map *map, int page);
+static FILE *tiff2png_create (tiff2png_context *ctx, char *pngname);
+static void tiff2png_png_write (png_structp png_ptr, png_bytep data,
+                                png_size_t length);
+static void tiff2png_png_flush (png_structp png_ptr);
+static uch *row_source_skip (row_source *src, uch *line, int plane);
+static uch *row_source_line (row_source *src, int row);
+static int row_source_read (row_source *src, int row);
+static char *thumb_name (char *pngname, int size);
+static thumb *thumbs_create (tiff2png_context *ctx, char *pngname,
+                             png_structp png_ptr, png_infop info_ptr,
+                             int *nthumbs);
+static void thumb_add (thumb *t, png_byte *row);
+static void thumb_finish (thumb *t);
+static void thumbs_destroy (thumb *thumbs, int nthumbs);
+static int tiff2png_run (tiff2png_context *ctx, TIFF *tif, tiff_map *map,
+                         char *tiffname, FILE *png, tiff2png_buffer *out,
+                         char *pngname);
+static int tiff2png_convert_file (tiff2png_context *ctx, char *tiffname,
+                                  char *pngname, int page, FILE *png);
+#ifdef HAVE_CACHE
+static void sha256_init (sha256 *s);
+static void sha256_block (sha256 *s, const uch *p);
+static void sha256_update (sha256 *s, const uch *data, size_t len);
+static void sha256_final (sha256 *s, char *hex);
+static char *cache_entry (tiff2png_context *ctx, char *tiffname, int page);
+static int cache_store (tiff2png_context *ctx, char *tiffname, int page,
+                        char *entry);
+static int cache_fetch (tiff2png_context *ctx, char *entry, char *pngname);
+static int cache_convert (tiff2png_context *ctx, char *tiffname,
+                          char *pngname, int page);
+#endif
+
+/* the -backend choices; the first is the default */
+
+static deflate_backend deflate_backends[] = {
+  { "zlib",		idat_backend_zlib },
+#ifdef HAVE_LIBDEFLATE
+  { "libdeflate",	idat_backend_libdeflate },
+#endif
+  { "exhaustive",	idat_backend_exhaustive },
+  { NULL,		NULL }
+};
+
+
+/*----------------------------------------------------------------------------*/
+
+/* done once, by the first context to be created */
+static void context_init ()
+{
+  pthread_key_create (&context_key, NULL);
+  tiff_error_chain = TIFFSetErrorHandler (tiff2png_tiff_error);
+  tiff_warning_chain = TIFFSetWarningHandler (tiff2png_tiff_warning);
+}
+
+/* makes ctx the current context of the calling thread; returns the one it
+ * had before, which the caller puts back when done */
+static tiff2png_context *context_enter (ctx)
+  tiff2png_context *ctx;
+{
+  tiff2png_context *prev;
+
+  prev = (tiff2png_context *) pthread_getspecific (context_key);
+  pthread_setspecific (context_key, ctx);
+  return prev;
+}
+
+/* passes a warning or error on to ctx's message function, or prints it.
+ * The first error of a conversion is kept for tiff2png_last_error(). */
+static void tiff2png_vmessage (ctx, level, fmt, ap)
+  tiff2png_context *ctx;
+  int level;
+  char *fmt;
+  va_list ap;
+{
+  char msg[ERROR_SIZE];
+
+  vsnprintf (msg, sizeof(msg), fmt, ap);
+  if (level == TIFF2PNG_ERROR && ctx->error[0] == '\0')
+    strcpy (ctx->error, msg);
+
+  if (ctx->message)
+    (*ctx->message) (ctx->message_arg, level, msg);
+  else
+  {
+    fprintf (stderr, "tiff2png %s:  %s\n",
+      level == TIFF2PNG_ERROR? "error" : "warning", msg);
+    fflush (stderr);
+  }
+}
+
+static void tiff2png_message (tiff2png_context *ctx, int level, char *fmt,
+                              ...)
+{
+  va_list ap;
+
+  va_start (ap, fmt);
+  tiff2png_vmessage (ctx, level, fmt, ap);
+  va_end (ap);
+}
+
+/* libtiff's messages go to the current context of the thread they come
+ * from; if it hasn't got one, the TIFF isn't ours */
+static void tiff2png_tiff_message (level, chain, module, fmt, ap)
+  int level;
+  TIFFErrorHandler chain;
+  const char *module, *fmt;
+  va_list ap;
+{
+  tiff2png_context *ctx;
+  char msg[ERROR_SIZE];
+
+  ctx = (tiff2png_context *) pthread_getspecific (context_key);
+  if (ctx == NULL)
+  {
+    if (chain)
+      (*chain) (module, fmt, ap);
+    return;
+  }
+
+  vsnprintf (msg, sizeof(msg), fmt, ap);
+  if (module)
+    tiff2png_message (ctx, level, "%s: %s", module, msg);
+  else
+    tiff2png_message (ctx, level, "%s", msg);
+}
+
+static void tiff2png_tiff_error (module, fmt, ap)
+  const char *module, *fmt;
+  va_list ap;
+{
+  tiff2png_tiff_message (TIFF2PNG_ERROR, tiff_error_chain, module, fmt, ap);
+}
+
+static void tiff2png_tiff_warning (module, fmt, ap)
+  const char *module, *fmt;
+  va_list ap;
+{
+  tiff2png_tiff_message (TIFF2PNG_WARNING, tiff_warning_chain, module, fmt,
+    ap);
+}
+
+static void tiff2png_error_handler (png_ptr, msg)
+  png_structp png_ptr;
+  png_const_charp msg;
+{
+  tiff2png_context *ctx;
+
+  /* this function, aside from the extra step of retrieving the "error
+   * pointer" (below) and the fact that it exists within the application
+   * rather than within libpng, is essentially identical to libpng's
+   * default error handler.  The second point is critical:  since both
+   * setjmp() and longjmp() are called from the same code, they are
+   * guaranteed to have compatible notions of how big a jmp_buf is,
+   * regardless of whether _BSD_SOURCE or anything else has (or has not)
+   * been defined. */
+
+  ctx = png_get_error_ptr (png_ptr);
+  if (ctx == NULL) {                /* we are completely hosed now */
+    fprintf (stderr, "tiff2png:  fatal libpng error: %s\n", msg);
+    fprintf (stderr,
+      "tiff2png:  EXTREMELY fatal error: jmpbuf unrecoverable; terminating.\n");
+    fflush (stderr);
+    exit (99);
+  }
+
+  tiff2png_message (ctx, TIFF2PNG_ERROR, "fatal libpng error: %s", msg);
+  longjmp (ctx->jmpbuf, 1);
+}
+
+static void tiff2png_warning_handler (png_ptr, msg)
+  png_structp png_ptr;
+  png_const_charp msg;
+{
+  tiff2png_message ((tiff2png_context *) png_get_error_ptr (png_ptr),
+    TIFF2PNG_WARNING, "libpng warning: %s", msg);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* monotonic wall-clock time and the calling thread's CPU time, in seconds;
+ * 0 where there's no such clock */
+static double stats_wall ()
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  return 0.0;
+}
+
+static double stats_cpu ()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  return 0.0;
+}
+
+/* clears the stats for a conversion starting on the calling thread */
+static void stats_begin (ctx, mark)
+  tiff2png_context *ctx;
+  stats_mark *mark;
+{
+  memset (mark, 0, sizeof(stats_mark));
+  memset (&ctx->stats, 0, sizeof(tiff2png_stats));
+  ctx->mem = 0;
+  ctx->thread = pthread_self ();
+  stats_start (ctx, mark);
+}
+
+/* totals up a conversion; its workers are done with it by now */
+static void stats_end (ctx, mark)
+  tiff2png_context *ctx;
+  stats_mark *mark;
+{
+  if (!ctx->opts.stats)
+    return;
+  ctx->stats.wall = stats_wall () - mark->wall;
+  ctx->stats.cpu += stats_cpu () - mark->cpu;
+}
+
+static void stats_start (ctx, mark)
+  tiff2png_context *ctx;
+  stats_mark *mark;
+{
+  if (!ctx->opts.stats)
+    return;
+  mark->wall = stats_wall ();
+  mark->cpu = stats_cpu ();
+  mark->output_wall = ctx->stats.output_wall;
+  mark->output_cpu = ctx->stats.output_cpu;
+}
+
+static void stats_stop (ctx, mark, wall, cpu)
+  tiff2png_context *ctx;
+  stats_mark *mark;
+  double *wall, *cpu;
+{
+  double w, c;
+
+  if (!ctx->opts.stats)
+    return;
+  w = stats_wall () - mark->wall;
+  c = stats_cpu () - mark->cpu;
+  *wall += w - (ctx->stats.output_wall - mark->output_wall);
+  pthread_mutex_lock (&ctx->stats_lock);
+  *cpu += c - (ctx->stats.output_cpu - mark->output_cpu);
+  pthread_mutex_unlock (&ctx->stats_lock);
+}
+
+/* a worker's CPU time since cpu0; the converting thread, when it does the
+ * work itself, has it counted by stats_stop() instead */
+static void stats_worker (ctx, cpu0, cpu)
+  tiff2png_context *ctx;
+  double cpu0;
+  double *cpu;
+{
+  double c;
+
+  if (!ctx->opts.stats || pthread_equal (pthread_self (), ctx->thread))
+    return;
+  c = stats_cpu () - cpu0;
+  pthread_mutex_lock (&ctx->stats_lock);
+  *cpu += c;
+  ctx->stats.cpu += c;
+  pthread_mutex_unlock (&ctx->stats_lock);
+}
+
+/* counts delta more (or fewer) bytes of image data held in buffers */
+static void stats_mem (ctx, delta)
+  tiff2png_context *ctx;
+  int64_t delta;
+{
+  if (!ctx->opts.stats)
+    return;
+  pthread_mutex_lock (&ctx->stats_lock);
+  ctx->mem += delta;
+  if (ctx->mem > ctx->stats.peak_memory)
+    ctx->stats.peak_memory = ctx->mem;
+  pthread_mutex_unlock (&ctx->stats_lock);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* sets *prod to a*b; returns FALSE if that doesn't fit in a size_t (as a
+ * band of a very wide TIFF may not on a 32-bit system) */
+static int size_mul (a, b, prod)
+  size_t a, b;
+  size_t *prod;
+{
+  if (b != 0 && a > (size_t)-1 / b)
+    return FALSE;
+  *prod = a * b;
+  return TRUE;
+}
+
+/* the bytes one kind of buffer may take:  dflt, what it gets anyway, or
+ * with -max-memory, no more than 1/share of that */
+static size_t mem_budget (ctx, dflt, share)
+  tiff2png_context *ctx;
+  size_t dflt;
+  int share;
+{
+  uint64_t budget = ctx->opts.max_memory / share;
+
+  if (ctx->opts.max_memory == 0 || budget >= dflt)
+    return dflt;
+  return (size_t)budget;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void *workq_worker (arg)
+  void *arg;
+{
+  workq *wq = (workq *)arg;
+  workq_job *job;
+
+  pthread_mutex_lock (&wq->lock);
+  for (;;)
+  {
+    while (wq->head == NULL && !wq->shutdown)
+      pthread_cond_wait (&wq->more, &wq->lock);
+    if (wq->head == NULL)	/* shutting down and nothing left to do */
+      break;
+
+    job = wq->head;
+    wq->head = job->next;
+    if (wq->head == NULL)
+      wq->tail = NULL;
+    pthread_mutex_unlock (&wq->lock);
+
+    job->fn (job->arg);
+
+    pthread_mutex_lock (&wq->lock);
+    job->done = TRUE;
+    pthread_cond_broadcast (&wq->finished);
+  }
+  pthread_mutex_unlock (&wq->lock);
+
+  return NULL;
+}
+
+static workq *workq_create (nthreads)
+  int nthreads;
+{
+  workq *wq;
+  int i;
+
+  wq = (workq *) calloc (1, sizeof(workq));
+  if (wq == NULL)
+    return NULL;
+  pthread_mutex_init (&wq->lock, NULL);
+  pthread_cond_init (&wq->more, NULL);
+  pthread_cond_init (&wq->finished, NULL);
+
+  if (nthreads > 0)
+  {
+    wq->threads = (pthread_t *) malloc (nthreads * sizeof(pthread_t));
+    if (wq->threads == NULL)
+      nthreads = 0;
+  }
+  for (i = 0; i < nthreads; i++)
+  {
+    if (pthread_create (&wq->threads[i], NULL, workq_worker, wq) != 0)
+      break;
+    wq->nthreads++;
+  }
+
+  return wq;
+}
+
+static void workq_submit (wq, job, fn, arg)
+  workq *wq;
+  workq_job *job;
+  void (*fn) (void *);
+  void *arg;
+{
+  job->fn = fn;
+  job->arg = arg;
+  job->done = FALSE;
+  job->next = NULL;
+
+  if (wq->nthreads == 0)	/* no workers:  just do it now */
+  {
+    fn (arg);
+    job->done = TRUE;
+    return;
+  }
+
+  pthread_mutex_lock (&wq->lock);
+  if (wq->tail)
+    wq->tail->next = job;
+  else
+    wq->head = job;
+  wq->tail = job;
+  pthread_cond_signal (&wq->more);
+  pthread_mutex_unlock (&wq->lock);
+}
+
+static void workq_wait (wq, job)
+  workq *wq;
+  workq_job *job;
+{
+  pthread_mutex_lock (&wq->lock);
+  while (!job->done)
+    pthread_cond_wait (&wq->finished, &wq->lock);
+  pthread_mutex_unlock (&wq->lock);
+}
+
+/* lets the workers drain the queue, then joins them and frees everything */
+static void workq_destroy (wq)
+  workq *wq;
+{
+  int i;
+
+  pthread_mutex_lock (&wq->lock);
+  wq->shutdown = TRUE;
+  pthread_cond_broadcast (&wq->more);
+  pthread_mutex_unlock (&wq->lock);
+
+  for (i = 0; i < wq->nthreads; i++)
+    pthread_join (wq->threads[i], NULL);
+
+  pthread_cond_destroy (&wq->finished);
+  pthread_cond_destroy (&wq->more);
+  pthread_mutex_destroy (&wq->lock);
+  free (wq->threads);
+  free (wq);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* The encoder takes rows in the same form png_write_row() does after
+ * png_set_packing() (one sample per byte below 8 bits), filters them on the
+ * calling thread, and queues each full band for deflating on the work queue.
+ * Errors are reported through png_error(), just as libpng itself would. */
+
+static idat_encoder *idat_encoder_create (png_ptr, wq, backend, width,
+                                          bit_depth, color_type, level)
+  png_structp png_ptr;
+  workq *wq;
+  deflate_backend *backend;
+  png_uint_32 width;
+  int bit_depth, color_type, level;
+{
+  idat_encoder *enc;
+  int channels, i;
+  size_t rows_per_band, budget;
+
+  enc = (idat_encoder *) calloc (1, sizeof(idat_encoder));
+  if (enc == NULL)
+    return NULL;
+
+  switch (color_type)
+  {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:	channels = 2;	break;
+    case PNG_COLOR_TYPE_RGB:		channels = 3;	break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:	channels = 4;	break;
+    default:				channels = 1;	break;
+  }
+
+  enc->ctx = (tiff2png_context *) png_get_error_ptr (png_ptr);
+  enc->png_ptr = png_ptr;
+  enc->wq = wq;
+  enc->backend = backend;
+  enc->width = width;
+  enc->bit_depth = bit_depth;
+  enc->level = (level == -1)? Z_DEFAULT_COMPRESSION : level;
+  if (backend->deflate_band == idat_backend_exhaustive)
+    enc->level = 9;	/* for the zlib header's level hint */
+  enc->rowbytes = ((size_t)width * channels * bit_depth + 7) >> 3;
+  enc->bpp = (channels * bit_depth + 7) >> 3;
+
+  /* same defaults as libpng:  no filtering for palette images and sub-byte
+   * depths (and the plain default strategy), adaptive filtering with
+   * Z_FILTERED otherwise; set_compression() may change them */
+  if (color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8)
+    enc->filters = PNG_FILTER_NONE;
+  else
+    enc->filters = PNG_ALL_FILTERS;
+  enc->strategy = (enc->filters != PNG_FILTER_NONE)? Z_FILTERED :
+    Z_DEFAULT_STRATEGY;
+
+  /* the bands in flight (and their deflated copies) take no more than a
+   * quarter of -max-memory:  fewer of them, and smaller */
+  budget = mem_budget (enc->ctx, (size_t)-1, 8);
+  rows_per_band = ((budget < IDAT_BAND_SIZE)? budget : IDAT_BAND_SIZE) /
+    (enc->rowbytes + 1);
+  if (rows_per_band == 0)
+    rows_per_band = 1;
+  enc->bandsize = rows_per_band * (enc->rowbytes + 1);
+
+  /* keep every worker busy, plus one band queued up behind each */
+  enc->maxinflight = (wq->nthreads > 0)? 2 * wq->nthreads : 1;
+  while (enc->maxinflight > 1 && enc->maxinflight * enc->bandsize > budget)
+    --enc->maxinflight;
+  enc->adler = adler32 (0L, Z_NULL, 0);
+
+  enc->prev = (uch *) calloc (enc->rowbytes, 1);
+  enc->cur = (uch *) calloc (enc->rowbytes, 1);
+  if (enc->prev == NULL || enc->cur == NULL)
+  {
+    idat_encoder_destroy (enc);
+    return NULL;
+  }
+  for (i = 0; i < 5; i++)
+  {
+    enc->trial[i] = (uch *) malloc (enc->rowbytes + 1);
+    if (enc->trial[i] == NULL)
+    {
+      idat_encoder_destroy (enc);
+      return NULL;
+    }
+  }
+
+  return enc;
+}
+
+static int idat_paeth (a, b, c)
+  int a, b, c;
+{
+  int p, pa, pb, pc;
+
+  p = a + b - c;
+  pa = abs(p - a);
+  pb = abs(p - b);
+  pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+/* filters the n packed bytes at cur (against prev, the row above) into out,
+ * filter byte first, trying each filter type in the filters mask in one of
+ * the trial rows; picks the filter with the smallest sum of absolute
+ * values, like libpng does */
+static void filter_row (filters, bpp, n, cur, prev, trial, out)
+  int filters, bpp;
+  size_t n;
+  uch *cur, *prev;
+  uch **trial;
+  uch *out;
+{
+  size_t i;
+  int type, best;
+  ulg sum, bestsum;
+  uch *t;
+
+  if (filters == PNG_FILTER_NONE)
+  {
+    out[0] = PNG_FILTER_VALUE_NONE;
+    memcpy (out+1, cur, n);
+    return;
+  }
+
+  if (filters & PNG_FILTER_NONE)
+  {
+    t = trial[PNG_FILTER_VALUE_NONE];
+    memcpy (t+1, cur, n);
+  }
+
+  if (filters & PNG_FILTER_SUB)
+  {
+    t = trial[PNG_FILTER_VALUE_SUB];
+    for (i = 0; i < (size_t)bpp && i < n; i++)
+      t[i+1] = cur[i];
+    for (; i < n; i++)
+      t[i+1] = cur[i] - cur[i-bpp];
+  }
+
+  if (filters & PNG_FILTER_UP)
+  {
+    t = trial[PNG_FILTER_VALUE_UP];
+    for (i = 0; i < n; i++)
+      t[i+1] = cur[i] - prev[i];
+  }
+
+  if (filters & PNG_FILTER_AVG)
+  {
+    t = trial[PNG_FILTER_VALUE_AVG];
+    for (i = 0; i < (size_t)bpp && i < n; i++)
+      t[i+1] = cur[i] - (prev[i] >> 1);
+    for (; i < n; i++)
+      t[i+1] = cur[i] - ((cur[i-bpp] + prev[i]) >> 1);
+  }
+
+  if (filters & PNG_FILTER_PAETH)
+  {
+    t = trial[PNG_FILTER_VALUE_PAETH];
+    for (i = 0; i < (size_t)bpp && i < n; i++)
+      t[i+1] = cur[i] - prev[i];
+    for (; i < n; i++)
+      t[i+1] = cur[i] - idat_paeth (cur[i-bpp], prev[i], prev[i-bpp]);
+  }
+
+  best = PNG_FILTER_VALUE_NONE;
+  bestsum = ~0UL;
+  for (type = PNG_FILTER_VALUE_NONE; type <= PNG_FILTER_VALUE_PAETH; type++)
+  {
+    if (!(filters & (PNG_FILTER_NONE << type)))
+      continue;
+    t = trial[type];
+    sum = 0;
+    for (i = 1; i <= n && sum < bestsum; i++)
+      sum += (t[i] < 128)? t[i] : 256 - t[i];
+    if (sum < bestsum)
+    {
+      bestsum = sum;
+      best = type;
+    }
+  }
+
+  memcpy (out+1, trial[best]+1, n);
+  out[0] = (uch)best;
+}
+
+/* worker:  turns one band of filtered rows into raw deflate data */
+static void idat_deflate_band (arg)
+  void *arg;
+{
+  idat_band *band = (idat_band *)arg;
+  tiff2png_context *ctx = band->enc->ctx;
+  double cpu0 = stats_cpu ();
+
+  band->adler = adler32 (adler32 (0L, Z_NULL, 0), band->data, band->size);
+  band->status = band->enc->backend->deflate_band (band);
+
+  free (band->data);	/* the next band already has its dictionary */
+  band->data = NULL;
+  stats_mem (ctx, (int64_t)(band->zbuf? band->zsize : 0) -
+    (int64_t)band->enc->bandsize);
+  stats_worker (ctx, cpu0, &ctx->stats.deflate_cpu);
+}
+
+/* deflates a band with zlib, primed with the end of the band before it and
+ * ending in a sync flush (or the final block), into a new *zbuf */
+static int idat_zlib (band, level, memlevel, strategy, zbuf, zsize)
+  idat_band *band;
+  int level, memlevel, strategy;
+  uch **zbuf;
+  size_t *zsize;
+{
+  z_stream z;
+  size_t bound;
+  int err, status;
+
+  memset (&z, 0, sizeof(z));
+  status = deflateInit2 (&z, level, Z_DEFLATED, -15, memlevel, strategy);
+  if (status != Z_OK)
+    return status;
+  if (band->dictsize)
+    deflateSetDictionary (&z, band->dict, band->dictsize);
+
+  /* room for the zlib header in front and the adler32 behind; the flush
+   * marker at the end of a non-final band needs a few bytes, too */
+  bound = deflateBound (&z, band->size) + 16;
+  *zbuf = (uch *) malloc (2 + bound + 4);
+  if (*zbuf == NULL)
+  {
+    deflateEnd (&z);
+    return Z_MEM_ERROR;
+  }
+
+  z.next_in = band->data;
+  z.avail_in = band->size;
+  z.next_out = *zbuf + 2;
+  z.avail_out = bound;
+  err = deflate (&z, band->last? Z_FINISH : Z_SYNC_FLUSH);
+  if (band->last)
+    status = (err == Z_STREAM_END)? Z_OK : Z_BUF_ERROR;
+  else
+    status = (err == Z_OK && z.avail_out > 0)? Z_OK : Z_BUF_ERROR;
+  *zsize = bound - z.avail_out;
+  deflateEnd (&z);
+
+  if (status != Z_OK)
+  {
+    free (*zbuf);
+    *zbuf = NULL;
+  }
+  return status;
+}
+
+static int idat_backend_zlib (band)
+  idat_band *band;
+{
+  return idat_zlib (band, band->enc->level, 8, band->enc->strategy,
+    &band->zbuf, &band->zsize);
+}
+
+/* for output that is written once and read many times:  tries zlib at its
+ * best with every strategy that could pay off (and libdeflate at its best,
+ * if it's there) and keeps the smallest result */
+static int idat_backend_exhaustive (band)
+  idat_band *band;
+{
+  static int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+  uch *zbuf;
+  size_t zsize;
+  int i, status;
+
+  for (i = 0; i < (int)(sizeof(strategies) / sizeof(strategies[0])); i++)
+  {
+    status = idat_zlib (band, 9, 9, strategies[i], &zbuf, &zsize);
+    if (status != Z_OK)
+      return status;
+    if (band->zbuf == NULL || zsize < band->zsize)
+    {
+      free (band->zbuf);
+      band->zbuf = zbuf;
+      band->zsize = zsize;
+    }
+    else
+      free (zbuf);
+  }
+
+#ifdef HAVE_LIBDEFLATE
+  /* libdeflate can't use the dictionary, but its level 12 often wins
+   * anyway; running out of memory for it is no reason to fail */
+  if (idat_libdeflate (band, 12, &zbuf, &zsize) == Z_OK)
+  {
+    if (zsize < band->zsize)
+    {
+      free (band->zbuf);
+      band->zbuf = zbuf;
+      band->zsize = zsize;
+    }
+    else
+      free (zbuf);
+  }
+#endif
+
+  return Z_OK;
+}
+
+#ifdef HAVE_LIBDEFLATE
+/* deflates a band with libdeflate into a new *zbuf.  libdeflate only makes
+ * complete streams, without a preset dictionary, so the band stands on its
+ * own, and all but the last one need their final block turned into an
+ * ordinary one:  the stream is inflated a block at a time (as zlib's
+ * gzjoin example does) to find the last block header, its BFINAL bit is
+ * cleared, and an empty stored block brings the end to a byte boundary. */
+static int idat_libdeflate (band, level, zbuf, zsize)
+  idat_band *band;
+  int level;
+  uch **zbuf;
+  size_t *zsize;
+{
+  struct libdeflate_compressor *c;
+  z_stream z;
+  uch junk[16384];
+  uch *p;
+  size_t bound, n, hdr, end;
+  int err;
+
+  c = libdeflate_alloc_compressor (level);
+  if (c == NULL)
+    return Z_MEM_ERROR;
+
+  /* room for the zlib header and adler32, plus the empty stored block */
+  bound = libdeflate_deflate_compress_bound (c, band->size);
+  *zbuf = (uch *) malloc (2 + bound + 5 + 4);
+  if (*zbuf == NULL)
+  {
+    libdeflate_free_compressor (c);
+    return Z_MEM_ERROR;
+  }
+  p = *zbuf + 2;
+  n = libdeflate_deflate_compress (c, band->data, band->size, p, bound);
+  libdeflate_free_compressor (c);
+  if (n == 0)
+  {
+    free (*zbuf);
+    *zbuf = NULL;
+    return Z_BUF_ERROR;
+  }
+
+  if (!band->last)
+  {
+    memset (&z, 0, sizeof(z));
+    if (inflateInit2 (&z, -15) != Z_OK)
+    {
+      free (*zbuf);
+      *zbuf = NULL;
+      return Z_MEM_ERROR;
+    }
+    z.next_in = p;
+    z.avail_in = n;
+    hdr = end = 0;
+    do
+    {
+      z.next_out = junk;
+      z.avail_out = sizeof(junk);
+      err = inflate (&z, Z_BLOCK);
+      if (err != Z_OK)
+        break;
+      if (z.data_type & 128)	/* at a block boundary */
+      {
+        if (z.data_type & 64)	/* ... after the last block */
+          end = (z.next_in - p) * 8 - (z.data_type & 7);
+        else
+          hdr = (z.next_in - p) * 8 - (z.data_type & 7);
+      }
+    } while (end == 0);
+    inflateEnd (&z);
+    if (end == 0)
+    {
+      free (*zbuf);
+      *zbuf = NULL;
+      return Z_DATA_ERROR;
+    }
+
+    p[hdr >> 3] &= ~(1 << (hdr & 7));
+    if (end & 7)
+      p[end >> 3] &= (1 << (end & 7)) - 1;
+    n = (end + 3 + 7) >> 3;	/* three zero bits:  stored, not final */
+    memset (p + ((end + 7) >> 3), 0, n - ((end + 7) >> 3));
+    p[n++] = 0x00;
+    p[n++] = 0x00;
+    p[n++] = 0xff;
+    p[n++] = 0xff;
+  }
+
+  *zsize = n;
+  return Z_OK;
+}
+
+static int idat_backend_libdeflate (band)
+  idat_band *band;
+{
+  return idat_libdeflate (band, (band->enc->level == Z_DEFAULT_COMPRESSION)?
+    6 : band->enc->level, &band->zbuf, &band->zsize);
+}
+#endif /* HAVE_LIBDEFLATE */
+
+static void idat_band_free (band)
+  idat_band *band;
+{
+  stats_mem (band->enc->ctx, -(int64_t)((band->data? band->enc->bandsize : 0) +
+    (band->zbuf? band->zsize : 0)));
+  free (band->data);
+  free (band->zbuf);
+  free (band);
+}
+
+/* waits for the oldest band in flight and writes it out as an IDAT chunk */
+static void idat_write_band (enc)
+  idat_encoder *enc;
+{
+  idat_band *band = enc->head;
+  uch *p;
+  size_t len;
+  int flevel;
+
+  workq_wait (enc->wq, &band->job);
+  enc->head = band->next;
+  if (enc->head == NULL)
+    enc->tail = NULL;
+  enc->inflight--;
+
+  if (band->status != Z_OK)
+  {
+    idat_band_free (band);
+    png_error (enc->png_ptr, "cannot deflate IDAT data");
+  }
+
+  p = band->zbuf + 2;
+  len = band->zsize;
+  if (!enc->wrote_header)
+  {
+    /* CMF:  deflate with a 32K window; FLG:  level hint plus check bits */
+    if (enc->level == Z_DEFAULT_COMPRESSION || enc->level == 6)
+      flevel = 2;
+    else if (enc->level < 2)
+      flevel = 0;
+    else if (enc->level < 6)
+      flevel = 1;
+    else
+      flevel = 3;
+    p -= 2;
+    len += 2;
+    p[0] = 0x78;
+    p[1] = (uch)(flevel << 6);
+    p[1] += 31 - ((p[0] << 8) + p[1]) % 31;
+    enc->wrote_header = TRUE;
+  }
+  enc->adler = adler32_combine (enc->adler, band->adler, (z_off_t)band->size);
+  if (band->last)
+  {
+    p[len++] = (uch)((enc->adler >> 24) & 0xff);
+    p[len++] = (uch)((enc->adler >> 16) & 0xff);
+    p[len++] = (uch)((enc->adler >> 8) & 0xff);
+    p[len++] = (uch)(enc->adler & 0xff);
+  }
+
+  enc->writing = band;	/* png_write_chunk() may longjmp away */
+  png_write_chunk (enc->png_ptr, (png_const_bytep)"IDAT", p, len);
+  enc->writing = NULL;
+  idat_band_free (band);
+}
+
+/* allocates an empty band, primed with the tail end of the previous one */
+static idat_band *idat_new_band (enc, prev)
+  idat_encoder *enc;
+  idat_band *prev;
+{
+  idat_band *band;
+
+  band = (idat_band *) calloc (1, sizeof(idat_band));
+  if (band != NULL)
+  {
+    band->data = (uch *) malloc (enc->bandsize);
+    if (band->data == NULL)
+    {
+      free (band);
+      band = NULL;
+    }
+  }
+  if (band == NULL)
+    png_error (enc->png_ptr, "cannot allocate memory for IDAT band");
+  stats_mem (enc->ctx, enc->bandsize);
+
+  band->enc = enc;
+  if (prev != NULL)
+  {
+    band->dictsize = (prev->size < IDAT_WINDOW)? prev->size : IDAT_WINDOW;
+    memcpy (band->dict, prev->data + prev->size - band->dictsize,
+      band->dictsize);
+  }
+
+  return band;
+}
+
+/* queues a full band for deflating, writing out older bands as needed to
+ * stay within the in-flight limit */
+static void idat_submit_band (enc, band, last)
+  idat_encoder *enc;
+  idat_band *band;
+  int last;
+{
+  band->last = last;
+  if (enc->tail)
+    enc->tail->next = band;
+  else
+    enc->head = band;
+  enc->tail = band;
+  enc->inflight++;
+  workq_submit (enc->wq, &band->job, idat_deflate_band, band);
+
+  while (enc->inflight > enc->maxinflight)
+    idat_write_band (enc);
+}
+
+/* packs sub-byte samples (one per byte in row) into out, as png_set_packing()
+ * would have; deeper rows are simply copied */
+static void pack_row (row, out, width, bit_depth, rowbytes)
+  png_bytep row;
+  uch *out;
+  png_uint_32 width;
+  int bit_depth;
+  size_t rowbytes;
+{
+  png_uint_32 i;
+  int shift;
+
+  if (bit_depth >= 8)
+  {
+    memcpy (out, row, rowbytes);
+    return;
+  }
+
+  memset (out, 0, rowbytes);
+  shift = 8 - bit_depth;
+  for (i = 0; i < width; i++)
+  {
+    *out |= (uch)(row[i] << shift);
+    if (shift == 0)
+    {
+      out++;
+      shift = 8 - bit_depth;
+    }
+    else
+      shift -= bit_depth;
+  }
+}
+
+static void idat_write_row (enc, row)
+  idat_encoder *enc;
+  png_bytep row;
+{
+  idat_band *band;
+  uch *t;
+
+  pack_row (row, enc->cur, enc->width, enc->bit_depth, enc->rowbytes);
+
+  band = enc->band;
+  if (band == NULL)
+    enc->band = idat_new_band (enc, NULL);
+  else if (band->size + enc->rowbytes + 1 > enc->bandsize)
+  {
+    enc->band = idat_new_band (enc, band);
+    idat_submit_band (enc, band, FALSE);
+  }
+  band = enc->band;
+
+  filter_row (enc->filters, enc->bpp, enc->rowbytes, enc->cur, enc->prev,
+    enc->trial, band->data + band->size);
+  band->size += enc->rowbytes + 1;
+
+  t = enc->prev;
+  enc->prev = enc->cur;
+  enc->cur = t;
+}
+
+/* writes whatever is left of the image data, then the IEND chunk */
+static void idat_encoder_finish (enc)
+  idat_encoder *enc;
+{
+  idat_band *band = enc->band;
+
+  if (band != NULL)
+  {
+    enc->band = NULL;
+    idat_submit_band (enc, band, TRUE);
+  }
+  while (enc->head != NULL)
+    idat_write_band (enc);
+
+  png_write_chunk (enc->png_ptr, (png_const_bytep)"IEND", NULL, 0);
+}
+
+/* safe to call at any point, including after a libpng error */
+static void idat_encoder_destroy (enc)
+  idat_encoder *enc;
+{
+  idat_band *band;
+  int i;
+
+  while ((band = enc->head) != NULL)
+  {
+    workq_wait (enc->wq, &band->job);
+    enc->head = band->next;
+    idat_band_free (band);
+  }
+  if (enc->band != NULL)
+    idat_band_free (enc->band);
+  if (enc->writing != NULL)
+    idat_band_free (enc->writing);
+
+  for (i = 0; i < 5; i++)
+    free (enc->trial[i]);
+  free (enc->prev);
+  free (enc->cur);
+  free (enc);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* looks up a -filter setting:  "auto", or a comma-separated list of filter
+ * names; returns the PNG_FILTER_* mask, TIFF2PNG_AUTO, or 0 if it makes no
+ * sense */
+int tiff2png_parse_filters (arg)
+  char *arg;
+{
+  named_value *nv;
+  int filters = 0;
+  size_t len;
+
+  if (strcmp (arg, "auto") == 0)
+    return TIFF2PNG_AUTO;
+
+  while (*arg)
+  {
+    len = strcspn (arg, ",");
+    for (nv = filter_names; nv->name; nv++)
+      if (strlen (nv->name) == len && strncmp (arg, nv->name, len) == 0)
+        break;
+    if (nv->name == NULL)
+      return 0;
+    filters |= nv->value;
+    arg += len;
+    if (*arg == ',')
+      arg++;
+  }
+
+  return filters;
+}
+
+/* reads a -sizes setting:  a comma-separated list of longest sides in
+ * pixels, or "full"; fills in sizes (0 for full size) and returns how many
+ * there are, or 0 if it makes no sense */
+int tiff2png_parse_sizes (arg, sizes)
+  char *arg;
+  int *sizes;
+{
+  int n = 0;
+  size_t len;
+  char *end;
+
+  while (*arg)
+  {
+    if (n == TIFF2PNG_MAX_SIZES)
+      return 0;
+    len = strcspn (arg, ",");
+    if (len == 4 && strncmp (arg, "full", 4) == 0)
+      sizes[n] = 0;
+    else
+    {
+      sizes[n] = (int)strtol (arg, &end, 10);
+      if (end != arg + len || sizes[n] <= 0)
+        return 0;
+    }
+    n++;
+    arg += len;
+    if (*arg == ',')
+      arg++;
+  }
+
+  return n;
+}
+
+/* looks up a -strategy setting; returns the zlib strategy, TIFF2PNG_AUTO,
+ * or TIFF2PNG_DEFAULT if there is no such thing */
+int tiff2png_parse_strategy (arg)
+  char *arg;
+{
+  named_value *nv;
+
+  if (strcmp (arg, "auto") == 0)
+    return TIFF2PNG_AUTO;
+
+  for (nv = strategy_names; nv->name; nv++)
+    if (strcmp (arg, nv->name) == 0)
+      return nv->value;
+
+  return TIFF2PNG_DEFAULT;
+}
+
+/* settles -filter auto and -strategy auto for one image.  The photometric
+ * interpretation and bit depth narrow down the candidates (Paeth rarely
+ * beats Up on packed pixels or palette indices; photographic data always
+ * wants a real predictor and gets nothing out of run-length matching), then
+ * each remaining filter set and strategy is tried on the first nrows
+ * converted rows, and the cheapest candidate whose output is within
+ * TUNE_SLACK of the smallest one wins.  Settings that weren't auto are
+ * left alone, but are taken into account. */
+static void tune_compression (rows, nrows, width, channels, bit_depth,
+                              color_type, photometric, level,
+                              filters, strategy)
+  png_bytep rows;
+  png_uint_32 nrows, width;
+  int channels, bit_depth, color_type, photometric, level;
+  int *filters, *strategy;
+{
+  /* cheapest first */
+  static int all_filter_sets[] = {
+    PNG_FILTER_NONE, PNG_FILTER_UP, PNG_FILTER_PAETH, PNG_ALL_FILTERS
+  };
+  static int all_strategies[] = { Z_RLE, Z_FILTERED, Z_DEFAULT_STRATEGY };
+  int filter_sets[4], strategies[3];
+  int nfilter_sets = 0, nstrategies = 0;
+  int packed, photo, bpp, f, k, fs, st, best_f, best_k, err, ok;
+  size_t srcbytes, rowbytes, n;
+  ulg size[4][3], smallest;
+  uch *filtered, *zbuf, *trial[5], *prev, *cur, *t;
+  png_uint_32 row;
+  z_stream z;
+
+  packed = (color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8);
+  photo = (photometric == PHOTOMETRIC_YCBCR ||
+           photometric == PHOTOMETRIC_CIELAB ||
+           photometric == PHOTOMETRIC_LOGL ||
+           photometric == PHOTOMETRIC_LOGLUV ||
+           bit_depth == 16);
+
+  if (*filters != TIFF2PNG_AUTO)
+    filter_sets[nfilter_sets++] = (*filters == TIFF2PNG_DEFAULT)?
+      (packed? PNG_FILTER_NONE : PNG_ALL_FILTERS) : *filters;
+  else
+    for (f = 0; f < 4; f++)
+      if (!(packed && all_filter_sets[f] == PNG_FILTER_PAETH) &&
+          !(photo && (all_filter_sets[f] == PNG_FILTER_NONE ||
+                      all_filter_sets[f] == PNG_FILTER_UP)))
+        filter_sets[nfilter_sets++] = all_filter_sets[f];
+
+  if (*strategy != TIFF2PNG_AUTO)
+    strategies[nstrategies++] = *strategy;	/* may be TIFF2PNG_DEFAULT */
+  else
+    for (k = 0; k < 3; k++)
+      if (!(photo && all_strategies[k] == Z_RLE))
+        strategies[nstrategies++] = all_strategies[k];
+
+  if (nfilter_sets * nstrategies == 1)
+  {
+    *filters = filter_sets[0];
+    *strategy = strategies[0];
+    return;
+  }
+
+  srcbytes = (size_t)width * channels * (bit_depth == 16? 2 : 1);
+  rowbytes = ((size_t)width * channels * bit_depth + 7) >> 3;
+  bpp = (channels * bit_depth + 7) >> 3;
+  filtered = (uch *) malloc (nrows * (rowbytes + 1));
+  zbuf = (uch *) malloc (16384);
+  prev = (uch *) calloc (rowbytes, 1);
+  cur = (uch *) malloc (rowbytes);
+  for (f = 0; f < 5; f++)
+    trial[f] = (uch *) malloc (rowbytes + 1);
+  ok = (filtered && zbuf && prev && cur &&
+        trial[0] && trial[1] && trial[2] && trial[3] && trial[4]);
+
+  /* running out of memory here is not worth failing the conversion over:
+   * with no sizes, the first (cheapest) candidates are picked */
+  for (f = 0; f < nfilter_sets; f++)
+    for (k = 0; k < nstrategies; k++)
+      size[f][k] = ~0UL;
+
+  for (f = 0; ok && f < nfilter_sets; f++)
+  {
+    fs = filter_sets[f];
+    memset (prev, 0, rowbytes);
+    for (row = 0; row < nrows; row++)
+    {
+      pack_row (rows + row * srcbytes, cur, width, bit_depth, rowbytes);
+      filter_row (fs, bpp, rowbytes, cur, prev, trial,
+                  filtered + row * (rowbytes + 1));
+      t = prev;
+      prev = cur;
+      cur = t;
+    }
+
+    for (k = 0; k < nstrategies; k++)
+    {
+      st = strategies[k];
+      if (st == TIFF2PNG_DEFAULT)
+        st = (fs != PNG_FILTER_NONE)? Z_FILTERED : Z_DEFAULT_STRATEGY;
+
+      memset (&z, 0, sizeof(z));
+      if (deflateInit2 (&z, (level == -1)? Z_DEFAULT_COMPRESSION : level,
+                        Z_DEFLATED, 15, 8, st) != Z_OK)
+        continue;
+      z.next_in = filtered;
+      z.avail_in = nrows * (rowbytes + 1);
+      n = 0;
+      do
+      {
+        z.next_out = zbuf;
+        z.avail_out = 16384;
+        err = deflate (&z, Z_FINISH);
+        n += 16384 - z.avail_out;
+      } while (err == Z_OK);
+      if (err == Z_STREAM_END)
+        size[f][k] = n;
+      deflateEnd (&z);
+    }
+  }
+
+  smallest = ~0UL;
+  for (f = 0; f < nfilter_sets; f++)
+    for (k = 0; k < nstrategies; k++)
+      if (size[f][k] < smallest)
+        smallest = size[f][k];
+
+  /* the first candidate within the slack:  filter sets first, since
+   * trying more filters costs more than a slower strategy */
+  best_f = best_k = 0;
+  for (f = 0; f < nfilter_sets; f++)
+  {
+    for (k = 0; k < nstrategies; k++)
+      if (size[f][k] != ~0UL &&
+          size[f][k] - smallest <= smallest / 1000 * TUNE_SLACK)
+        break;
+    if (k < nstrategies)
+    {
+      best_f = f;
+      best_k = k;
+      break;
+    }
+  }
+
+  *filters = filter_sets[best_f];
+  *strategy = strategies[best_k];
+
+  for (f = 0; f < 5; f++)
+    free (trial[f]);
+  free (cur);
+  free (prev);
+  free (zbuf);
+  free (filtered);
+}
+
+/* hands the filter set and zlib strategy to whichever of libpng and the IDAT
+ * encoder compresses the image; TIFF2PNG_DEFAULT leaves libpng's choice
+ * alone */
+static void set_compression (png_ptr, enc, filters, strategy)
+  png_structp png_ptr;
+  idat_encoder *enc;
+  int filters, strategy;
+{
+  if (filters >= 0)
+  {
+    png_set_filter (png_ptr, PNG_FILTER_TYPE_BASE, filters);
+    if (enc)
+    {
+      enc->filters = filters;
+      enc->strategy = (filters != PNG_FILTER_NONE)? Z_FILTERED :
+        Z_DEFAULT_STRATEGY;
+    }
+  }
+  if (strategy >= 0)
+  {
+    png_set_compression_strategy (png_ptr, strategy);
+    if (enc)
+      enc->strategy = strategy;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* samples of less than 8 bits are unpacked a whole byte at a time through
+ * lookup tables, indexed by bit depth, scaling to 8 bits, inversion of the
+ * even and of the odd samples (a byte always starts on an even sample) and
+ * the packed byte itself; 4-bit samples are also done 16 bytes at a time
+ * with SSE2 or NEON.  The tables are filled in by unpack_init(). */
+
+static uch unpack_lut[3][2][4][256][8];
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+
+static void unpack_init ()
+{
+  int depth, bps, maxval, scale, inv, b, k, v;
+
+  for (depth = 0; depth < 3; depth++)
+  {
+    bps = 1 << depth;
+    maxval = (1 << bps) - 1;
+    for (scale = 0; scale < 2; scale++)
+      for (inv = 0; inv < 4; inv++)
+        for (b = 0; b < 256; b++)
+          for (k = 0; k < 8 / bps; k++)
+          {
+            v = (b >> (8 - bps * (k + 1))) & maxval;
+            if (inv & ((k & 1)? 1 : 2))
+              v ^= maxval;
+            if (scale)
+              v *= 255 / maxval;
+            unpack_lut[depth][scale][inv][b][k] = (uch)v;
+          }
+  }
+}
+
+static void unpack_row (bps, src, dst, nsamples, scale, inv_even, inv_odd)
+  int bps;
+  uch *src;
+  png_byte *dst;
+  size_t nsamples;
+  int scale, inv_even, inv_odd;
+{
+  uch (*lut)[8];
+  size_t n = nsamples;
+
+  lut = unpack_lut[(bps == 1)? 0 : (bps == 2)? 1 : 2][scale? 1 : 0]
+    [(inv_even? 2 : 0) + (inv_odd? 1 : 0)];
+
+  switch (bps)
+  {
+    case 1:
+      for (; n >= 8; n -= 8, dst += 8)
+        memcpy (dst, lut[*src++], 8);
+      break;
+
+    case 2:
+      for (; n >= 4; n -= 4, dst += 4)
+        memcpy (dst, lut[*src++], 4);
+      break;
+
+    case 4:
+#if defined(SIMD_SSE2) || defined(SIMD_NEON)
+    {
+      uch xe = inv_even? 0x0f : 0, xo = inv_odd? 0x0f : 0;
+#  ifdef SIMD_SSE2
+      __m128i v, hi, lo, nib = _mm_set1_epi8 (0x0f);
+      __m128i me = _mm_set1_epi8 (xe), mo = _mm_set1_epi8 (xo);
+
+      for (; n >= 32; n -= 32, src += 16, dst += 32)
+      {
+        v = _mm_loadu_si128 ((const __m128i *)src);
+        hi = _mm_xor_si128 (_mm_and_si128 (_mm_srli_epi16 (v, 4), nib), me);
+        lo = _mm_xor_si128 (_mm_and_si128 (v, nib), mo);
+        if (scale)	/* times 17; nibbles don't carry into the next byte */
+        {
+          hi = _mm_or_si128 (hi, _mm_slli_epi16 (hi, 4));
+          lo = _mm_or_si128 (lo, _mm_slli_epi16 (lo, 4));
+        }
+        _mm_storeu_si128 ((__m128i *)dst, _mm_unpacklo_epi8 (hi, lo));
+        _mm_storeu_si128 ((__m128i *)(dst + 16), _mm_unpackhi_epi8 (hi, lo));
+      }
+#  else
+      uint8x16_t v, hi, lo;
+      uint8x16x2_t out;
+      uint8x16_t me = vdupq_n_u8 (xe), mo = vdupq_n_u8 (xo);
+
+      for (; n >= 32; n -= 32, src += 16, dst += 32)
+      {
+        v = vld1q_u8 (src);
+        hi = veorq_u8 (vshrq_n_u8 (v, 4), me);
+        lo = veorq_u8 (vandq_u8 (v, vdupq_n_u8 (0x0f)), mo);
+        if (scale)
+        {
+          hi = vorrq_u8 (hi, vshlq_n_u8 (hi, 4));
+          lo = vorrq_u8 (lo, vshlq_n_u8 (lo, 4));
+        }
+        out.val[0] = hi;
+        out.val[1] = lo;
+        vst2q_u8 (dst, out);
+      }
+#  endif
+    }
+#endif
+      for (; n >= 2; n -= 2, dst += 2)
+        memcpy (dst, lut[*src++], 2);
+      break;
+  }
+
+  /* the last few samples of a byte */
+  if (n > 0)
+    memcpy (dst, lut[*src], n);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* -faxpect squares up the pixels of a B&W image whose resolution is some
+ * whole n times (2 to FAX_MAX) higher across than down, or down than
+ * across, by counting the white pixels in each run of n across, or in each
+ * column of n rows, as one of n+1 grays.  The counts are made straight from
+ * the packed TIFF bytes:  across, fax_hsum has the 8/n counts in a byte for
+ * the n that divide 8 (and fax_count those of any n bits); down, fax_spread
+ * gives each pixel of a byte a byte of its own, so that n rows are added up
+ * 8 pixels at a time in a 64-bit word.  The tables are filled in by
+ * fax_init(). */
+
+#define FAX_MAX 8
+
+static uch fax_count[256];
+static uch fax_hsum[3][256][4];		/* for n = 2, 4 and 8 */
+static uint64_t fax_spread[256];
+static pthread_once_t fax_once = PTHREAD_ONCE_INIT;
+
+/* the n that ratio is within 5% of, or 0 */
+static int fax_factor (ratio)
+  double ratio;
+{
+  int n = (int)(ratio + 0.5);
+
+  if (n < 2 || n > FAX_MAX || ratio < 0.95 * n || ratio > 1.05 * n)
+    return 0;
+  return n;
+}
+
+static void fax_init ()
+{
+  int b, k, n, i;
+  uch bytes[8];
+
+  for (b = 0; b < 256; b++)
+  {
+    for (k = 0; k < 8; k++)
+    {
+      bytes[k] = (b >> (7 - k)) & 1;
+      fax_count[b] += bytes[k];
+    }
+    memcpy (&fax_spread[b], bytes, 8);	/* in memory order either way */
+    for (i = 0, n = 2; i < 3; i++, n <<= 1)
+      for (k = 0; k < 8 / n; k++)
+        fax_hsum[i][b][k] =
+          fax_count[(b >> (8 - n * (k + 1))) & ((1 << n) - 1)];
+  }
+}
+
+/* counts each run of n pixels of src, of which there are width, into dst;
+ * flip is 0xff if a 1 bit is black */
+static void fax_across (src, dst, width, n, flip)
+  uch *src;
+  png_byte *dst;
+  png_uint_32 width;
+  int n, flip;
+{
+  uch (*lut)[4];
+  png_uint_32 col = width;
+  ulg bits = 0;
+  int k, have = 0;
+
+  if (8 % n == 0)
+  {
+    lut = fax_hsum[(n == 2)? 0 : (n == 4)? 1 : 2];
+    k = 8 / n;
+    for (; col >= (png_uint_32)k; col -= k, dst += k)
+      memcpy (dst, lut[*src++ ^ flip], k);
+    if (col > 0)
+      memcpy (dst, lut[*src ^ flip], col);
+  }
+  else	/* runs straddle the bytes */
+  {
+    for (; col > 0; --col)
+    {
+      if (have < n)
+      {
+        bits = (bits << 8) | (*src++ ^ flip);
+        have += 8;
+      }
+      have -= n;
+      *dst++ = fax_count[(bits >> have) & ((1 << n) - 1)];
+      bits &= (1UL << have) - 1;
+    }
+  }
+}
+
+/* adds the cols pixels of src into the counts at dst, or starts them over
+ * if first; dst must have room for cols rounded up to a multiple of 8 */
+static void fax_down (src, dst, cols, first, flip)
+  uch *src;
+  png_byte *dst;
+  png_uint_32 cols;
+  int first, flip;
+{
+  uint64_t sum;
+  png_uint_32 n;
+
+  for (n = (cols + 7) >> 3; n > 0; --n, dst += 8)
+  {
+    if (first)
+      memcpy (dst, &fax_spread[*src++ ^ flip], 8);
+    else
+    {
+      memcpy (&sum, dst, 8);
+      sum += fax_spread[*src++ ^ flip];
+      memcpy (dst, &sum, 8);
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* merges one scanline of each of spp separated planes into a contiguous
+ * scanline.  8- and 16-bit samples are moved whole (with SSE2 for 2 and 4
+ * planes, NEON for 2 to 4), smaller ones a bit field at a time. */
+
+static void interleave_planes (planes, dst, cols, spp, bps)
+  uch **planes;
+  uch *dst;
+  png_uint_32 cols;
+  int spp, bps;
+{
+  png_uint_32 n = 0;
+  int s, size;
+
+  if (bps != 8 && bps != 16)
+  {
+    png_uint_32 k, nsamples = cols * spp;
+    int bit;
+
+    memset (dst, 0, (nsamples * bps + 7) / 8);
+    for (s = 0; s < spp; s++)
+    {
+      for (n = 0, k = s; n < cols; n++, k += spp)
+      {
+        bit = 8 - bps - (n * bps) % 8;
+        dst[k * bps / 8] |=
+          ((planes[s][n * bps / 8] >> bit) & ((1 << bps) - 1)) <<
+          (8 - bps - (k * bps) % 8);
+      }
+    }
+    return;
+  }
+
+  size = bps / 8;
+
+#ifdef SIMD_SSE2
+  if (spp == 2 || spp == 4)
+  {
+    __m128i a, b, c, d, ab0, ab1, cd0, cd1;
+
+    for (; n + 16 / size <= cols; n += 16 / size, dst += 16 * spp)
+    {
+      a = _mm_loadu_si128 ((const __m128i *)(planes[0] + n * size));
+      b = _mm_loadu_si128 ((const __m128i *)(planes[1] + n * size));
+      if (size == 1)
+      {
+        ab0 = _mm_unpacklo_epi8 (a, b);
+        ab1 = _mm_unpackhi_epi8 (a, b);
+      }
+      else
+      {
+        ab0 = _mm_unpacklo_epi16 (a, b);
+        ab1 = _mm_unpackhi_epi16 (a, b);
+      }
+      if (spp == 2)
+      {
+        _mm_storeu_si128 ((__m128i *)dst, ab0);
+        _mm_storeu_si128 ((__m128i *)(dst + 16), ab1);
+        continue;
+      }
+      c = _mm_loadu_si128 ((const __m128i *)(planes[2] + n * size));
+      d = _mm_loadu_si128 ((const __m128i *)(planes[3] + n * size));
+      if (size == 1)
+      {
+        cd0 = _mm_unpacklo_epi8 (c, d);
+        cd1 = _mm_unpackhi_epi8 (c, d);
+        _mm_storeu_si128 ((__m128i *)dst, _mm_unpacklo_epi16 (ab0, cd0));
+        _mm_storeu_si128 ((__m128i *)(dst + 16), _mm_unpackhi_epi16 (ab0, cd0));
+        _mm_storeu_si128 ((__m128i *)(dst + 32), _mm_unpacklo_epi16 (ab1, cd1));
+        _mm_storeu_si128 ((__m128i *)(dst + 48), _mm_unpackhi_epi16 (ab1, cd1));
+      }
+      else
+      {
+        cd0 = _mm_unpacklo_epi16 (c, d);
+        cd1 = _mm_unpackhi_epi16 (c, d);
+        _mm_storeu_si128 ((__m128i *)dst, _mm_unpacklo_epi32 (ab0, cd0));
+        _mm_storeu_si128 ((__m128i *)(dst + 16), _mm_unpackhi_epi32 (ab0, cd0));
+        _mm_storeu_si128 ((__m128i *)(dst + 32), _mm_unpacklo_epi32 (ab1, cd1));
+        _mm_storeu_si128 ((__m128i *)(dst + 48), _mm_unpackhi_epi32 (ab1, cd1));
+      }
+    }
+  }
+#endif
+
+#ifdef SIMD_NEON
+  if (size == 1 && spp >= 2)
+  {
+    uint8x16x2_t v2;
+    uint8x16x3_t v3;
+    uint8x16x4_t v4;
+
+    for (; n + 16 <= cols; n += 16, dst += 16 * spp)
+    {
+      switch (spp)
+      {
+        case 2:
+          v2.val[0] = vld1q_u8 (planes[0] + n);
+          v2.val[1] = vld1q_u8 (planes[1] + n);
+          vst2q_u8 (dst, v2);
+          break;
+        case 3:
+          v3.val[0] = vld1q_u8 (planes[0] + n);
+          v3.val[1] = vld1q_u8 (planes[1] + n);
+          v3.val[2] = vld1q_u8 (planes[2] + n);
+          vst3q_u8 (dst, v3);
+          break;
+        default:
+          v4.val[0] = vld1q_u8 (planes[0] + n);
+          v4.val[1] = vld1q_u8 (planes[1] + n);
+          v4.val[2] = vld1q_u8 (planes[2] + n);
+          v4.val[3] = vld1q_u8 (planes[3] + n);
+          vst4q_u8 (dst, v4);
+          break;
+      }
+    }
+  }
+  else if (spp >= 2)	/* 16-bit rows are whole samples into malloc()ed bands */
+  {
+    uint16x8x2_t v2;
+    uint16x8x3_t v3;
+    uint16x8x4_t v4;
+    const uint16_t *p0 = (const uint16_t *)planes[0];
+    const uint16_t *p1 = (const uint16_t *)planes[1];
+    const uint16_t *p2 = (const uint16_t *)planes[spp > 2? 2 : 0];
+    const uint16_t *p3 = (const uint16_t *)planes[spp > 3? 3 : 0];
+
+    for (; n + 8 <= cols; n += 8, dst += 16 * spp)
+    {
+      switch (spp)
+      {
+        case 2:
+          v2.val[0] = vld1q_u16 (p0 + n);
+          v2.val[1] = vld1q_u16 (p1 + n);
+          vst2q_u16 ((uint16_t *)dst, v2);
+          break;
+        case 3:
+          v3.val[0] = vld1q_u16 (p0 + n);
+          v3.val[1] = vld1q_u16 (p1 + n);
+          v3.val[2] = vld1q_u16 (p2 + n);
+          vst3q_u16 ((uint16_t *)dst, v3);
+          break;
+        default:
+          v4.val[0] = vld1q_u16 (p0 + n);
+          v4.val[1] = vld1q_u16 (p1 + n);
+          v4.val[2] = vld1q_u16 (p2 + n);
+          v4.val[3] = vld1q_u16 (p3 + n);
+          vst4q_u16 ((uint16_t *)dst, v4);
+          break;
+      }
+    }
+  }
+#endif
+
+  for (; n < cols; n++)
+  {
+    for (s = 0; s < spp; s++)
+    {
+      *dst++ = planes[s][n * size];
+      if (size == 2)
+        *dst++ = planes[s][n * size + 1];
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* row conversion kernels:  one function per sample layout, bit depth,
+ * inversion of the first sample (gray, for -invert and MINISWHITE) and of
+ * the others (alpha or color, for -invert) and host byte order, each
+ * generated from the same body with all of those as constants, so that
+ * the per-sample decisions are made by the compiler rather than in the
+ * inner loop.  The kernel for an image is picked once with
+ * row_kernel_lookup().
+ *
+ * Samples of less than 8 bits come out one per byte, scaled to 8 bits for
+ * gray+alpha and RGB(A) (for which PNG has no smaller depths) and left as
+ * they are for gray and palette images.  16-bit samples are in host order
+ * in the TIFF row and in network order in the PNG row.  Inverting a sample
+ * is the same as subtracting it from maxval, so both -invert and
+ * MINISWHITE are an exclusive-or, and the two together cancel out. */
+
+#define ROW_KERNEL(name, spp, bps, scale, inv0, inv1, swap) \
+static void name (src, dst, cols) \
+  uch *src; \
+  png_byte *dst; \
+  png_uint_32 cols; \
+{ \
+  png_uint_32 n; \
+  int i, bitsleft = 8; \
+  uch x; \
+ \
+  if ((bps) < 8 && ((spp) <= 2 || (inv0) == (inv1))) \
+  { \
+    unpack_row ((bps), src, dst, (size_t)cols * (spp), (scale), (inv0), \
+      ((spp) == 2)? (inv1) : (inv0)); \
+    return; \
+  } \
+ \
+  for (n = cols; n > 0; --n) \
+  { \
+    for (i = 0; i < (spp); i++) \
+    { \
+      x = ((i == 0)? (inv0) : (inv1))? \
+        (((bps) >= 8)? 0xff : (1 << (bps)) - 1) : 0; \
+      if ((bps) == 16) \
+      { \
+        dst[0] = src[swap] ^ x; \
+        dst[1] = src[1 - (swap)] ^ x; \
+        src += 2; \
+        dst += 2; \
+      } \
+      else if ((bps) == 8) \
+        *dst++ = *src++ ^ x; \
+      else \
+      { \
+        bitsleft -= (bps); \
+        *dst++ = (((*src >> bitsleft) & ((1 << (bps)) - 1)) ^ x) * \
+          ((scale)? 255 / ((1 << (bps)) - 1) : 1); \
+        if (bitsleft == 0) \
+        { \
+          src++; \
+          bitsleft = 8; \
+        } \
+      } \
+    } \
+  } \
+}
+
+#define ROW_KERNELS(layout, spp, scale, bps) \
+  ROW_KERNEL (row_##layout##_##bps##_000, spp, bps, scale, 0, 0, 0) \
+  ROW_KERNEL (row_##layout##_##bps##_001, spp, bps, scale, 0, 0, 1) \
+  ROW_KERNEL (row_##layout##_##bps##_010, spp, bps, scale, 0, 1, 0) \
+  ROW_KERNEL (row_##layout##_##bps##_011, spp, bps, scale, 0, 1, 1) \
+  ROW_KERNEL (row_##layout##_##bps##_100, spp, bps, scale, 1, 0, 0) \
+  ROW_KERNEL (row_##layout##_##bps##_101, spp, bps, scale, 1, 0, 1) \
+  ROW_KERNEL (row_##layout##_##bps##_110, spp, bps, scale, 1, 1, 0) \
+  ROW_KERNEL (row_##layout##_##bps##_111, spp, bps, scale, 1, 1, 1)
+
+#define ROW_KERNEL_LAYOUT(layout, spp, scale) \
+  ROW_KERNELS (layout, spp, scale, 1) \
+  ROW_KERNELS (layout, spp, scale, 2) \
+  ROW_KERNELS (layout, spp, scale, 4) \
+  ROW_KERNELS (layout, spp, scale, 8) \
+  ROW_KERNELS (layout, spp, scale, 16)
+
+ROW_KERNEL_LAYOUT (gray, 1, 0)		/* also palette */
+ROW_KERNEL_LAYOUT (ga, 2, 1)
+ROW_KERNEL_LAYOUT (rgb, 3, 1)
+ROW_KERNEL_LAYOUT (rgba, 4, 1)
+
+#define ROW_KERNEL_ENTRY(layout, bps) \
+  { row_##layout##_##bps##_000, row_##layout##_##bps##_001, \
+    row_##layout##_##bps##_010, row_##layout##_##bps##_011, \
+    row_##layout##_##bps##_100, row_##layout##_##bps##_101, \
+    row_##layout##_##bps##_110, row_##layout##_##bps##_111 }
+
+#define ROW_KERNEL_TABLE(layout) \
+  { ROW_KERNEL_ENTRY (layout, 1), ROW_KERNEL_ENTRY (layout, 2), \
+    ROW_KERNEL_ENTRY (layout, 4), ROW_KERNEL_ENTRY (layout, 8), \
+    ROW_KERNEL_ENTRY (layout, 16) }
+
+/* indexed by layout, bit depth and (first, rest, swap) as three bits */
+static const row_kernel row_kernels[4][5][8] = {
+  ROW_KERNEL_TABLE (gray),
+  ROW_KERNEL_TABLE (ga),
+  ROW_KERNEL_TABLE (rgb),
+  ROW_KERNEL_TABLE (rgba)
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* 16-bit samples on little-endian hosts:  the whole row is byte-swapped and
+ * inverted at once, x0 being exclusive-ored into the even samples and x1
+ * into the odd ones (which only differ for MINISWHITE gray+alpha).  The
+ * fastest version the CPU can run is picked by swab16_init(). */
+
+static void (*swab16_row) (uch *src, png_byte *dst, size_t nsamples,
+                           int x0, int x1);
+static const char *swab16_name;
+static pthread_once_t swab16_once = PTHREAD_ONCE_INIT;
+
+static void swab16_row_c (src, dst, nsamples, x0, x1)
+  uch *src;
+  png_byte *dst;
+  size_t nsamples;
+  int x0, x1;
+{
+  size_t n;
+
+  for (n = 0; n + 1 < nsamples; n += 2, src += 4, dst += 4)
+  {
+    dst[0] = src[1] ^ x0;
+    dst[1] = src[0] ^ x0;
+    dst[2] = src[3] ^ x1;
+    dst[3] = src[2] ^ x1;
+  }
+  if (n < nsamples)
+  {
+    dst[0] = src[1] ^ x0;
+    dst[1] = src[0] ^ x0;
+  }
+}
+
+#ifdef SIMD_SSE2
+static void swab16_row_sse2 (src, dst, nsamples, x0, x1)
+  uch *src;
+  png_byte *dst;
+  size_t nsamples;
+  int x0, x1;
+{
+  size_t n;
+  __m128i v, mask;
+
+  mask = _mm_set1_epi32 ((int)(x0 | (x0 << 8) | (x1 << 16) | ((ulg)x1 << 24)));
+  for (n = 0; n + 8 <= nsamples; n += 8, src += 16, dst += 16)
+  {
+    v = _mm_loadu_si128 ((const __m128i *)src);
+    v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+    _mm_storeu_si128 ((__m128i *)dst, _mm_xor_si128 (v, mask));
+  }
+  swab16_row_c (src, dst, nsamples - n, x0, x1);
+}
+#endif
+
+#ifdef SIMD_AVX2
+__attribute__((target("avx2")))
+static void swab16_row_avx2 (src, dst, nsamples, x0, x1)
+  uch *src;
+  png_byte *dst;
+  size_t nsamples;
+  int x0, x1;
+{
+  size_t n;
+  __m256i v, mask, swap;
+
+  mask = _mm256_set1_epi32 ((int)(x0 | (x0 << 8) | (x1 << 16) |
+    ((ulg)x1 << 24)));
+  swap = _mm256_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12,
+    15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  for (n = 0; n + 16 <= nsamples; n += 16, src += 32, dst += 32)
+  {
+    v = _mm256_loadu_si256 ((const __m256i *)src);
+    v = _mm256_shuffle_epi8 (v, swap);
+    _mm256_storeu_si256 ((__m256i *)dst, _mm256_xor_si256 (v, mask));
+  }
+  swab16_row_c (src, dst, nsamples - n, x0, x1);
+}
+#endif
+
+#ifdef SIMD_NEON
+static void swab16_row_neon (src, dst, nsamples, x0, x1)
+  uch *src;
+  png_byte *dst;
+  size_t nsamples;
+  int x0, x1;
+{
+  size_t n;
+  uint8x16_t v, mask;
+
+  mask = vreinterpretq_u8_u32 (vdupq_n_u32 ((uint32_t)(x0 | (x0 << 8) |
+    (x1 << 16) | ((ulg)x1 << 24))));
+  for (n = 0; n + 8 <= nsamples; n += 8, src += 16, dst += 16)
+  {
+    v = vrev16q_u8 (vld1q_u8 (src));
+    vst1q_u8 (dst, veorq_u8 (v, mask));
+  }
+  swab16_row_c (src, dst, nsamples - n, x0, x1);
+}
+#endif
+
+static void swab16_init ()
+{
+  swab16_row = swab16_row_c;
+  swab16_name = "C";
+#ifdef SIMD_SSE2
+  swab16_row = swab16_row_sse2;
+  swab16_name = "SSE2";
+#endif
+#ifdef SIMD_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+  {
+    swab16_row = swab16_row_avx2;
+    swab16_name = "AVX2";
+  }
+#endif
+#ifdef SIMD_NEON
+  swab16_row = swab16_row_neon;
+  swab16_name = "NEON";
+#endif
+}
+
+/* the masks are stored little-endian, so for spp == 2 x0 lands on the gray
+ * sample and x1 on alpha; other layouts never invert samples differently */
+#define ROW16_KERNEL(name, spp, inv0, inv1) \
+static void name (src, dst, cols) \
+  uch *src; \
+  png_byte *dst; \
+  png_uint_32 cols; \
+{ \
+  (*swab16_row) (src, dst, (size_t)cols * (spp), (inv0)? 0xff : 0, \
+    (((spp) == 2)? (inv1) : (inv0))? 0xff : 0); \
+}
+
+#define ROW16_KERNELS(layout, spp) \
+  ROW16_KERNEL (row16_##layout##_00, spp, 0, 0) \
+  ROW16_KERNEL (row16_##layout##_01, spp, 0, 1) \
+  ROW16_KERNEL (row16_##layout##_10, spp, 1, 0) \
+  ROW16_KERNEL (row16_##layout##_11, spp, 1, 1)
+
+ROW16_KERNELS (gray, 1)
+ROW16_KERNELS (ga, 2)
+ROW16_KERNELS (rgb, 3)
+ROW16_KERNELS (rgba, 4)
+
+#define ROW16_KERNEL_TABLE(layout) \
+  { { row16_##layout##_00, row16_##layout##_01 }, \
+    { row16_##layout##_10, row16_##layout##_11 } }
+
+static const row_kernel row16_kernels[4][2][2] = {
+  ROW16_KERNEL_TABLE (gray),
+  ROW16_KERNEL_TABLE (ga),
+  ROW16_KERNEL_TABLE (rgb),
+  ROW16_KERNEL_TABLE (rgba)
+};
+
+/* returns the kernel for a color type, or NULL if there is none (such as
+ * for extra samples beyond alpha, or odd bit depths) */
+static row_kernel row_kernel_lookup (color_type, spp, bps, invert_first,
+                                     invert_rest, bigendian)
+  int color_type, spp, bps;
+  int invert_first, invert_rest;
+  int bigendian;
+{
+  int layout, depth;
+
+  switch (color_type)
+  {
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_PALETTE:
+      layout = (spp == 1)? 0 : -1;
+      break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+      layout = (spp == 2)? 1 : -1;
+      break;
+    case PNG_COLOR_TYPE_RGB:
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+      layout = (spp == 3)? 2 : (spp == 4)? 3 : -1;
+      break;
+    default:
+      layout = -1;
+      break;
+  }
+
+  switch (bps)
+  {
+    case 1:  depth = 0;  break;
+    case 2:  depth = 1;  break;
+    case 4:  depth = 2;  break;
+    case 8:  depth = 3;  break;
+    case 16: depth = 4;  break;
+    default: depth = -1; break;
+  }
+
+  if (layout < 0 || depth < 0)
+    return NULL;
+
+  if (bps < 8)
+    pthread_once (&unpack_once, unpack_init);
+
+  /* whole-row byte swapping needs the same inversion for every sample but
+   * alpha, which is all that gray and gray+alpha can have anyway */
+  if (bps == 16 && !bigendian && (layout <= 1 || !invert_first == !invert_rest))
+  {
+    pthread_once (&swab16_once, swab16_init);
+    return row16_kernels[layout][invert_first? 1 : 0][invert_rest? 1 : 0];
+  }
+
+  return row_kernels[layout][depth][(invert_first? 4 : 0) +
+    (invert_rest? 2 : 0) + (bigendian? 0 : 1)];
+}
+
+/*----------------------------------------------------------------------------*/
+
+static row_store *row_store_create (rows, rowbytes, budget)
+  png_uint_32 rows;
+  size_t rowbytes;
+  size_t budget;
+{
+  row_store *rs;
+
+  rs = (row_store *) calloc (1, sizeof(row_store));
+  if (rs == NULL)
+    return NULL;
+  rs->rowbytes = rowbytes;
+
+  if (rowbytes > 0 && rows <= budget / rowbytes)
+    rs->mem = (uch *) malloc ((size_t)rows * rowbytes);
+  if (rs->mem == NULL)
+    rs->spill = tmpfile ();
+  if (rs->mem == NULL && rs->spill == NULL)
+  {
+    free (rs);
+    return NULL;
+  }
+
+  return rs;
+}
+
+/* rows are stored in order, so the spill file is written sequentially */
+static int row_store_put (rs, row, data)
+  row_store *rs;
+  png_uint_32 row;
+  png_byte *data;
+{
+  if (rs->mem)
+  {
+    memcpy (rs->mem + (size_t)row * rs->rowbytes, data, rs->rowbytes);
+    return TRUE;
+  }
+  return fwrite (data, 1, rs->rowbytes, rs->spill) == rs->rowbytes;
+}
+
+/* returns the stored row, read into buf if it has to come from the spill
+ * file, or NULL on a read error */
+static png_byte *row_store_get (rs, row, buf)
+  row_store *rs;
+  png_uint_32 row;
+  png_byte *buf;
+{
+  if (rs->mem)
+    return rs->mem + (size_t)row * rs->rowbytes;
+
+#ifdef HAVE_MMAP	/* POSIX, whose off_t can be wider than a long */
+  if (fseeko (rs->spill, (off_t)row * (off_t)rs->rowbytes, SEEK_SET) != 0)
+    return NULL;
+#else
+  if (fseek (rs->spill, (long)row * (long)rs->rowbytes, SEEK_SET) != 0)
+    return NULL;
+#endif
+  if (fread (buf, 1, rs->rowbytes, rs->spill) != rs->rowbytes)
+    return NULL;
+  return buf;
+}
+
+static void row_store_destroy (rs)
+  row_store *rs;
+{
+  free (rs->mem);
+  if (rs->spill)
+    fclose (rs->spill);
+  free (rs);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* -reduce:  looks over the converted rows of a gray, gray+alpha, RGB or RGBA
+ * image of 8 or 16 bits for what it doesn't need:  16-bit samples whose two
+ * bytes are the same (which 8-bit samples scale back to exactly), alpha that
+ * is all opaque, color that is all gray, gray levels that fit in 1, 2 or 4
+ * bits, and more than 256 colors. */
+
+static reduce_info *reduce_create (width, color_type, bit_depth)
+  png_uint_32 width;
+  int color_type, bit_depth;
+{
+  reduce_info *ri;
+
+  ri = (reduce_info *) calloc (1, sizeof(reduce_info));
+  if (ri == NULL)
+    return NULL;
+  ri->out = (png_byte *) malloc ((size_t)width * 8);
+  if (ri->out == NULL)
+  {
+    free (ri);
+    return NULL;
+  }
+  ri->width = width;
+  ri->color_type = color_type;
+  ri->bit_depth = bit_depth;
+  switch (color_type)
+  {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:	ri->channels = 2;	break;
+    case PNG_COLOR_TYPE_RGB:		ri->channels = 3;	break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:	ri->channels = 4;	break;
+    default:				ri->channels = 1;	break;
+  }
+  ri->to8 = (bit_depth == 16);
+  ri->opaque = (color_type & PNG_COLOR_MASK_ALPHA) != 0;
+  ri->gray = (color_type & PNG_COLOR_MASK_COLOR) != 0;
+  ri->fits1 = ri->fits2 = ri->fits4 = TRUE;
+  memset (ri->index, 0xff, sizeof(ri->index));	/* all slots empty (-1) */
+  ri->last_index = -1;
+
+  return ri;
+}
+
+static void reduce_destroy (ri)
+  reduce_info *ri;
+{
+  free (ri->out);
+  free (ri);
+}
+
+/* the slot of key in the color table:  its own, or the empty one it goes
+ * in */
+static int reduce_slot (ri, key)
+  reduce_info *ri;
+  png_uint_32 key;
+{
+  int h = (int)((key * 2654435761U) >> (32 - REDUCE_HASH_BITS));
+
+  while (ri->index[h] >= 0 && ri->keys[h] != key)
+    h = (h + 1) & ((1 << REDUCE_HASH_BITS) - 1);
+  return h;
+}
+
+/* a pixel as 0xRRGGBBAA, from the high bytes of 16-bit samples */
+static png_uint_32 reduce_key (ri, p)
+  reduce_info *ri;
+  png_bytep p;
+{
+  int step = ri->bit_depth / 8;
+
+  switch (ri->channels)
+  {
+    case 1:
+      return ((png_uint_32)p[0] * 0x01010100) | 0xff;
+    case 2:
+      return ((png_uint_32)p[0] * 0x01010100) | p[step];
+    case 3:
+      return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[step] << 16) |
+        ((png_uint_32)p[2*step] << 8) | 0xff;
+    default:
+      return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[step] << 16) |
+        ((png_uint_32)p[2*step] << 8) | p[3*step];
+  }
+}
+
+static void reduce_scan (ri, row)
+  reduce_info *ri;
+  png_bytep row;
+{
+  int step = ri->bit_depth / 8;
+  int pixbytes = ri->channels * step;
+  int color = (ri->color_type & PNG_COLOR_MASK_COLOR) != 0;
+  png_bytep p, a;
+  png_uint_32 x, key;
+  int i, h;
+
+  if (!ri->to8 && !ri->opaque && !ri->gray && ri->ncolors > 256 &&
+      !((!color || ri->gray) && (ri->fits1 || ri->fits2 || ri->fits4)))
+    return;	/* nothing left to find out */
+
+  for (x = 0, p = row; x < ri->width; x++, p += pixbytes)
+  {
+    if (ri->to8)
+      for (i = 0; i < pixbytes; i += 2)
+        if (p[i] != p[i+1])
+          ri->to8 = FALSE;
+    if (ri->opaque)
+    {
+      a = p + pixbytes - step;
+      if (a[0] != 0xff || a[step - 1] != 0xff)
+        ri->opaque = FALSE;
+    }
+    if (ri->gray && (memcmp (p, p + step, step) != 0 ||
+                     memcmp (p, p + 2*step, step) != 0))
+      ri->gray = FALSE;
+    if (ri->fits4)
+    {
+      ri->fits1 = ri->fits1 && (p[0] % 255 == 0);
+      ri->fits2 = ri->fits2 && (p[0] % 85 == 0);
+      ri->fits4 = p[0] % 17 == 0;
+    }
+
+    if (ri->ncolors <= 256 && (step == 1 || ri->to8))
+    {
+      key = reduce_key (ri, p);
+      if (key == ri->last_key && ri->last_index >= 0)
+        continue;
+      h = reduce_slot (ri, key);
+      if (ri->index[h] < 0)
+      {
+        if (ri->ncolors == 256)
+        {
+          ri->ncolors++;	/* too many for a palette */
+          continue;
+        }
+        ri->keys[h] = key;
+        ri->index[h] = ri->ncolors;
+        ri->colors[ri->ncolors++] = key;
+      }
+      ri->last_key = key;
+      ri->last_index = ri->index[h];
+    }
+  }
+}
+
+/* settles on the smallest PNG type that holds the image as it is, filling
+ * in palette[], trans[] and their sizes for a palette image; sets
+ * out_type and out_depth */
+static void reduce_decide (ri, palette, colors, trans, ntrans)
+  reduce_info *ri;
+  png_color *palette;
+  int *colors;
+  png_byte *trans;
+  int *ntrans;
+{
+  int color = (ri->color_type & PNG_COLOR_MASK_COLOR) != 0;
+  int alpha = (ri->color_type & PNG_COLOR_MASK_ALPHA) && !ri->opaque;
+  int gray = !color || ri->gray;
+  int depth = (ri->bit_depth == 16 && ri->to8)? 8 : ri->bit_depth;
+  int pdepth, gdepth;
+  short map[256];
+  png_uint_32 key;
+  int i, n, h;
+
+  gdepth = depth;
+  if (gray && !alpha && depth == 8)
+    gdepth = ri->fits1? 1 : ri->fits2? 2 : ri->fits4? 4 : 8;
+  pdepth = (ri->ncolors <= 2)? 1 : (ri->ncolors <= 4)? 2 :
+    (ri->ncolors <= 16)? 4 : 8;
+
+  ri->keep_alpha = alpha;
+  ri->out_depth = depth;
+  if (depth == 8 && ri->ncolors <= 256 && (!gray || alpha || pdepth < gdepth))
+  {
+    ri->out_type = PNG_COLOR_TYPE_PALETTE;
+    ri->out_depth = pdepth;
+
+    /* entries with alpha come first, so tRNS can stop after the last */
+    n = 0;
+    for (i = 0; i < ri->ncolors; i++)
+      if ((ri->colors[i] & 0xff) != 0xff)
+        map[i] = n++;
+    *ntrans = n;
+    for (i = 0; i < ri->ncolors; i++)
+      if ((ri->colors[i] & 0xff) == 0xff)
+        map[i] = n++;
+    for (i = 0; i < ri->ncolors; i++)
+    {
+      key = ri->colors[i];
+      palette[map[i]].red = (png_byte)(key >> 24);
+      palette[map[i]].green = (png_byte)(key >> 16);
+      palette[map[i]].blue = (png_byte)(key >> 8);
+      trans[map[i]] = (png_byte)key;
+    }
+    for (h = 0; h < (1 << REDUCE_HASH_BITS); h++)
+      if (ri->index[h] >= 0)
+        ri->index[h] = map[ri->index[h]];
+    *colors = ri->ncolors;
+    ri->last_index = -1;
+  }
+  else if (gray)
+  {
+    ri->out_type = alpha? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY;
+    ri->out_depth = gdepth;
+  }
+  else
+    ri->out_type = alpha? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+}
+
+/* the bytes of a row as reduce_decide() decided, in ri->out */
+static size_t reduce_rowbytes (ri)
+  reduce_info *ri;
+{
+  int channels;
+
+  switch (ri->out_type)
+  {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:	channels = 2;	break;
+    case PNG_COLOR_TYPE_RGB:		channels = 3;	break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:	channels = 4;	break;
+    default:				channels = 1;	break;
+  }
+  return (size_t)ri->width * channels * (ri->out_depth == 16? 2 : 1);
+}
+
+/* turns a row that has been looked over into the type decided on, in
+ * ri->out, which it returns */
+static png_byte *reduce_row (ri, row)
+  reduce_info *ri;
+  png_bytep row;
+{
+  int step = ri->bit_depth / 8;
+  int pixbytes = ri->channels * step;
+  int gray = (ri->out_type & PNG_COLOR_MASK_COLOR) == 0;
+  int nbytes = (ri->out_depth == 16)? 2 : 1;
+  int scale = (ri->out_depth < 8)? 255 / ((1 << ri->out_depth) - 1) : 1;
+  png_bytep p, q;
+  png_uint_32 x, key;
+
+  q = ri->out;
+  for (x = 0, p = row; x < ri->width; x++, p += pixbytes)
+  {
+    if (ri->out_type == PNG_COLOR_TYPE_PALETTE)
+    {
+      key = reduce_key (ri, p);
+      if (key != ri->last_key || ri->last_index < 0)
+      {
+        ri->last_key = key;
+        ri->last_index = ri->index[reduce_slot (ri, key)];
+      }
+      *q++ = (png_byte)ri->last_index;
+      continue;
+    }
+    if (scale > 1)
+    {
+      *q++ = p[0] / scale;
+      continue;
+    }
+    memcpy (q, p, nbytes);
+    q += nbytes;
+    if (!gray)
+    {
+      memcpy (q, p + step, nbytes);
+      memcpy (q + nbytes, p + 2*step, nbytes);
+      q += 2 * nbytes;
+    }
+    if (ri->keep_alpha)
+    {
+      memcpy (q, p + pixbytes - step, nbytes);
+      q += nbytes;
+    }
+  }
+
+  return ri->out;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* libtiff client procedures for a handle on a mapped file */
+
+static tmsize_t tiff_map_read (fd, buf, size)
+  thandle_t fd;
+  void *buf;
+  tmsize_t size;
+{
+  tiff_map_handle *mh = (tiff_map_handle *)fd;
+  tiff_map *map = mh->map;
+
+  if (mh->pos >= map->size)
+    return 0;
+  if ((toff_t)size > map->size - mh->pos)
+    size = map->size - mh->pos;
+  memcpy (buf, map->base + mh->pos, size);
+  mh->pos += size;
+  return size;
+}
+
+static tmsize_t tiff_map_write (fd, buf, size)
+  thandle_t fd;
+  void *buf;
+  tmsize_t size;
+{
+  return -1;	/* read-only */
+}
+
+static toff_t tiff_map_seek (fd, off, whence)
+  thandle_t fd;
+  toff_t off;
+  int whence;
+{
+  tiff_map_handle *mh = (tiff_map_handle *)fd;
+
+  switch (whence)
+  {
+    case SEEK_SET:	mh->pos = off;				break;
+    case SEEK_CUR:	mh->pos += off;				break;
+    case SEEK_END:	mh->pos = mh->map->size + off;		break;
+  }
+  return mh->pos;
+}
+
+static int tiff_map_close (fd)
+  thandle_t fd;
+{
+  tiff_map_handle *mh = (tiff_map_handle *)fd;
+
+  tiff_map_release (mh->map);
+  free (mh);
+  return 0;
+}
+
+static toff_t tiff_map_size (fd)
+  thandle_t fd;
+{
+  return ((tiff_map_handle *)fd)->map->size;
+}
+
+/* lets libtiff decode straight from the mapping */
+static int tiff_map_map (fd, base, size)
+  thandle_t fd;
+  void **base;
+  toff_t *size;
+{
+  tiff_map *map = ((tiff_map_handle *)fd)->map;
+
+  *base = map->base;
+  *size = map->size;
+  return 1;
+}
+
+static void tiff_map_unmap (fd, base, size)
+  thandle_t fd;
+  void *base;
+  toff_t size;
+{
+  /* the mapping is shared; tiff_map_release() gets rid of it */
+}
+
+/* maps a TIFF file; returns NULL if it can't be (or there is no mmap()), in
+ * which case the file should just be opened normally.  The caller holds the
+ * first reference. */
+static tiff_map *tiff_map_create (tiffname)
+  char *tiffname;
+{
+#ifdef HAVE_MMAP
+  int fd;
+
+  fd = open (tiffname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  return tiff_map_fd (fd);
+#else
+  return NULL;
+#endif
+}
+
+/* maps the file open on fd, which is closed if that fails */
+static tiff_map *tiff_map_fd (fd)
+  int fd;
+{
+#ifdef HAVE_MMAP
+  tiff_map *map;
+  struct stat st;
+  void *base;
+
+  if (fstat (fd, &st) != 0 || st.st_size == 0 ||
+      (off_t)(size_t)st.st_size != st.st_size)
+  {
+    close (fd);
+    return NULL;
+  }
+  base = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    close (fd);
+    return NULL;
+  }
+
+  map = (tiff_map *) calloc (1, sizeof(tiff_map));
+  if (map == NULL)
+  {
+    munmap (base, (size_t)st.st_size);
+    close (fd);
+    return NULL;
+  }
+  pthread_mutex_init (&map->lock, NULL);
+  map->refs = 1;
+  map->fd = fd;
+  map->base = (uch *)base;
+  map->size = (size_t)st.st_size;
+
+  return map;
+#else
+  return NULL;
+#endif
+}
+
+/* reads a TIFF from stdin:  a regular file redirected to it is mapped in
+ * place; anything else (a pipe) has to be read to the end, since the IFDs
+ * may be anywhere in it.  Up to limit bytes of it are kept in memory, and
+ * a bigger one goes to an anonymous temporary file that is mapped once
+ * complete.  Returns NULL if stdin can't be read. */
+static tiff_map *tiff_map_stdin (limit)
+  size_t limit;
+{
+  tiff_map *map;
+  uch *buf, *p;
+  size_t size = 0, alloc = 65536, n;
+#ifdef HAVE_MMAP
+  FILE *spill = NULL;
+  struct stat st;
+  int fd;
+
+  if (fstat (0, &st) == 0 && S_ISREG (st.st_mode) &&
+      lseek (0, 0, SEEK_CUR) == 0 && (fd = dup (0)) >= 0)
+  {
+    map = tiff_map_fd (fd);
+    if (map)
+      return map;
+  }
+#endif
+
+  buf = (uch *) malloc (alloc);
+  if (buf == NULL)
+    return NULL;
+  while ((n = fread (buf + size, 1, alloc - size, stdin)) > 0)
+  {
+    size += n;
+    if (size < alloc)
+      continue;
+#ifdef HAVE_MMAP
+    if (spill == NULL && alloc < limit)
+#endif
+    {
+      p = (uch *) realloc (buf, alloc * 2);
+      if (p == NULL)
+      {
+        free (buf);
+        return NULL;
+      }
+      buf = p;
+      alloc *= 2;
+      continue;
+    }
+#ifdef HAVE_MMAP
+    /* too big for memory:  the rest goes through buf to the spill file */
+    if ((spill == NULL && (spill = tmpfile ()) == NULL) ||
+        fwrite (buf, 1, size, spill) != size)
+    {
+      if (spill)
+        fclose (spill);
+      free (buf);
+      return NULL;
+    }
+    size = 0;
+#endif
+  }
+  if (ferror (stdin))
+  {
+#ifdef HAVE_MMAP
+    if (spill)
+      fclose (spill);
+#endif
+    free (buf);
+    return NULL;
+  }
+
+#ifdef HAVE_MMAP
+  if (spill)
+  {
+    /* the mapping keeps the (already unlinked) file alive on its own fd */
+    fd = -1;
+    if (fwrite (buf, 1, size, spill) == size && fflush (spill) == 0)
+      fd = dup (fileno (spill));
+    fclose (spill);
+    free (buf);
+    return fd < 0? NULL : tiff_map_fd (fd);
+  }
+#endif
+
+  map = (tiff_map *) calloc (1, sizeof(tiff_map));
+  if (map == NULL)
+  {
+    free (buf);
+    return NULL;
+  }
+  pthread_mutex_init (&map->lock, NULL);
+  map->refs = 1;
+  map->fd = -1;
+  map->own = TRUE;
+  map->base = buf;
+  map->size = size;
+
+  return map;
+}
+
+/* wraps a TIFF in the caller's memory, which has to stay put until the last
+ * handle on it is closed */
+static tiff_map *tiff_map_memory (base, size)
+  const void *base;
+  size_t size;
+{
+  tiff_map *map;
+
+  map = (tiff_map *) calloc (1, sizeof(tiff_map));
+  if (map == NULL)
+    return NULL;
+  pthread_mutex_init (&map->lock, NULL);
+  map->refs = 1;
+  map->fd = -1;
+  map->own = FALSE;
+  map->base = (uch *)base;
+  map->size = size;
+
+  return map;
+}
+
+/* opens a new TIFF handle on the mapping, which it holds a reference to */
+static TIFF *tiff_map_open (tiffname, map)
+  char *tiffname;
+  tiff_map *map;
+{
+  tiff_map_handle *mh;
+  TIFF *tif;
+
+  mh = (tiff_map_handle *) calloc (1, sizeof(tiff_map_handle));
+  if (mh == NULL)
+    return NULL;
+  mh->map = map;
+  pthread_mutex_lock (&map->lock);
+  map->refs++;
+  pthread_mutex_unlock (&map->lock);
+
+  tif = TIFFClientOpen (tiffname, "r", (thandle_t)mh, tiff_map_read,
+    tiff_map_write, tiff_map_seek, tiff_map_close, tiff_map_size,
+    tiff_map_map, tiff_map_unmap);
+  if (tif == NULL)	/* libtiff doesn't close what it couldn't open */
+    tiff_map_close ((thandle_t)mh);
+
+  return tif;
+}
+
+static void tiff_map_release (map)
+  tiff_map *map;
+{
+  int refs;
+
+  pthread_mutex_lock (&map->lock);
+  refs = --map->refs;
+  pthread_mutex_unlock (&map->lock);
+  if (refs > 0)
+    return;
+
+  if (map->fd < 0)
+  {
+    if (map->own)
+      free (map->base);
+  }
+#ifdef HAVE_MMAP
+  else
+  {
+    munmap (map->base, map->size);
+    close (map->fd);
+  }
+#endif
+  pthread_mutex_destroy (&map->lock);
+  free (map);
+}
+
+/* tells the kernel how the image data will be read:  strips from front to
+ * back, tiles a row at a time (see tiff_map_willneed()) */
+static void tiff_map_advise (map, tiled)
+  tiff_map *map;
+  int tiled;
+{
+#ifdef HAVE_MMAP
+  if (tiled || map->fd < 0)
+    return;
+  (void) madvise (map->base, map->size, MADV_SEQUENTIAL);
+#  ifdef POSIX_FADV_SEQUENTIAL
+  (void) posix_fadvise (map->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#  endif
+#endif
+}
+
+/* asks for the pages holding count bytes at offset to be read in */
+static void tiff_map_willneed (map, offset, count)
+  tiff_map *map;
+  uint64_t offset, count;
+{
+#ifdef HAVE_MMAP
+  long pagesize = sysconf (_SC_PAGESIZE);
+  uint64_t start;
+
+  if (map->fd < 0 || offset >= map->size || count == 0 || pagesize <= 0)
+    return;
+  if (count > map->size - offset)
+    count = map->size - offset;
+  start = offset - offset % pagesize;
+  (void) madvise (map->base + start, (size_t)(offset + count - start),
+    MADV_WILLNEED);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* opens another handle on an input file that is already being converted
+ * (on its mapping, with -mmap), set to the same page and with the same
+ * decoding pseudo-tags as the first one */
+static TIFF *tiff2png_reopen (tiffname, map, page, jpegcolormode,
+                              sgilogdatafmt)
+  char *tiffname;
+  tiff_map *map;
+  int page;
+  int jpegcolormode, sgilogdatafmt;
+{
+  TIFF *tif;
+
+  tif = map? tiff_map_open (tiffname, map) : TIFFOpen (tiffname, "r");
+  if (tif == NULL)
+    return NULL;
+  if (page > 0 && !TIFFSetDirectory (tif, (tdir_t)page))
+  {
+    TIFFClose (tif);
+    return NULL;
+  }
+  if (jpegcolormode != -1)
+    TIFFSetField (tif, TIFFTAG_JPEGCOLORMODE, jpegcolormode);
+  if (sgilogdatafmt != -1)
+    TIFFSetField (tif, TIFFTAG_SGILOGDATAFMT, sgilogdatafmt);
+
+  return tif;
+}
+
+/* reads the w by h window at x,y of the image in tif (all of it with
+ * -crop); only the striles that cross it are decoded, and the lines handed
+ * out start sr->xoff pixels left of it.  The buffers take no more than
+ * budget bytes; if they can't, NULL is returned with *need set to the
+ * fewest bytes they could take (and to 0 if memory just ran out). */
+static strile_reader *strile_reader_create (tif, tiffname, map, wq,
+                                            jpegcolormode, sgilogdatafmt,
+                                            x, y, w, h, budget, need)
+  TIFF *tif;
+  char *tiffname;
+  tiff_map *map;
+  workq *wq;
+  int jpegcolormode, sgilogdatafmt;
+  png_uint_32 x, y, w, h;
+  size_t budget;
+  size_t *need;
+{
+  strile_reader *sr;
+  uint32_t iw, ih, tw, th;
+  uint16_t planar, spp;
+  size_t right, linesz, bandsz, fixed, lines;
+  int i;
+
+  *need = 0;
+
+  sr = (strile_reader *) calloc (1, sizeof(strile_reader));
+  if (sr == NULL)
+    return NULL;
+  pthread_mutex_init (&sr->lock, NULL);
+
+  (void) TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &iw);
+  (void) TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &ih);
+  (void) TIFFGetFieldDefaulted (tif, TIFFTAG_PLANARCONFIG, &planar);
+  (void) TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+
+  sr->ctx = (tiff2png_context *) pthread_getspecific (context_key);
+  sr->tiffname = tiffname;
+  sr->wq = wq;
+  sr->map = map;
+  sr->page = TIFFCurrentDirectory (tif);
+  sr->jpegcolormode = jpegcolormode;
+  sr->sgilogdatafmt = sgilogdatafmt;
+  sr->tiled = TIFFIsTiled (tif);
+  sr->rows = ih;
+  sr->nplanes = (planar == PLANARCONFIG_SEPARATE)? spp : 1;
+  sr->linebytes = TIFFScanlineSize (tif);
+  if (sr->tiled)
+  {
+    (void) TIFFGetField (tif, TIFFTAG_TILEWIDTH, &tw);
+    (void) TIFFGetField (tif, TIFFTAG_TILELENGTH, &th);
+    sr->band_height = th;
+    sr->tiles_across = (iw + tw - 1) / tw;
+    sr->tilerowbytes = TIFFTileRowSize (tif);
+
+    /* tiles are a multiple of 16 pixels wide, so a line of the tiles
+     * across the window is still whole bytes */
+    sr->col0 = x / tw;
+    sr->nacross = (x + w + tw - 1) / tw - sr->col0;
+    sr->xoff = x - sr->col0 * tw;
+    right = (sr->col0 + sr->nacross) * sr->tilerowbytes;
+    if (right > sr->linebytes)
+      right = sr->linebytes;
+    sr->linebytes = right - sr->col0 * sr->tilerowbytes;
+    sr->tilesz = TIFFTileSize (tif);
+    if (map &&
+        (!TIFFGetField (tif, TIFFTAG_TILEOFFSETS, &sr->offsets) ||
+         !TIFFGetField (tif, TIFFTAG_TILEBYTECOUNTS, &sr->bytecounts)))
+      sr->offsets = sr->bytecounts = NULL;
+  }
+  else
+  {
+    (void) TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &th);
+    sr->band_height = (th < ih)? th : ih;
+    sr->tiles_across = sr->nacross = 1;
+    sr->tilerowbytes = sr->linebytes;
+    sr->xoff = x;
+  }
+  sr->ndown = (ih + sr->band_height - 1) / sr->band_height;
+
+  /* one handle per worker; the caller's own handle is the first of them */
+  sr->nhandles = (wq->nthreads > 0)? wq->nthreads : 1;
+
+  /* a row of tiles keeps the workers busy by itself, so one band of
+   * read-ahead is enough; strips need a band per worker.  Within a budget
+   * there may be no read-ahead at all, and if a row of tiles is still too
+   * much, it is read a slice of its lines at a time, every slice decoding
+   * all of the tiles again. */
+  fixed = sr->tiled? sr->nhandles * (size_t)sr->tilesz : 0;
+  if (sr->linebytes == 0 || fixed > budget ||
+      !size_mul (sr->linebytes, sr->nplanes, &linesz))
+  {
+    *need = (sr->linebytes == 0)? 0 : fixed + sr->linebytes;
+    strile_reader_destroy (sr);
+    return NULL;
+  }
+  budget -= fixed;
+  sr->slice = sr->band_height;
+  sr->slices = 1;
+  if (!size_mul (linesz, sr->band_height, &bandsz))
+    bandsz = (size_t)-1;
+  sr->nbands = sr->tiled? 2 : wq->nthreads + 1;
+  while (sr->nbands > 2 && bandsz > STRILE_READAHEAD / sr->nbands)
+    --sr->nbands;
+  if (sr->nbands < 2)
+    sr->nbands = 2;
+  while (sr->nbands > 1 && bandsz > budget / sr->nbands)
+    --sr->nbands;
+  if (bandsz > budget)
+  {
+    lines = budget / linesz;
+    if (!sr->tiled || lines == 0)
+    {
+      *need = fixed + (sr->tiled? linesz : bandsz);
+      strile_reader_destroy (sr);
+      return NULL;
+    }
+    sr->slices = (sr->band_height + lines - 1) / lines;
+    sr->slice = (sr->band_height + sr->slices - 1) / sr->slices;
+  }
+  sr->planebytes = sr->linebytes * sr->slice;
+  sr->bottom = strile_reader_band (sr, y + h - 1) + 1;
+  if (sr->nbands > sr->bottom - strile_reader_band (sr, y))
+    sr->nbands = sr->bottom - strile_reader_band (sr, y);
+
+  sr->handles = (tiff_handle *) calloc (sr->nhandles, sizeof(tiff_handle));
+  if (sr->handles == NULL)
+  {
+    strile_reader_destroy (sr);
+    return NULL;
+  }
+  sr->handles[0].tif = tif;
+
+  sr->band = (strile_band *) calloc (sr->nbands, sizeof(strile_band));
+  if (sr->band == NULL)
+  {
+    strile_reader_destroy (sr);
+    return NULL;
+  }
+  for (i = 0; i < sr->nbands; i++)
+  {
+    sr->band[i].brow = -1;
+    sr->band[i].buf = (uch *) malloc (sr->planebytes * sr->nplanes);
+    if (sr->band[i].buf != NULL)
+      stats_mem (sr->ctx, sr->planebytes * sr->nplanes);
+    sr->band[i].jobs = (strile_job *) calloc (sr->nacross * sr->nplanes,
+      sizeof(strile_job));
+    if (sr->band[i].buf == NULL || sr->band[i].jobs == NULL)
+    {
+      strile_reader_destroy (sr);
+      return NULL;
+    }
+  }
+
+  return sr;
+}
+
+/* worker:  decodes one strip straight into its band, or one tile and
+ * copies it into its place in the band */
+static void strile_decode (arg)
+  void *arg;
+{
+  strile_job *sj = (strile_job *)arg;
+  strile_reader *sr = sj->sr;
+  tiff2png_context *prev;
+  tiff_handle *h = NULL;
+  double cpu0 = stats_cpu ();
+  int i, r;
+
+  pthread_mutex_lock (&sr->lock);
+  for (i = 0; i < sr->nhandles; i++)
+  {
+    if (!sr->handles[i].busy)
+    {
+      h = &sr->handles[i];
+      h->busy = TRUE;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&sr->lock);
+
+  sj->ok = FALSE;
+  if (h == NULL)	/* can't happen:  there's a handle for every worker */
+    return;
+
+  prev = context_enter (sr->ctx);	/* for libtiff's messages */
+  if (h->tif == NULL)
+    h->tif = tiff2png_reopen (sr->tiffname, sr->map, sr->page,
+      sr->jpegcolormode, sr->sgilogdatafmt);
+
+  if (h->tif == NULL)
+    ;
+  else if (!sr->tiled)
+  {
+    if (TIFFReadEncodedStrip (h->tif, sj->strile, sj->dest,
+        sj->nrows * sr->linebytes) >= 0)
+      sj->ok = TRUE;
+  }
+  else
+  {
+    if (h->buf == NULL && (h->buf = (uch *) malloc (sr->tilesz)) != NULL)
+      stats_mem (sr->ctx, sr->tilesz);
+    if (h->buf != NULL &&
+        TIFFReadEncodedTile (h->tif, sj->strile, h->buf, sr->tilesz) >= 0)
+    {
+      for (r = 0; r < sj->nrows; r++)
+        memcpy (sj->dest + r * sr->linebytes,
+          h->buf + (sj->skip + r) * sr->tilerowbytes, sj->nbytes);
+      sj->ok = TRUE;
+    }
+  }
+  context_enter (prev);
+
+  pthread_mutex_lock (&sr->lock);
+  h->busy = FALSE;
+  pthread_mutex_unlock (&sr->lock);
+  stats_worker (sr->ctx, cpu0, &sr->ctx->stats.decode_cpu);
+}
+
+/* returns the band that holds the given row */
+static long strile_reader_band (sr, row)
+  strile_reader *sr;
+  png_uint_32 row;
+{
+  return (long)(row / sr->band_height) * sr->slices +
+    (row % sr->band_height) / sr->slice;
+}
+
+/* starts decoding band brow into b */
+static void strile_reader_fill (sr, b, brow)
+  strile_reader *sr;
+  strile_band *b;
+  long brow;
+{
+  strile_job *sj;
+  size_t offset;
+  long srow = brow / sr->slices;
+  png_uint_32 skip = (brow % sr->slices) * sr->slice;
+  png_uint_32 top = srow * sr->band_height + skip;
+  int plane, col;
+
+  b->brow = brow;
+  b->pending = TRUE;
+  for (plane = 0; plane < sr->nplanes; plane++)
+  {
+    for (col = 0; col < sr->nacross; col++)
+    {
+      sj = &b->jobs[plane * sr->nacross + col];
+      offset = col * sr->tilerowbytes;
+      sj->sr = sr;
+      sj->strile = (uint32_t)(plane * sr->ndown + srow) * sr->tiles_across +
+        sr->col0 + col;
+      sj->dest = b->buf + plane * sr->planebytes + offset;
+      sj->nbytes = sr->linebytes - offset;
+      if (sj->nbytes > sr->tilerowbytes)
+        sj->nbytes = sr->tilerowbytes;
+      sj->skip = skip;
+      sj->nrows = (sr->rows - top < sr->slice)? sr->rows - top : sr->slice;
+      if (sj->nrows > (int)(sr->band_height - skip))
+        sj->nrows = sr->band_height - skip;
+      if (sr->offsets)
+        tiff_map_willneed (sr->map, sr->offsets[sj->strile],
+          sr->bytecounts[sj->strile]);
+      workq_submit (sr->wq, &sj->job, strile_decode, sj);
+    }
+  }
+}
+
+/* waits for band b to be decoded; returns FALSE if any strile failed */
+static int strile_reader_wait (sr, b)
+  strile_reader *sr;
+  strile_band *b;
+{
+  int i, ok = TRUE;
+
+  if (!b->pending)
+    return TRUE;
+  for (i = 0; i < sr->nacross * sr->nplanes; i++)
+  {
+    workq_wait (sr->wq, &b->jobs[i].job);
+    if (!b->jobs[i].ok)
+      ok = FALSE;
+  }
+  b->pending = FALSE;
+  if (!ok)
+    b->brow = -1;
+
+  return ok;
+}
+
+/* returns scanline row of the given plane, or NULL on a read error; rows
+ * are expected in order, but the image may be started over (for interlacing)
+ * and the planes of a row may be asked for in any order */
+static uch *strile_reader_row (sr, row, plane)
+  strile_reader *sr;
+  int row, plane;
+{
+  strile_band *b, *ahead;
+  long brow = strile_reader_band (sr, row);
+  long n;
+
+  b = &sr->band[brow % sr->nbands];
+  if (b->brow != brow || b->pending)
+  {
+    if (b->brow != brow)
+    {
+      if (!strile_reader_wait (sr, b))
+        return NULL;
+      strile_reader_fill (sr, b, brow);
+    }
+
+    /* keep the rest of the ring busy with the bands that follow */
+    for (n = brow + 1; n < brow + sr->nbands && n < sr->bottom; n++)
+    {
+      ahead = &sr->band[n % sr->nbands];
+      if (ahead->brow != n)
+      {
+        if (!strile_reader_wait (sr, ahead))
+          return NULL;
+        strile_reader_fill (sr, ahead, n);
+      }
+    }
+
+    if (!strile_reader_wait (sr, b))
+      return NULL;
+  }
+
+  return b->buf + plane * sr->planebytes +
+    (row % sr->band_height % sr->slice) * sr->linebytes;
+}
+
+static void strile_reader_destroy (sr)
+  strile_reader *sr;
+{
+  int i;
+
+  if (sr->band != NULL)
+  {
+    for (i = 0; i < sr->nbands; i++)
+    {
+      if (sr->band[i].jobs != NULL)
+        (void) strile_reader_wait (sr, &sr->band[i]);
+      if (sr->band[i].buf != NULL)
+        stats_mem (sr->ctx, -(int64_t)(sr->planebytes * sr->nplanes));
+      free (sr->band[i].jobs);
+      free (sr->band[i].buf);
+    }
+    free (sr->band);
+  }
+  if (sr->handles != NULL)
+  {
+    for (i = 0; i < sr->nhandles; i++)
+    {
+      if (i > 0 && sr->handles[i].tif != NULL)	/* [0] is the caller's */
+        TIFFClose (sr->handles[i].tif);
+      if (sr->handles[i].buf != NULL)
+        stats_mem (sr->ctx, -(int64_t)sr->tilesz);
+      free (sr->handles[i].buf);
+    }
+    free (sr->handles);
+  }
+  pthread_mutex_destroy (&sr->lock);
+  free (sr);
+}
+
+/* shuts down everything that may have jobs on the work queue, then the
+ * queue itself; any of the arguments may be NULL */
+static void tiff2png_stop_workers (enc, sr, wq)
+  idat_encoder *enc;
+  strile_reader *sr;
+  workq *wq;
+{
+  if (enc)
+    idat_encoder_destroy (enc);
+  if (sr)
+    strile_reader_destroy (sr);
+  if (wq)
+    workq_destroy (wq);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* opens the input of a conversion, on its mapping if there is one, and
+ * goes to the page to convert; the handle takes over the caller's reference
+ * to the mapping */
+static TIFF *tiff2png_open (ctx, tiffname, map, page)
+  tiff2png_context *ctx;
+  char *tiffname;
+  tiff_map *map;
+  int page;
+{
+  TIFF *tif;
+
+  if (map)
+  {
+    tif = tiff_map_open (tiffname, map);
+    tiff_map_release (map);	/* tif holds the mapping from now on */
+  }
+  else
+    tif = TIFFOpen (tiffname, "r");
+  if (tif == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "TIFF file %s not found",
+      tiffname);
+    return NULL;
+  }
+  if (page > 0 && !TIFFSetDirectory (tif, (tdir_t)page))
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "TIFF file %s has no page %d",
+      tiffname, page + 1);
+    TIFFClose (tif);
+    return NULL;
+  }
+
+  return tif;
+}
+
+/* creates the output file of a conversion, unless it exists and -force
+ * wasn't given; "-" is stdout */
+static FILE *tiff2png_create (ctx, pngname)
+  tiff2png_context *ctx;
+  char *pngname;
+{
+  FILE *png;
+
+  /* rows go out to stdout as they are encoded, through a copy of it that
+   * fclose() can close like any other PNG file */
+  if (strcmp (pngname, "-") == 0)
+    return fdopen (dup (fileno (stdout)), "wb");
+
+  if (!ctx->opts.force)
+  {
+    png = fopen (pngname, "rb");
+    if (png)
+    {
+      tiff2png_message (ctx, TIFF2PNG_WARNING,
+        "PNG file %s exists: skipping", pngname);
+      fclose (png);
+      return NULL;
+    }
+  }
+
+#ifdef HAVE_CACHE
+  /* replace the file rather than write over it:  it may be a link to a
+   * -cache entry */
+  else
+    (void) unlink (pngname);
+#endif
+
+  png = fopen (pngname, "wb");
+  if (png == NULL)
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "PNG file %s cannot be created",
+      pngname);
+
+  return png;
+}
+
+/* libpng write procedures for a png_sink, for timing the output under
+ * -stats.  A tiff2png_buffer grows (at least twice as big each time) as
+ * needed. */
+static void tiff2png_png_write (png_ptr, data, length)
+  png_structp png_ptr;
+  png_bytep data;
+  png_size_t length;
+{
+  png_sink *sink = (png_sink *) png_get_io_ptr (png_ptr);
+  tiff2png_buffer *out = sink->out;
+  stats_mark mark;
+  size_t alloc;
+  uch *p;
+
+  stats_start (sink->ctx, &mark);
+  if (sink->png)
+  {
+    if (fwrite (data, 1, length, sink->png) != length)
+      png_error (png_ptr, "Write Error");
+  }
+  else
+  {
+    if (length > out->alloc - out->size)
+    {
+      alloc = out->alloc < 65536? 65536 : out->alloc * 2;
+      while (alloc - out->size < length)
+        alloc *= 2;
+      p = (uch *) realloc (out->data, alloc);
+      if (p == NULL)
+        png_error (png_ptr, "out of memory for PNG buffer");
+      out->data = p;
+      out->alloc = alloc;
+    }
+    memcpy (out->data + out->size, data, length);
+    out->size += length;
+    stats_mem (sink->ctx, length);
+  }
+  if (sink->ctx->opts.stats)
+    sink->ctx->stats.bytes_out += length;
+  stats_stop (sink->ctx, &mark, &sink->ctx->stats.output_wall,
+    &sink->ctx->stats.output_cpu);
+}
+
+static void tiff2png_png_flush (png_ptr)
+  png_structp png_ptr;
+{
+  png_sink *sink = (png_sink *) png_get_io_ptr (png_ptr);
+  stats_mark mark;
+
+  if (sink->png)
+  {
+    stats_start (sink->ctx, &mark);
+    fflush (sink->png);
+    stats_stop (sink->ctx, &mark, &sink->ctx->stats.output_wall,
+      &sink->ctx->stats.output_cpu);
+  }
+}
+
+/* the part of line (of the given plane) from src->xoff on, shifted into
+ * src->shifted if it doesn't start on a byte */
+static uch *row_source_skip (src, line, plane)
+  row_source *src;
+  uch *line;
+  int plane;
+{
+  size_t bits, n, i;
+  uch *dst;
+  int k;
+
+  bits = (size_t)src->xoff * src->bps * ((src->planar == 1)? src->spp : 1);
+  line += bits >> 3;
+  k = bits & 7;
+  if (k == 0)
+    return line;
+
+  n = src->linebytes - (bits >> 3);
+  dst = src->shifted + plane * src->linebytes;
+  for (i = 0; i < n; i++)
+    dst[i] = (uch)((line[i] << k) | ((i + 1 < n)? line[i + 1] >> (8 - k) : 0));
+
+  return dst;
+}
+
+/* decodes row of the TIFF (of the -crop window), with the planes
+ * interleaved if they're separate; returns NULL on a read error */
+static uch *row_source_line (src, row)
+  row_source *src;
+  int row;
+{
+  tiff2png_context *ctx = src->ctx;
+  stats_mark mark;
+  uch *tiffline;
+  uch *planes[4];		/* no row kernel takes more than 4 samples */
+  int s;
+
+  stats_start (ctx, &mark);
+  if (src->planar == 1) /* contiguous picture */
+  {
+    tiffline = strile_reader_row (src->sr, src->y0 + row, 0);
+    stats_stop (ctx, &mark, &ctx->stats.decode_wall, &ctx->stats.decode_cpu);
+    if (tiffline != NULL && src->xoff > 0)
+      tiffline = row_source_skip (src, tiffline, 0);
+    return tiffline;
+  }
+
+  /* separated planes, then combine them into one line */
+  for (s = 0; s < src->spp; s++)
+  {
+    planes[s] = strile_reader_row (src->sr, src->y0 + row, s);
+    if (planes[s] == NULL)
+      return NULL;
+    if (src->xoff > 0)
+      planes[s] = row_source_skip (src, planes[s], s);
+  }
+  stats_stop (ctx, &mark, &ctx->stats.decode_wall, &ctx->stats.decode_cpu);
+
+  stats_start (ctx, &mark);
+  tiffline = src->tiffline;
+  interleave_planes (planes, tiffline, src->cols, src->spp, src->bps);
+  stats_stop (ctx, &mark, &ctx->stats.convert_wall, &ctx->stats.convert_cpu);
+
+  return tiffline;
+}
+
+/* decodes row of the PNG image (src->fax_down rows of the TIFF, for
+ * -faxpect down) and converts it into src->pngline; returns FALSE on a
+ * read error */
+static int row_source_read (src, row)
+  row_source *src;
+  int row;
+{
+  tiff2png_context *ctx = src->ctx;
+  stats_mark mark;
+  uch *tiffline;
+  int k;
+
+  /* note that -faxpect actually converts 1-bit grayscale to indexed data,
+   * where 0 = black and n = white */
+  if (src->fax_down)
+  {
+    for (k = 0; k < src->fax_down; k++)
+    {
+      tiffline = row_source_line (src, row * src->fax_down + k);
+      if (tiffline == NULL)
+        return FALSE;
+      stats_start (ctx, &mark);
+      fax_down (tiffline, src->pngline, src->cols, k == 0, src->fax_flip);
+      stats_stop (ctx, &mark, &ctx->stats.convert_wall,
+        &ctx->stats.convert_cpu);
+    }
+    return TRUE;
+  }
+
+  tiffline = row_source_line (src, row);
+  if (tiffline == NULL)
+    return FALSE;
+
+  /* convert from tiff-line to png-line */
+
+  stats_start (ctx, &mark);
+  if (src->fax_across)
+    fax_across (tiffline, src->pngline, src->fax_width, src->fax_across,
+      src->fax_flip);
+  else
+    (*src->convert_row) (tiffline, src->pngline, src->cols);
+  stats_stop (ctx, &mark, &ctx->stats.convert_wall, &ctx->stats.convert_cpu);
+
+  return TRUE;
+}
+
+/* name-size.png for name.png, or pngname-size if it isn't a .png */
+static char *thumb_name (pngname, size)
+  char *pngname;
+  int size;
+{
+  size_t len = strlen (pngname);
+  char *name;
+
+  if (len >= 4 && strcasecmp (pngname + len - 4, ".png") == 0)
+    len -= 4;
+  name = (char *) malloc (strlen (pngname) + 16);
+  if (name)
+    sprintf (name, "%.*s-%d%s", (int)len, pngname, size, pngname + len);
+  return name;
+}
+
+/* sets up the -sizes smaller than the image described by png_ptr and
+ * info_ptr, and creates their PNGs; returns NULL (with *nthumbs 0 if
+ * there's none to make) if there's nothing to do or they can't be set up */
+static thumb *thumbs_create (ctx, pngname, png_ptr, info_ptr, nthumbs)
+  tiff2png_context *ctx;
+  char *pngname;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  int *nthumbs;
+{
+  thumb *thumbs, *t;
+  png_uint_32 width, height, res_x, res_y, x;
+  png_color *palette;
+  double gamma;
+  uint64_t edge;
+  int bit_depth, color_type, npalette, unit_type, gray, i, n = 0;
+
+  for (i = 0; i < ctx->opts.nsizes; i++)
+    if (ctx->opts.sizes[i] > 0)
+      n++;
+  *nthumbs = n;
+  if (n == 0)
+    return NULL;
+  if (strcmp (pngname, "-") == 0)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "-sizes can't write smaller PNGs to stdout or a buffer");
+    return NULL;
+  }
+
+  thumbs = (thumb *) calloc (n, sizeof(thumb));
+  if (thumbs == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "can't allocate memory for -sizes (%s)", pngname);
+    return NULL;
+  }
+
+  width = png_get_image_width (png_ptr, info_ptr);
+  height = png_get_image_height (png_ptr, info_ptr);
+  bit_depth = png_get_bit_depth (png_ptr, info_ptr);
+  color_type = png_get_color_type (png_ptr, info_ptr);
+  palette = NULL;
+  npalette = 0;
+  gray = TRUE;
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+  {
+    png_get_PLTE (png_ptr, info_ptr, &palette, &npalette);
+    for (i = 0; i < npalette; i++)
+      if (palette[i].red != palette[i].green ||
+          palette[i].red != palette[i].blue)
+        gray = FALSE;
+  }
+
+  for (i = 0, t = thumbs; i < ctx->opts.nsizes; i++)
+  {
+    if (ctx->opts.sizes[i] <= 0)
+      continue;
+    t->ctx = ctx;
+    t->size = ctx->opts.sizes[i];
+    t->src_width = width;
+    t->src_height = height;
+    t->width = width;
+    t->height = height;
+    if (width >= height && width > (png_uint_32)t->size)
+    {
+      t->width = t->size;
+      t->height = (png_uint_32)(((uint64_t)height * t->size + width / 2) /
+        width);
+    }
+    else if (height > width && height > (png_uint_32)t->size)
+    {
+      t->height = t->size;
+      t->width = (png_uint_32)(((uint64_t)width * t->size + height / 2) /
+        height);
+    }
+    if (t->width == 0)
+      t->width = 1;
+    if (t->height == 0)
+      t->height = 1;
+    t->color_type = color_type;
+    t->bit_depth = bit_depth;
+
+    /* palette images come out gray or RGB, and gray of less than 8 bits
+     * comes out 8-bit, to hold the levels in between */
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+      t->channels = gray? 1 : 3;
+      t->alpha = FALSE;
+    }
+    else
+    {
+      t->channels = png_get_channels (png_ptr, info_ptr);
+      t->alpha = (color_type & PNG_COLOR_MASK_ALPHA) != 0;
+    }
+
+    t->col_to = (png_uint_32 *) malloc (width * sizeof(png_uint_32));
+    t->col_w = (png_uint_32 *) malloc (width * sizeof(png_uint_32));
+    t->hrow = (double *) malloc (t->width * t->channels * sizeof(double));
+    t->acc = (double *) calloc (t->width * t->channels, sizeof(double));
+    t->line = (png_byte *) malloc (t->width * t->channels * 2);
+    t->name = thumb_name (pngname, t->size);
+    if (palette)
+    {
+      t->palette = (png_color *) malloc (npalette * sizeof(png_color));
+      if (t->palette)
+        memcpy (t->palette, palette, npalette * sizeof(png_color));
+    }
+    if (!t->col_to || !t->col_w || !t->hrow || !t->acc || !t->line ||
+        !t->name || (palette && !t->palette))
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "can't allocate memory for -sizes (%s)", pngname);
+      thumbs_destroy (thumbs, n);
+      return NULL;
+    }
+    stats_mem (ctx, width * 2 * sizeof(png_uint_32) +
+      t->width * t->channels * (2 * sizeof(double) + 2));
+    for (x = 0; x < width; x++)
+    {
+      t->col_to[x] = (png_uint_32)((uint64_t)x * t->width / width);
+      edge = (uint64_t)(t->col_to[x] + 1) * width;
+      t->col_w[x] = ((uint64_t)(x + 1) * t->width <= edge)? t->width :
+        (png_uint_32)(edge - (uint64_t)x * t->width);
+    }
+
+    t->fp = tiff2png_create (ctx, t->name);
+    if (t->fp == NULL)
+    {
+      thumbs_destroy (thumbs, n);
+      return NULL;
+    }
+    t->sink.ctx = ctx;
+    t->sink.png = t->fp;
+    t->sink.out = NULL;
+    t->png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING,
+      ctx, tiff2png_error_handler, tiff2png_warning_handler);
+    if (t->png_ptr)
+      t->info_ptr = png_create_info_struct (t->png_ptr);
+    if (t->info_ptr == NULL)
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "cannot allocate libpng structs (%s)", t->name);
+      thumbs_destroy (thumbs, n);
+      return NULL;
+    }
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+    png_set_user_limits (t->png_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+#endif
+    png_set_write_fn (t->png_ptr, &t->sink, tiff2png_png_write,
+      tiff2png_png_flush);
+
+    png_set_IHDR (t->png_ptr, t->info_ptr, t->width, t->height,
+      (bit_depth == 16)? 16 : 8,
+      (t->channels == 1)? PNG_COLOR_TYPE_GRAY :
+      (t->channels == 2)? PNG_COLOR_TYPE_GRAY_ALPHA :
+      (t->channels == 3)? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+      ctx->opts.interlace? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+      PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (ctx->opts.compression_level != -1)
+      png_set_compression_level (t->png_ptr, ctx->opts.compression_level);
+    set_compression (t->png_ptr, NULL, ctx->opts.filters,
+      ctx->opts.strategy);
+    if (png_get_gAMA (png_ptr, info_ptr, &gamma))
+      png_set_gAMA (t->png_ptr, t->info_ptr, gamma);
+    if (png_get_pHYs (png_ptr, info_ptr, &res_x, &res_y, &unit_type))
+      png_set_pHYs (t->png_ptr, t->info_ptr,
+        (png_uint_32)((double)res_x * t->width / width + 0.5),
+        (png_uint_32)((double)res_y * t->height / height + 0.5), unit_type);
+    png_write_info (t->png_ptr, t->info_ptr);
+
+    if (ctx->opts.interlace)
+    {
+      t->rs = row_store_create (t->height, t->width * t->channels *
+        ((bit_depth == 16)? 2 : 1),
+        mem_budget (ctx, INTERLACE_MEMORY, 8 * (ctx->opts.nsizes + 1)));
+      if (t->rs == NULL)
+      {
+        tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "cannot allocate interlacing buffer (%s)", t->name);
+        thumbs_destroy (thumbs, n);
+        return NULL;
+      }
+      if (t->rs->mem)
+        stats_mem (ctx, (int64_t)t->height * t->width * t->channels *
+          ((bit_depth == 16)? 2 : 1));
+    }
+
+    if (ctx->opts.verbose)
+      fprintf (stderr, "tiff2png:  writing %ux%u copy to %s\n",
+        t->width, t->height, t->name);
+    t++;
+  }
+
+  return thumbs;
+}
+
+/* adds the next row of the image into t, and writes out each row of t
+ * that it completes */
+static void thumb_add (t, row)
+  thumb *t;
+  png_byte *row;
+{
+  png_uint_32 x, y;
+  uint64_t top, edge;
+  double v[4], w, wy, total, a;
+  double *h, *acc;
+  int ch = t->channels, c, k, maxval;
+  png_byte *p, *out;
+
+  /* across:  each image pixel into one or two thumbnail pixels */
+  memset (t->hrow, 0, t->width * ch * sizeof(double));
+  maxval = (1 << t->bit_depth) - 1;
+  for (x = 0; x < t->src_width; x++)
+  {
+    if (t->palette)
+    {
+      v[0] = t->palette[row[x]].red;
+      v[1] = t->palette[row[x]].green;
+      v[2] = t->palette[row[x]].blue;
+    }
+    else if (t->bit_depth == 16)
+    {
+      p = row + (size_t)x * ch * 2;
+      for (c = 0; c < ch; c++)
+        v[c] = (p[2*c] << 8) | p[2*c + 1];
+    }
+    else if (t->bit_depth < 8)
+      v[0] = row[x] * 255.0 / maxval;
+    else
+    {
+      p = row + (size_t)x * ch;
+      for (c = 0; c < ch; c++)
+        v[c] = p[c];
+    }
+    if (t->alpha)
+      for (c = 0; c < ch - 1; c++)
+        v[c] *= v[ch - 1];
+
+    h = t->hrow + (size_t)t->col_to[x] * ch;
+    w = t->col_w[x];
+    for (c = 0; c < ch; c++)
+      h[c] += v[c] * w;
+    if (t->col_w[x] < t->width)
+    {
+      w = t->width - t->col_w[x];
+      for (c = 0; c < ch; c++)
+        h[ch + c] += v[c] * w;
+    }
+  }
+
+  /* down:  the row into one or two thumbnail rows, the first of which is
+   * complete if the row reaches its bottom edge */
+  top = (uint64_t)t->src_row * t->height;
+  y = (png_uint_32)(top / t->src_height);
+  edge = (uint64_t)(y + 1) * t->src_height;
+  wy = (top + t->height <= edge)? t->height : (double)(edge - top);
+  for (k = 0; k < (int)t->width * ch; k++)
+    t->acc[k] += t->hrow[k] * wy;
+  t->src_row++;
+  if (top + t->height < edge)
+    return;
+
+  total = (double)t->src_width * t->src_height;
+  out = t->line;
+  for (x = 0, acc = t->acc; x < t->width; x++, acc += ch)
+  {
+    a = t->alpha? acc[ch - 1] : total;
+    for (c = 0; c < ch; c++)
+    {
+      if (t->alpha && c < ch - 1)
+        w = (a > 0.0)? acc[c] / a + 0.5 : 0.0;
+      else
+        w = acc[c] / total + 0.5;
+      if (t->bit_depth == 16)
+      {
+        k = (w > 65535.0)? 65535 : (int)w;
+        *out++ = (png_byte)(k >> 8);
+        *out++ = (png_byte)k;
+      }
+      else
+        *out++ = (png_byte)((w > 255.0)? 255 : (int)w);
+    }
+  }
+
+  wy = t->height - wy;	/* what's left of the row, for the next one */
+  for (k = 0; k < (int)t->width * ch; k++)
+    t->acc[k] = t->hrow[k] * wy;
+
+  if (t->rs)
+  {
+    if (!row_store_put (t->rs, y, t->line))
+      png_error (t->png_ptr, "cannot write interlacing temp file");
+  }
+  else
+    png_write_row (t->png_ptr, t->line);
+}
+
+/* writes the rest of t once every row of the image has been added */
+static void thumb_finish (t)
+  thumb *t;
+{
+  png_uint_32 row;
+  png_byte *p;
+  int pass, npasses;
+
+  npasses = png_set_interlace_handling (t->png_ptr);
+  for (pass = 0; t->rs && pass < npasses; pass++)
+    for (row = 0; row < t->height; row++)
+    {
+      p = t->line;	/* libpng skips the rows that aren't in this pass */
+      if (PNG_ROW_IN_INTERLACE_PASS (row, pass))
+      {
+        p = row_store_get (t->rs, row, t->line);
+        if (p == NULL)
+          png_error (t->png_ptr, "cannot read back interlacing temp file");
+      }
+      png_write_row (t->png_ptr, p);
+    }
+  png_write_end (t->png_ptr, t->info_ptr);
+  t->done = TRUE;
+}
+
+static void thumbs_destroy (thumbs, nthumbs)
+  thumb *thumbs;
+  int nthumbs;
+{
+  thumb *t;
+
+  if (thumbs == NULL)
+    return;
+  for (t = thumbs; t < thumbs + nthumbs; t++)
+  {
+    if (t->png_ptr)
+      png_destroy_write_struct (&t->png_ptr, &t->info_ptr);
+    if (t->fp)
+    {
+      fclose (t->fp);
+      if (!t->done)	/* don't leave half a PNG behind */
+        (void) remove (t->name);
+    }
+    if (t->rs)
+      row_store_destroy (t->rs);
+    free (t->name);
+    free (t->palette);
+    free (t->col_to);
+    free (t->col_w);
+    free (t->hrow);
+    free (t->acc);
+    free (t->line);
+  }
+  free (thumbs);
+}
+
+/* converts the current page of tif, which it closes, to the open file png
+ * or to out; map is the mapping tif reads from, if any */
+static int tiff2png_run (ctx, tif, map, tiffname, png, out, pngname)
+  tiff2png_context *ctx;
+  TIFF *tif;
+  tiff_map *map;
+  char *tiffname;
+  FILE *png;
+  tiff2png_buffer *out;
+  char *pngname;
+{
+  int verbose = ctx->opts.verbose;
+  int interlace_type = ctx->opts.interlace? PNG_INTERLACE_ADAM7 :
+    PNG_INTERLACE_NONE;
+  int png_compression_level = ctx->opts.compression_level;
+  double gamma = ctx->opts.gamma;
+  int threads = ctx->opts.threads;
+  int filters = ctx->opts.filters;
+  int strategy = ctx->opts.strategy;
+
+  ush bps, spp, planar;
+  ush photometric, tiff_compression_method;
+  int bigendian;
+  int maxval;
+  int colors = 0;
+  int cols, rows;
+  int row;
+  uch *tiffline;
+
+  ush tiled;
+  int jpegcolormode = -1;	/* pseudo-tags set on tif, or -1 */
+  int sgilogdatafmt = -1;
+
+  float xres, yres, ratio;
+  row_kernel convert_row;
+  int invert_gray;
+#ifdef GRR_16BIT_DEBUG
+  int col;
+  uch msb_max, lsb_max;
+  uch msb_min, lsb_min;
+  int s16_max, s16_min;
+#endif
+
+  workq *volatile wq = NULL;		/* volatile:  needed after longjmp */
+  idat_encoder *volatile enc = NULL;
+  strile_reader *volatile sr = NULL;
+  row_store *volatile rs = NULL;
+  png_byte *volatile sample = NULL;	/* rows held back for tuning */
+  png_uint_32 nsample = 0;
+  png_struct *png_ptr;
+  png_info *info_ptr;
+  png_byte *volatile pngline = NULL;
+  png_byte *p_png;
+  png_sink sink;
+  stats_mark mark;
+  row_source src;
+  reduce_info *volatile ri = NULL;	/* with -reduce */
+  thumb *volatile thumbs = NULL;	/* with -sizes */
+  volatile int nthumbs = 0;
+  int ncreated, k;
+  png_color palette[MAXCOLORS];
+  png_byte trans[MAXCOLORS];
+  int ntrans = 0;
+  png_uint_32 width, height;
+  png_uint_32 crop_x, crop_y;
+  int bit_depth = 0;
+  int color_type = -1;
+  int tiff_color_type;
+  int pass, npasses;
+  size_t rowbytes, shiftbytes, linesz, need, rowmem;
+  png_uint_32 res_x=0L, res_y=0L;
+  double res_scale = 100.0;	/* pixels per unit to pixels per meter */
+  int unit_type = 0;
+
+  unsigned short *redcolormap;
+  unsigned short *greencolormap;
+  unsigned short *bluecolormap;
+  int have_res = FALSE;
+  int invert;
+  int faxpect, fax_across, fax_down;
+  int n;
+  long i;
+
+
+  /* first figure out whether this machine is big- or little-endian */
+  {
+    union { int32 i; char c[4]; } endian_tester;
+
+    endian_tester.i = 1;
+    bigendian = (endian_tester.c[0] == 0);
+  }
+
+  invert = ctx->opts.invert;
+
+  if (verbose)
+    fprintf (stderr, "\ntiff2png:  converting %s to %s\n", tiffname, pngname);
+
+
+  /* start PNG preparation */
+
+  png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING,
+    ctx, tiff2png_error_handler, tiff2png_warning_handler);
+  if (!png_ptr)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "cannot allocate libpng main struct (%s)", pngname);
+    TIFFClose (tif);
+    return 4;
+  }
+
+  info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "cannot allocate libpng info struct (%s)", pngname);
+    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    TIFFClose (tif);
+    return 4;
+  }
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+  /* libpng's million-pixel limit is meant for reading; PNG's is 2^31-1 */
+  png_set_user_limits (png_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+#endif
+
+  if (setjmp (ctx->jmpbuf))
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "libpng returns error condition (%s)", pngname);
+    tiff2png_stop_workers (enc, sr, wq);
+    if (rs)
+      row_store_destroy (rs);
+    if (ri)
+      reduce_destroy (ri);
+    thumbs_destroy (thumbs, nthumbs);
+    free (sample);
+    free (pngline);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    TIFFClose (tif);
+    return 1;
+  }
+
+  sink.ctx = ctx;
+  sink.png = png;
+  sink.out = out;
+  png_set_write_fn (png_ptr, &sink, tiff2png_png_write, tiff2png_png_flush);
+
+
+  /* get TIFF header info */
+
+  if (verbose)
+  {
+    int byteswapped = TIFFIsByteSwapped(tif);   /* why no TIFFIsBigEndian()?? */
+
+    fprintf (stderr, "tiff2png:  ");
+    TIFFPrintDirectory (tif, stderr, TIFFPRINT_NONE);
+    fprintf (stderr, "tiff2png:  byte order = %s\n",
+      ((bigendian && byteswapped) || (!bigendian && !byteswapped))?
+      "little-endian (Intel)" : "big-endian (Motorola)");
+    fprintf (stderr, "tiff2png:  this machine is %s-endian\n",
+      bigendian? "big" : "little");
+  }
+
+  if (! TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric))
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "photometric could not be retrieved (%s)", tiffname);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    TIFFClose (tif);
+    return 1;
+  }
+  if (! TIFFGetField (tif, TIFFTAG_BITSPERSAMPLE, &bps))
+    bps = 1;
+  if (! TIFFGetField (tif, TIFFTAG_SAMPLESPERPIXEL, &spp))
+    spp = 1;
+  if (! TIFFGetField (tif, TIFFTAG_PLANARCONFIG, &planar))
+    planar = 1;
+
+  tiled = TIFFIsTiled(tif); /* FAP 20020610 - get tiled flag */
+
+  (void) TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &cols);
+  (void) TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &rows);
+  if ((uint32_t)cols > PNG_UINT_31_MAX || (uint32_t)rows > PNG_UINT_31_MAX)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "%ux%u image is too big for PNG (%s)", (uint32_t)cols, (uint32_t)rows,
+      tiffname);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    TIFFClose (tif);
+    return 1;
+  }
+
+  /* -crop converts just the part of the image in its window; from here on
+   * the image is that part */
+  crop_x = crop_y = 0;
+  if (ctx->opts.crop_width > 0)
+  {
+    if (ctx->opts.crop_x >= (uint32_t)cols ||
+        ctx->opts.crop_y >= (uint32_t)rows)
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "crop window is outside the %dx%d image (%s)", cols, rows, tiffname);
+      png_destroy_write_struct (&png_ptr, &info_ptr);
+      TIFFClose (tif);
+      return 1;
+    }
+    crop_x = ctx->opts.crop_x;
+    crop_y = ctx->opts.crop_y;
+    if (ctx->opts.crop_width < (uint32_t)cols - crop_x)
+      cols = ctx->opts.crop_width;
+    else
+      cols -= crop_x;
+    if (ctx->opts.crop_height < (uint32_t)rows - crop_y)
+      rows = ctx->opts.crop_height;
+    else
+      rows -= crop_y;
+    if (verbose)
+      fprintf (stderr, "tiff2png:  cropping to %dx%d at %u,%u\n", cols, rows,
+        crop_x, crop_y);
+  }
+  width = cols;
+  height = rows;
+
+  ratio = 0.0;
+
+  if (TIFFGetField (tif, TIFFTAG_XRESOLUTION, &xres) &&
+      TIFFGetField (tif, TIFFTAG_YRESOLUTION, &yres) &&  /* no default value */
+      (xres != 0.0) && (yres != 0.0))
+  {
+    uint16 resunit;   /* typedef'd in tiff.h */
+
+    have_res = TRUE;
+    ratio = xres / yres;
+    if (verbose)
+    {
+      fprintf (stderr, "tiff2png:  aspect ratio (hor/vert) = %g (%g / %g)\n",
+        ratio, xres, yres);
+      if (0.95 < ratio && ratio < 1.05)
+        fprintf (stderr, "tiff2png:  near-unity aspect ratio\n");
+      else if (1.90 < ratio && ratio < 2.10)
+        fprintf (stderr, "tiff2png:  near-2X aspect ratio\n");
+      else
+        fprintf (stderr, "tiff2png:  non-square, non-2X pixels\n");
+    }
+
+#if 0
+    /* GRR: this should be fine and works sometimes, but occasionally it
+     *  seems to cause a segfault--which may be more related to Linux 2.2.10
+     *  and/or SMP and/or heavy CPU loading.  Disabled for now. */
+    (void) TIFFGetFieldDefaulted (tif, TIFFTAG_RESOLUTIONUNIT, &resunit);
+#else
+    if (! TIFFGetField (tif, TIFFTAG_RESOLUTIONUNIT, &resunit))
+      resunit = RESUNIT_INCH;  /* default (see libtiff tif_dir.c) */
+#endif
+
+    /* convert from TIFF data (floats) to PNG data (unsigned longs) */
+    switch (resunit)
+    {
+      case RESUNIT_CENTIMETER:
+        res_scale = 100.0;
+        unit_type = PNG_RESOLUTION_METER;
+        break;
+      case RESUNIT_INCH:
+        res_scale = 39.37;
+        unit_type = PNG_RESOLUTION_METER;
+        break;
+/*    case RESUNIT_NONE:   */
+      default:
+        res_scale = 100.0;
+        unit_type = PNG_RESOLUTION_UNKNOWN;
+        break;
+    }
+    res_x = (png_uint_32)(res_scale*xres + 0.5);
+    res_y = (png_uint_32)(res_scale*yres + 0.5);
+  }
+
+  if (verbose)
+  {
+    fprintf (stderr, "tiff2png:  %dx%dx%d image\n", cols, rows, bps * spp);
+    fprintf (stderr, "tiff2png:  %d bit%s/sample, %d sample%s/pixel\n",
+      bps, bps == 1? "" : "s", spp, spp == 1? "" : "s");
+  }
+
+  /* detect tiff filetype */
+
+  maxval = (1 << bps) - 1;
+  if (verbose)
+    fprintf (stderr, "tiff2png:  maxval=%d\n", maxval);
+
+  switch (photometric)
+  {
+    case PHOTOMETRIC_MINISWHITE:
+    case PHOTOMETRIC_MINISBLACK:
+      if (verbose)
+	fprintf (stderr, "tiff2png:  %d graylevels (min = %s)\n", maxval + 1,
+	  photometric == PHOTOMETRIC_MINISBLACK? "black" : "white");
+      if (spp == 1) /* no alpha */
+      {
+	color_type = PNG_COLOR_TYPE_GRAY;
+	if (verbose)
+	  fprintf (stderr, "tiff2png:  color type = grayscale\n");
+	bit_depth = bps;
+      }
+      else /* must be alpha */
+      {
+	color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+	if (verbose)
+	  fprintf (stderr, "tiff2png:  color type = grayscale + alpha\n");
+	if (bps <= 8)
+	  bit_depth = 8;
+	else
+	  bit_depth = bps;
+      }
+      break;
+
+    case PHOTOMETRIC_PALETTE:
+    {
+      int palette_8bit; /* set iff all color values in TIFF palette are < 256 */
+
+      color_type = PNG_COLOR_TYPE_PALETTE;
+      if (verbose)
+	fprintf (stderr, "tiff2png:  color type = paletted\n");
+
+      if (! TIFFGetField (tif, TIFFTAG_COLORMAP, &redcolormap, &greencolormap,
+          &bluecolormap))
+      {
+	tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "cannot retrieve TIFF colormaps (%s)", tiffname);
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+        TIFFClose (tif);
+	return 1;
+      }
+      colors = maxval + 1;
+      if (colors > MAXCOLORS)
+      {
+	tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "palette too large (%d colors) (%s)", colors, tiffname);
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+        TIFFClose (tif);
+	return 1;
+      }
+      /* max PNG palette-size is 8 bits, you could convert to full-color */
+      if (bps >= 8) 
+	bit_depth = 8;
+      else
+	bit_depth = bps;
+
+      /* PLTE chunk */
+      /* TIFF palettes contain 16-bit shorts, while PNG palettes are 8-bit */
+      /* Some broken (??) software puts 8-bit values in the shorts, which would
+         make the palette come out all zeros, which isn't good. We check... */
+      palette_8bit = 1;
+      for (i = 0 ; i < colors ; i++)
+      {
+        if ( redcolormap[i] > 255   || 
+             greencolormap[i] > 255 ||
+             bluecolormap[i] > 255)
+        {
+           palette_8bit = 0;
+           break;
+        }
+      }	
+      if (palette_8bit && verbose)
+        tiff2png_message (ctx, TIFF2PNG_WARNING,
+          "assuming 8-bit palette values");
+
+      for (i = 0 ; i < colors ; i++)
+      {
+        if (invert)
+        {
+          if (palette_8bit)
+          {
+            palette[i].red   = ~((png_byte) redcolormap[i]);
+            palette[i].green = ~((png_byte) greencolormap[i]);
+            palette[i].blue  = ~((png_byte) bluecolormap[i]);
+          }
+          else
+          {
+            palette[i].red   = ~((png_byte) (redcolormap[i] >> 8));
+            palette[i].green = ~((png_byte) (greencolormap[i] >> 8));
+            palette[i].blue  = ~((png_byte) (bluecolormap[i] >> 8));
+          }
+        }
+        else
+        {
+          if (palette_8bit)
+          {
+	    palette[i].red   = (png_byte) redcolormap[i];
+	    palette[i].green = (png_byte) greencolormap[i];
+	    palette[i].blue  = (png_byte) bluecolormap[i];
+          }
+          else
+          {
+	    palette[i].red   = (png_byte) (redcolormap[i] >> 8);
+	    palette[i].green = (png_byte) (greencolormap[i] >> 8);
+	    palette[i].blue  = (png_byte) (bluecolormap[i] >> 8);
+          }
+        }
+      }
+      /* prevent index data (pixel values) from being inverted (-> garbage) */
+      invert = FALSE;
+      break;
+    }
+
+    case PHOTOMETRIC_YCBCR:
+      /* GRR 20001110:  lifted from tiff2ps in libtiff 3.5.4 */
+      TIFFGetField(tif, TIFFTAG_COMPRESSION, &tiff_compression_method);
+      if (tiff_compression_method == COMPRESSION_JPEG &&
+          planar == PLANARCONFIG_CONTIG)
+      {
+        /* can rely on libjpeg to convert to RGB */
+        jpegcolormode = JPEGCOLORMODE_RGB;
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, jpegcolormode);
+        photometric = PHOTOMETRIC_RGB;
+        if (verbose)
+          fprintf (stderr,
+            "tiff2png:  original color type = YCbCr with JPEG compression\n");
+      }
+      else
+      {
+        tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "don't know how to handle PHOTOMETRIC_YCBCR with compression %d "
+          "(%sJPEG) and planar config %d (%scontiguous) (%s)",
+          tiff_compression_method,
+          tiff_compression_method == COMPRESSION_JPEG? "" : "not ",
+          planar, planar == PLANARCONFIG_CONTIG? "" : "not ", tiffname);
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+        TIFFClose (tif);
+        return 1;
+      }
+      /* fall thru... */
+
+    case PHOTOMETRIC_RGB:
+      if (spp == 3)
+      {
+	color_type = PNG_COLOR_TYPE_RGB;
+	if (verbose)
+	  fprintf (stderr, "tiff2png:  color type = truecolor\n");
+      }
+      else
+      {
+	color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+	if (verbose)
+	  fprintf (stderr, "tiff2png:  color type = truecolor + alpha\n");
+      }
+      if (bps <= 8)
+	bit_depth = 8;
+      else
+	bit_depth = bps;
+      break;
+
+    case PHOTOMETRIC_LOGL:
+    case PHOTOMETRIC_LOGLUV:
+      /* GRR 20001110:  lifted from tiff2ps from libtiff 3.5.4 */
+      TIFFGetField(tif, TIFFTAG_COMPRESSION, &tiff_compression_method);
+      if (tiff_compression_method != COMPRESSION_SGILOG &&
+          tiff_compression_method != COMPRESSION_SGILOG24)
+      {
+        tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "don't know how to handle PHOTOMETRIC_LOGL%s with "
+          "compression %d (not SGILOG) (%s)",
+          photometric == PHOTOMETRIC_LOGLUV? "UV" : "",
+          tiff_compression_method, tiffname);
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+        TIFFClose (tif);
+        return 1;
+      }
+      /* rely on library to convert to RGB/greyscale */
+#ifdef LIBTIFF_HAS_16BIT_INTEGER_FORMAT
+      if (bps > 8)
+      {
+        /* SGILOGDATAFMT_16BIT converts to a floating-point luminance value;
+         *  U,V are left as such.  SGILOGDATAFMT_16BIT_INT doesn't exist. */
+        sgilogdatafmt = SGILOGDATAFMT_16BIT_INT;
+        TIFFSetField(tif, TIFFTAG_SGILOGDATAFMT, sgilogdatafmt);
+        bit_depth = bps = 16;
+      }
+      else
+#endif
+      {
+        /* SGILOGDATAFMT_8BIT converts to normal grayscale or RGB format */
+        sgilogdatafmt = SGILOGDATAFMT_8BIT;
+        TIFFSetField(tif, TIFFTAG_SGILOGDATAFMT, sgilogdatafmt);
+        bit_depth = bps = 8;
+      }
+      if (photometric == PHOTOMETRIC_LOGL)
+      {
+        photometric = PHOTOMETRIC_MINISBLACK;
+        color_type = PNG_COLOR_TYPE_GRAY;
+        if (verbose)
+        {
+          fprintf (stderr,
+            "tiff2png:  original color type = logL with SGILOG compression\n");
+          fprintf (stderr, "tiff2png:  color type = grayscale\n");
+        }
+      }
+      else
+      {
+        photometric = PHOTOMETRIC_RGB;
+        color_type = PNG_COLOR_TYPE_RGB;
+        if (verbose)
+        {
+          fprintf (stderr,
+           "tiff2png:  original color type = logLUV with SGILOG compression\n");
+          fprintf (stderr, "tiff2png:  color type = truecolor\n");
+        }
+      }
+      break;
+
+/*
+    case PHOTOMETRIC_YCBCR:
+    case PHOTOMETRIC_LOGL:
+    case PHOTOMETRIC_LOGLUV:
+ */
+    case PHOTOMETRIC_MASK:
+    case PHOTOMETRIC_SEPARATED:
+    case PHOTOMETRIC_CIELAB:
+    case PHOTOMETRIC_DEPTH:
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "don't know how to handle %s (%s)",
+/*
+        photometric == PHOTOMETRIC_YCBCR?     "PHOTOMETRIC_YCBCR" :
+        photometric == PHOTOMETRIC_LOGL?      "PHOTOMETRIC_LOGL" :
+        photometric == PHOTOMETRIC_LOGLUV?    "PHOTOMETRIC_LOGLUV" :
+ */
+        photometric == PHOTOMETRIC_MASK?      "PHOTOMETRIC_MASK" :
+        photometric == PHOTOMETRIC_SEPARATED? "PHOTOMETRIC_SEPARATED" :
+        photometric == PHOTOMETRIC_CIELAB?    "PHOTOMETRIC_CIELAB" :
+        photometric == PHOTOMETRIC_DEPTH?     "PHOTOMETRIC_DEPTH" :
+                                              "unknown photometric",
+        tiffname);
+      png_destroy_write_struct (&png_ptr, &info_ptr);
+      TIFFClose (tif);
+      return 1;
+    }
+
+    default:
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR, "unknown photometric (%d) (%s)",
+        photometric, tiffname);
+      png_destroy_write_struct (&png_ptr, &info_ptr);
+      TIFFClose (tif);
+      return 1;
+    }
+  }
+  tiff_color_type = color_type;
+
+  /* pick the row conversion once, rather than deciding sample by sample;
+   * MINISWHITE only inverts the gray sample, -invert all of them (palette
+   * images have had it turned off) */
+
+/*
+        XXX BUG:  this doesn't check for associated vs. unassociated alpha
+
+	GRR PSEUDO-FIX 20001109:  from tiff2ps.c:
+	     TIFFGetFieldDefaulted(tif, TIFFTAG_EXTRASAMPLES,
+	       &extrasamples, &sampleinfo);
+	     if (extrasamples > 1) {
+	       warn&die:  unknown extra-sample type
+	     } else if (sampleinfo[0] == EXTRASAMPLE_ASSOCALPHA) {
+	       warn&die or warn & do (lossy) conversion of gray/RGB samples
+	     } else if (sampleinfo[0] == EXTRASAMPLE_UNSPECIFIED) {
+	       warn but continue (assume unassociated alpha)
+	     } else if (sampleinfo[0] == EXTRASAMPLE_UNASSALPHA) {
+	       much happiness
+	     } else {
+	       warn&die:  unknown extra-sample type
+	     }
+ */
+
+  invert_gray = invert;
+#ifdef INVERT_MINISWHITE
+  if (photometric == PHOTOMETRIC_MINISWHITE)
+    invert_gray = !invert_gray;
+#endif
+
+  convert_row = row_kernel_lookup (tiff_color_type, spp, bps, invert_gray,
+    invert, bigendian);
+  if (convert_row == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "can't convert %d-bit images with %d sample%s/pixel (%s)", bps, spp,
+      spp == 1? "" : "s", tiffname);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    TIFFClose (tif);
+    return 1;
+  }
+
+  if (verbose)
+    fprintf (stderr, "tiff2png:  bit depth = %d\n", bit_depth);
+
+  faxpect = ctx->opts.faxpect;
+  fax_across = fax_down = 0;
+  if (faxpect && have_res)
+  {
+    fax_across = fax_factor (ratio);
+    fax_down = fax_factor (1.0 / ratio);
+  }
+  if (faxpect && !fax_across && !fax_down)
+  {
+    tiff2png_message (ctx, TIFF2PNG_WARNING,
+      "aspect ratio is out of range: skipping -faxpect conversion");
+    faxpect = FALSE;
+  }
+
+  if (faxpect && (color_type != PNG_COLOR_TYPE_GRAY || bit_depth != 1))
+  {
+    tiff2png_message (ctx, TIFF2PNG_WARNING,
+      "only B&W (1-bit grayscale) images supported for -faxpect");
+    faxpect = FALSE;
+  }
+
+  /* reduce the width (or height) of a fax by n by converting 1-bit
+   * grayscale to a 2- or 4-bit, n+1-color palette */
+  if (faxpect)
+  {
+    n = fax_across? fax_across : fax_down;
+    if (fax_across)
+    {
+      width = cols / n;
+      res_x = (png_uint_32)(res_scale*xres/n + 0.5);
+    }
+    else
+    {
+      height = rows / n;
+      res_y = (png_uint_32)(res_scale*yres/n + 0.5);
+    }
+    color_type = PNG_COLOR_TYPE_PALETTE;
+    for (colors = 0; colors <= n; colors++)	/* n is all white */
+      palette[colors].red = palette[colors].green = palette[colors].blue =
+        255 * colors / n;
+    bit_depth = (n < 4)? 2 : 4;
+    if (width == 0 || height == 0)
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "image is too small for -faxpect (%s)", tiffname);
+      png_destroy_write_struct (&png_ptr, &info_ptr);
+      TIFFClose (tif);
+      return 1;
+    }
+    pthread_once (&fax_once, fax_init);
+    if (verbose)
+    {
+      fprintf (stderr, "tiff2png:  new %s = %u pixels\n",
+        fax_across? "width" : "height", fax_across? width : height);
+      fprintf (stderr, "tiff2png:  new color type = paletted\n");
+      fprintf (stderr, "tiff2png:  new bit depth = %d\n", bit_depth);
+    }
+  }
+
+  /* put parameter info in png-chunks */
+
+  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+    interlace_type, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+  if (png_compression_level != -1)
+    png_set_compression_level(png_ptr, png_compression_level);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_PLTE(png_ptr, info_ptr, palette, colors);
+
+  /* gAMA chunk */
+  if (gamma != -1.0)
+  {
+    if (verbose)
+      fprintf (stderr, "tiff2png:  gamma = %f\n", gamma);
+    png_set_gAMA(png_ptr, info_ptr, gamma);
+  }
+
+  /* pHYs chunk */
+  if (have_res)
+    png_set_pHYs (png_ptr, info_ptr, res_x, res_y, unit_type);
+
+  /* the work queue is shared by the strile reader and the IDAT encoder;
+   * without -threads it has no workers and just runs the jobs inline */
+
+  wq = workq_create (threads > 1? threads : 0);
+  if (wq == NULL)
+    png_error (png_ptr, "cannot allocate work queue");
+
+
+  /* strips or rows of tiles are decoded into the strile reader's buffers,
+   * which hand out the TIFF image a scanline at a time.  With -max-memory,
+   * they get half of it; the IDAT bands get a quarter, and the rows kept
+   * for interlacing or -reduce and a TIFF piped in an eighth each. */
+
+  tiffline = NULL;
+
+  if (map)
+    tiff_map_advise (map, tiled);
+  stats_start (ctx, &mark);
+  sr = strile_reader_create (tif, tiffname, map, wq, jpegcolormode,
+    sgilogdatafmt, crop_x, crop_y, cols, rows, mem_budget (ctx, (size_t)-1, 2),
+    &need);
+  stats_stop (ctx, &mark, &ctx->stats.decode_wall, &ctx->stats.decode_cpu);
+  if (sr == NULL)
+  {
+    if (need > 0)
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "-max-memory must be at least %lu for the TIFF %s buffers (%s)",
+        (unsigned long)(2 * need), tiled? "tile" : "strip", tiffname);
+    else
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "can't allocate memory for TIFF %s buffer (%s)",
+        tiled? "tile" : "strip", tiffname);
+    tiff2png_stop_workers (enc, sr, wq);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    TIFFClose (tif);
+    return 4;
+  }
+
+  if (planar != 1) /* in case we must combine more planes into one */
+  {
+    if (size_mul (TIFFScanlineSize(tif), spp, &linesz))
+      tiffline = (uch*) malloc(linesz);
+    if (tiffline == NULL)
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR,
+        "can't allocate memory for TIFF scanline buffer (%s)",
+        tiffname);
+      tiff2png_stop_workers (enc, sr, wq);
+      png_destroy_write_struct (&png_ptr, &info_ptr);
+      TIFFClose (tif);
+      return 4;
+    }
+    stats_mem (ctx, linesz);
+  }
+
+
+  /* allocate space for one line of PNG image, a byte per sample below 16
+   * bits (and, for -faxpect, as wide as the TIFF, rounded up to a multiple
+   * of 8 pixels down, since fax_down() counts whole bytes of them) */
+  /* (followed, if a -crop window starts in the middle of a byte, by room
+   * for the TIFF lines moved to start on a byte) */
+
+  shiftbytes = 0;
+  if ((sr->xoff * bps * (planar == 1? spp : 1)) & 7)
+    shiftbytes = sr->linebytes * sr->nplanes;
+  linesz = cols;
+  if (faxpect && fax_down)
+    linesz = ((size_t)cols + 7) & ~(size_t)7;
+  pngline = NULL;
+  if (size_mul (linesz, png_get_channels (png_ptr, info_ptr) *
+        (bit_depth == 16? 2 : 1), &linesz) &&
+      linesz <= (size_t)-1 - shiftbytes)
+    pngline = (uch *) malloc (linesz + shiftbytes);
+  if (pngline == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "can't allocate memory for PNG row buffer (%s)",
+      tiffname);
+    tiff2png_stop_workers (enc, sr, wq);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    TIFFClose (tif);
+    if (planar != 1)	/* else tiffline points into the strile reader */
+      free(tiffline);
+    return 4;
+  }
+  stats_mem (ctx, linesz + shiftbytes);
+
+  src.ctx = ctx;
+  src.sr = sr;
+  src.planar = planar;
+  src.spp = spp;
+  src.bps = bps;
+  src.cols = cols;
+  src.fax_across = faxpect? fax_across : 0;
+  src.fax_down = faxpect? fax_down : 0;
+  src.fax_width = width;
+  src.fax_flip = invert_gray? 0xff : 0;
+  src.y0 = crop_y;
+  src.xoff = sr->xoff;
+  src.linebytes = sr->linebytes;
+  src.shifted = shiftbytes? pngline + linesz : NULL;
+  src.convert_row = convert_row;
+  src.tiffline = tiffline;
+  src.pngline = pngline;
+
+  rowbytes = (size_t)width * png_get_channels (png_ptr, info_ptr) *
+    (bit_depth == 16? 2 : 1);
+
+  /* the eighth of -max-memory for kept rows is shared with -sizes' copies */
+  rowmem = mem_budget (ctx, INTERLACE_MEMORY, 8 * (ctx->opts.nsizes + 1));
+
+
+  /* with -sizes, the smaller PNGs are made from the same rows as they go
+   * by (before -reduce has changed them); if the full size isn't wanted,
+   * that's all there is to do */
+
+  if (ctx->opts.nsizes > 0)
+  {
+    thumbs = thumbs_create (ctx, out? "-" : pngname, png_ptr, info_ptr,
+      &ncreated);
+    nthumbs = ncreated;
+    if (thumbs == NULL && nthumbs > 0)
+    {
+      tiff2png_stop_workers (enc, sr, wq);
+      free (pngline);
+      png_destroy_write_struct (&png_ptr, &info_ptr);
+      TIFFClose (tif);
+      if (planar != 1)	/* else tiffline points into the strile reader */
+        free(tiffline);
+      return 1;
+    }
+  }
+
+  if (png == NULL && out == NULL)
+  {
+    for (row = 0; row < (int)height; row++)
+    {
+      if (!row_source_read (&src, row))
+      {
+        tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "bad data read on line %d (%s)", row, tiffname);
+        tiff2png_stop_workers (enc, sr, wq);
+        thumbs_destroy (thumbs, nthumbs);
+        free (pngline);
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+        TIFFClose (tif);
+        if (planar != 1)	/* else tiffline points into the strile reader */
+          free(tiffline);
+        return 1;
+      }
+      stats_start (ctx, &mark);
+      for (k = 0; k < nthumbs; k++)
+        thumb_add (&thumbs[k], pngline);
+      stats_stop (ctx, &mark, &ctx->stats.convert_wall,
+        &ctx->stats.convert_cpu);
+    }
+
+    stats_start (ctx, &mark);
+    for (k = 0; k < nthumbs; k++)
+      thumb_finish (&thumbs[k]);
+    stats_stop (ctx, &mark, &ctx->stats.deflate_wall,
+      &ctx->stats.deflate_cpu);
+    tiff2png_stop_workers (enc, sr, wq);
+    thumbs_destroy (thumbs, nthumbs);
+    TIFFClose (tif);
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+    if (planar != 1)	/* else tiffline points into the strile reader */
+      free(tiffline);
+    free (pngline);
+    return 0;
+  }
+
+
+  /* with -reduce, the image is converted and looked over before anything
+   * is written, and kept to be written from once the PNG type is settled */
+
+  if (ctx->opts.reduce && color_type != PNG_COLOR_TYPE_PALETTE &&
+      bit_depth >= 8)
+  {
+    ri = reduce_create (width, color_type, bit_depth);
+    if (ri == NULL)
+      png_error (png_ptr, "cannot allocate memory for -reduce");
+    rs = row_store_create (height, rowbytes, rowmem);
+    if (rs == NULL)
+      png_error (png_ptr, "cannot allocate -reduce buffer");
+    if (rs->mem)
+      stats_mem (ctx, (int64_t)height * rowbytes);
+
+    for (row = 0; row < (int)height; row++)
+    {
+      if (!row_source_read (&src, row))
+      {
+        tiff2png_message (ctx, TIFF2PNG_ERROR,
+          "bad data read on line %d (%s)", row, tiffname);
+        tiff2png_stop_workers (enc, sr, wq);
+        row_store_destroy (rs);
+        reduce_destroy (ri);
+        thumbs_destroy (thumbs, nthumbs);
+        free (pngline);
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+        TIFFClose (tif);
+        if (planar != 1)	/* else tiffline points into the strile reader */
+          free(tiffline);
+        return 1;
+      }
+      stats_start (ctx, &mark);
+      for (k = 0; k < nthumbs; k++)
+        thumb_add (&thumbs[k], pngline);
+      reduce_scan (ri, pngline);
+      if (!row_store_put (rs, row, pngline))
+        png_error (png_ptr, "cannot write -reduce temp file");
+      stats_stop (ctx, &mark, &ctx->stats.convert_wall,
+        &ctx->stats.convert_cpu);
+    }
+
+    reduce_decide (ri, palette, &colors, trans, &ntrans);
+    if (ri->out_type != color_type || ri->out_depth != bit_depth)
+    {
+      color_type = ri->out_type;
+      bit_depth = ri->out_depth;
+      png_set_IHDR (png_ptr, info_ptr, width, height, bit_depth, color_type,
+        interlace_type, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+      if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_PLTE (png_ptr, info_ptr, palette, colors);
+      if (color_type == PNG_COLOR_TYPE_PALETTE && ntrans > 0)
+        png_set_tRNS (png_ptr, info_ptr, trans, ntrans, NULL);
+      rowbytes = reduce_rowbytes (ri);
+      if (verbose)
+        fprintf (stderr, "tiff2png:  reduced to color type %d, bit depth %d"
+          " (%d colors)\n", color_type, bit_depth, colors);
+    }
+  }
+
+  png_write_info (png_ptr, info_ptr);
+  png_set_packing (png_ptr);
+
+
+  /* with -threads or -backend, filtering and deflating are done here rather
+   * than by libpng, so that the image can be compressed in parallel and
+   * with something other than zlib */
+
+  if (threads > 0 || ctx->backend != NULL)
+  {
+    if (interlace_type != PNG_INTERLACE_NONE)
+    {
+      if (verbose)
+        fprintf (stderr,
+          "tiff2png:  interlaced image will be encoded by libpng instead\n");
+    }
+    else
+    {
+      enc = idat_encoder_create (png_ptr, wq,
+        ctx->backend? ctx->backend : &deflate_backends[0], width, bit_depth,
+        color_type, png_compression_level);
+      if (enc == NULL)
+        png_error (png_ptr, "cannot allocate IDAT encoder");
+    }
+  }
+
+#ifdef GRR_16BIT_DEBUG
+  msb_max = lsb_max = 0;
+  msb_min = lsb_min = 255;
+  s16_max = 0;
+  s16_min = 65535;
+#endif
+
+  /* -filter auto and -strategy auto hold back the first rows until they
+   * have been tried out; anything else can be set up right away */
+
+  if (filters == TIFF2PNG_AUTO || strategy == TIFF2PNG_AUTO)
+  {
+    nsample = TUNE_SAMPLE_SIZE / rowbytes;
+    if (nsample < 1)
+      nsample = 1;
+    if (nsample > height)
+      nsample = height;
+    sample = (png_byte *) malloc (nsample * rowbytes);
+    if (sample == NULL)
+      png_error (png_ptr, "cannot allocate memory for compression trial");
+    stats_mem (ctx, nsample * rowbytes);
+  }
+  else
+    set_compression (png_ptr, enc, filters, strategy);
+
+  /* the TIFF image is decoded and converted only once:  for interlaced
+   * output, the first pass keeps the rows and the others are fed from them */
+
+  npasses = png_set_interlace_handling (png_ptr);
+  if (npasses > 1 && rs == NULL)
+  {
+    rs = row_store_create (height, rowbytes, rowmem);
+    if (rs == NULL)
+      png_error (png_ptr, "cannot allocate interlacing buffer");
+    if (rs->mem)
+      stats_mem (ctx, (int64_t)height * rowbytes);
+    if (verbose && rs->spill)
+      fprintf (stderr,
+        "tiff2png:  image too big to interlace in memory; using a temp file\n");
+  }
+
+  for (pass = 0 ; pass < npasses ; pass++)
+  {
+    for (row = 0; row < (int)height; row++)
+    {
+      if (pass > 0)
+      {
+        /* libpng skips the rows that aren't in this pass */
+        p_png = ri? ri->out : pngline;
+        if (PNG_ROW_IN_INTERLACE_PASS (row, pass))
+        {
+          stats_start (ctx, &mark);
+          p_png = row_store_get (rs, row, pngline);
+          if (p_png != NULL && ri)
+            p_png = reduce_row (ri, p_png);
+          stats_stop (ctx, &mark, &ctx->stats.convert_wall,
+            &ctx->stats.convert_cpu);
+          if (p_png == NULL)
+            png_error (png_ptr, "cannot read back interlacing temp file");
+        }
+        stats_start (ctx, &mark);
+        png_write_row (png_ptr, p_png);
+        stats_stop (ctx, &mark, &ctx->stats.deflate_wall,
+          &ctx->stats.deflate_cpu);
+        continue;
+      }
+
+      if (ri)	/* looked over already */
+      {
+        stats_start (ctx, &mark);
+        p_png = row_store_get (rs, row, pngline);
+        if (p_png == NULL)
+          png_error (png_ptr, "cannot read back -reduce temp file");
+        p_png = reduce_row (ri, p_png);
+        stats_stop (ctx, &mark, &ctx->stats.convert_wall,
+          &ctx->stats.convert_cpu);
+      }
+      else
+      {
+        if (!row_source_read (&src, row))
+        {
+          tiff2png_message (ctx, TIFF2PNG_ERROR,
+            "bad data read on line %d (%s)", row, tiffname);
+          tiff2png_stop_workers (enc, sr, wq);
+          if (rs)
+            row_store_destroy (rs);
+          thumbs_destroy (thumbs, nthumbs);
+          free (sample);
+          free (pngline);
+          png_destroy_write_struct (&png_ptr, &info_ptr);
+          TIFFClose (tif);
+          if (planar != 1)	/* else tiffline points into the strile reader */
+            free(tiffline);
+          return 1;
+        }
+        p_png = pngline;
+
+#ifdef GRR_16BIT_DEBUG
+        if (bps == 16 && tiff_color_type == PNG_COLOR_TYPE_GRAY)
+        {
+          for (col = cols; col > 0; --col, p_png += 2)
+          {
+            if (msb_max < p_png[0])
+              msb_max = p_png[0];
+            if (msb_min > p_png[0])
+              msb_min = p_png[0];
+            if (lsb_max < p_png[1])
+              lsb_max = p_png[1];
+            if (lsb_min > p_png[1])
+              lsb_min = p_png[1];
+            if (s16_max < ((p_png[0] << 8) | p_png[1]))
+              s16_max = (p_png[0] << 8) | p_png[1];
+            if (s16_min > ((p_png[0] << 8) | p_png[1]))
+              s16_min = (p_png[0] << 8) | p_png[1];
+          }
+          p_png = pngline;
+        }
+
+        if (verbose && bps == 16 && row == 0)
+        {
+          fprintf (stderr,
+            "DEBUG:  hex contents of first row sent to libpng:\n");
+          for (col = cols; col > 0; --col, p_png += 2)
+            fprintf (stderr, "   %02x %02x", p_png[0], p_png[1]);
+          fprintf (stderr, "\n");
+          fprintf (stderr, "DEBUG:  end of first row sent to libpng\n");
+          fflush (stderr);
+          p_png = pngline;
+        }
+#endif
+
+        stats_start (ctx, &mark);
+        for (k = 0; k < nthumbs; k++)
+          thumb_add (&thumbs[k], pngline);
+        if (rs && !row_store_put (rs, row, pngline))
+          png_error (png_ptr, "cannot write interlacing temp file");
+        stats_stop (ctx, &mark, &ctx->stats.convert_wall,
+          &ctx->stats.convert_cpu);
+      }
+
+      stats_start (ctx, &mark);
+      if (sample)
+      {
+        memcpy (sample + row * rowbytes, p_png, rowbytes);
+        if ((png_uint_32)row + 1 < nsample)
+        {
+          stats_stop (ctx, &mark, &ctx->stats.deflate_wall,
+            &ctx->stats.deflate_cpu);
+          continue;
+        }
+
+        tune_compression (sample, nsample, width,
+          png_get_channels (png_ptr, info_ptr), bit_depth, color_type,
+          photometric, png_compression_level, &filters, &strategy);
+        set_compression (png_ptr, enc, filters, strategy);
+        if (verbose)
+        {
+          named_value *nv;
+
+          fprintf (stderr, "tiff2png:  filters =");
+          for (nv = filter_names; nv->value != PNG_ALL_FILTERS; nv++)
+            if (filters & nv->value)
+              fprintf (stderr, " %s", nv->name);
+          for (nv = strategy_names; nv->name; nv++)
+            if (nv->value == strategy)
+              break;
+          fprintf (stderr, ", strategy = %s (tried on %lu rows)\n",
+            nv->name? nv->name : "libpng's", (ulg)nsample);
+        }
+
+        for (i = 0; i < (long)nsample; i++)
+        {
+          if (enc)
+            idat_write_row (enc, sample + i * rowbytes);
+          else
+            png_write_row (png_ptr, sample + i * rowbytes);
+        }
+        free (sample);
+        sample = NULL;
+        stats_mem (ctx, -(int64_t)(nsample * rowbytes));
+      }
+      else if (enc)
+        idat_write_row (enc, p_png);
+      else
+        png_write_row (png_ptr, p_png);
+      stats_stop (ctx, &mark, &ctx->stats.deflate_wall,
+        &ctx->stats.deflate_cpu);
+
+    } /* end for-loop (row) */
+  } /* end for-loop (pass) */
+
+  stats_start (ctx, &mark);
+  if (enc)
+    idat_encoder_finish (enc);
+  else
+    png_write_end (png_ptr, info_ptr);
+  for (k = 0; k < nthumbs; k++)
+    thumb_finish (&thumbs[k]);
+  stats_stop (ctx, &mark, &ctx->stats.deflate_wall, &ctx->stats.deflate_cpu);
+  tiff2png_stop_workers (enc, sr, wq);
+  if (rs)
+    row_store_destroy (rs);
+  if (ri)
+    reduce_destroy (ri);
+  thumbs_destroy (thumbs, nthumbs);
+
+  TIFFClose(tif);
+
+  png_destroy_write_struct (&png_ptr, &info_ptr);
+
+  if (planar != 1)	/* else tiffline points into the strile reader */
+    free(tiffline);
+  free (pngline);
+
+#ifdef GRR_16BIT_DEBUG
+  if (verbose && bps == 16)
+  {
+    fprintf (stderr, "tiff2png:  range of most significant bytes  = %u-%u\n",
+      msb_min, msb_max);
+    fprintf (stderr, "tiff2png:  range of least significant bytes = %u-%u\n",
+      lsb_min, lsb_max);
+    fprintf (stderr, "tiff2png:  range of 16-bit integer values   = %u-%u\n",
+      s16_min, s16_max);
+  }
+#endif
+
+  if (verbose)
+    fprintf (stderr, "\n");
+
+  return 0;
+}
+
+/* converts page of tiffname to pngname, or to png if it's open already
+ * (which is left for the caller to close) */
+static int tiff2png_convert_file (ctx, tiffname, pngname, page, png)
+  tiff2png_context *ctx;
+  char *tiffname, *pngname;
+  int page;
+  FILE *png;
+{
+  tiff_map *map = NULL;
+  TIFF *tif;
+  stats_mark mark;
+  struct stat st;
+  int rc = 1;
+  int i;
+
+  /* with -mmap, every handle on the file reads from one mapping, which goes
+   * away with the last of them; stdin ("-") is always read that way */
+  stats_start (ctx, &mark);
+  if (strcmp (tiffname, "-") == 0)
+  {
+    map = tiff_map_stdin (mem_budget (ctx, SPOOL_MEMORY, 8));
+    if (map == NULL)
+    {
+      tiff2png_message (ctx, TIFF2PNG_ERROR, "can't read TIFF from stdin");
+      return 1;
+    }
+    if (map->fd < 0)	/* not mapped from a file */
+      stats_mem (ctx, map->size);
+  }
+  else if (ctx->opts.use_mmap)
+  {
+    map = tiff_map_create (tiffname);
+    if (map == NULL && ctx->opts.verbose)
+      fprintf (stderr, "tiff2png:  can't map %s; reading it instead\n",
+        tiffname);
+  }
+
+  if (map)
+    ctx->stats.bytes_in = map->size;
+  else if (ctx->opts.stats && stat (tiffname, &st) == 0)
+    ctx->stats.bytes_in = st.st_size;
+  tif = tiff2png_open (ctx, tiffname, map, page);
+  stats_stop (ctx, &mark, &ctx->stats.decode_wall, &ctx->stats.decode_cpu);
+  if (tif == NULL)
+    return 1;
+
+  if (png)
+    return tiff2png_run (ctx, tif, map, tiffname, png, NULL, pngname);
+
+  /* -sizes without "full" writes only the smaller PNGs */
+  if (ctx->opts.nsizes > 0)
+  {
+    for (i = 0; i < ctx->opts.nsizes; i++)
+      if (ctx->opts.sizes[i] == 0)
+        break;
+    if (i == ctx->opts.nsizes)
+      return tiff2png_run (ctx, tif, map, tiffname, NULL, NULL, pngname);
+  }
+
+  png = tiff2png_create (ctx, pngname);
+  if (png)
+  {
+    rc = tiff2png_run (ctx, tif, map, tiffname, png, NULL, pngname);
+    stats_start (ctx, &mark);
+    fclose (png);
+    stats_stop (ctx, &mark, &ctx->stats.output_wall, &ctx->stats.output_cpu);
+  }
+  else
+    TIFFClose (tif);
+
+  return rc;
+}
+
+#ifdef HAVE_CACHE
+/*----------------------------------------------------------------------------*/
+
+/* SHA-256 (FIPS 180-4), for the keys of the -cache */
+
+static uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init (s)
+  sha256 *s;
+{
+  s->h[0] = 0x6a09e667;  s->h[1] = 0xbb67ae85;
+  s->h[2] = 0x3c6ef372;  s->h[3] = 0xa54ff53a;
+  s->h[4] = 0x510e527f;  s->h[5] = 0x9b05688c;
+  s->h[6] = 0x1f83d9ab;  s->h[7] = 0x5be0cd19;
+  s->len = 0;
+  s->n = 0;
+}
+
+static void sha256_block (s, p)
+  sha256 *s;
+  const uch *p;
+{
+  uint32_t w[64], v[8], t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) |
+           ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+  for (; i < 64; i++)
+    w[i] = w[i-16] + w[i-7] +
+      (ROTR32 (w[i-15], 7) ^ ROTR32 (w[i-15], 18) ^ (w[i-15] >> 3)) +
+      (ROTR32 (w[i-2], 17) ^ ROTR32 (w[i-2], 19) ^ (w[i-2] >> 10));
+
+  for (i = 0; i < 8; i++)
+    v[i] = s->h[i];
+  for (i = 0; i < 64; i++)
+  {
+    t1 = v[7] + (ROTR32 (v[4], 6) ^ ROTR32 (v[4], 11) ^ ROTR32 (v[4], 25)) +
+      ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+    t2 = (ROTR32 (v[0], 2) ^ ROTR32 (v[0], 13) ^ ROTR32 (v[0], 22)) +
+      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    v[7] = v[6];
+    v[6] = v[5];
+    v[5] = v[4];
+    v[4] = v[3] + t1;
+    v[3] = v[2];
+    v[2] = v[1];
+    v[1] = v[0];
+    v[0] = t1 + t2;
+  }
+  for (i = 0; i < 8; i++)
+    s->h[i] += v[i];
+}
+
+static void sha256_update (s, data, len)
+  sha256 *s;
+  const uch *data;
+  size_t len;
+{
+  size_t n;
+
+  s->len += len;
+  if (s->n > 0)
+  {
+    n = (len < 64 - s->n)? len : 64 - s->n;
+    memcpy (s->buf + s->n, data, n);
+    s->n += n;
+    data += n;
+    len -= n;
+    if (s->n < 64)
+      return;
+    sha256_block (s, s->buf);
+    s->n = 0;
+  }
+  for (; len >= 64; data += 64, len -= 64)
+    sha256_block (s, data);
+  memcpy (s->buf, data, len);
+  s->n = len;
+}
+
+/* finishes the hash as 64 lowercase hex digits */
+static void sha256_final (s, hex)
+  sha256 *s;
+  char *hex;
+{
+  uint64_t bits = s->len * 8;
+  uch pad[72];
+  size_t npad;
+  int i;
+
+  npad = (s->n < 56)? 56 - s->n : 120 - s->n;
+  memset (pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++)
+    pad[npad + i] = (uch)(bits >> (56 - 8 * i));
+  sha256_update (s, pad, npad + 8);
+
+  for (i = 0; i < 32; i++)
+    sprintf (hex + 2 * i, "%02x", (s->h[i / 4] >> (24 - 8 * (i % 4))) & 0xff);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* -cache:  a directory of the PNGs converted before, each stored as
+ * <dir>/xx/yyyy.png by the SHA-256 of the TIFF and of everything else that
+ * goes into the PNG (the options that affect it, the page, and the versions
+ * of tiff2png and the libraries), xxyyyy in hex.  A new entry is written
+ * to a temporary file that is renamed into place once complete, so an
+ * interrupted or concurrent run never leaves half a PNG behind.  The PNG
+ * asked for is hard-linked to its entry (or copied where that fails),
+ * replacing whatever PNG was there before. */
+
+/* the path of the cache entry for page of tiffname, or NULL if the TIFF
+ * can't be read (or there's no memory) */
+static char *cache_entry (ctx, tiffname, page)
+  tiff2png_context *ctx;
+  char *tiffname;
+  int page;
+{
+  tiff2png_options *opts = &ctx->opts;
+  sha256 s;
+  FILE *fp;
+  uch buf[65536];
+  char hex[65];
+  char *entry;
+  size_t n;
+  uint64_t size = 0;
+
+  fp = fopen (tiffname, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  /* the number of -threads doesn't change the PNG, but whether it is
+   * compressed by libpng or in IDAT bands does, and so does the size of
+   * the bands (smaller with a small -max-memory) */
+  sprintf ((char *)buf,
+    "tiff2png %s\nlibtiff %s\nlibpng %s\nzlib %s\nlibdeflate %s\n"
+    "page %d\ncompression %d\ngamma %.17g\ninvert %d\nfaxpect %d\n"
+    "interlace %d\nfilters %d\nstrategy %d\nbackend %s\nminiswhite %d\n"
+    "reduce %d\ncrop %lu,%lu,%lu,%lu\nthreads %d\nbands %lu\n\n",
+#ifdef VERSION
+    VERSION,
+#else
+    "",
+#endif
+    TIFFGetVersion (), png_libpng_ver, zlib_version,
+#if defined(HAVE_LIBDEFLATE) && defined(LIBDEFLATE_VERSION_STRING)
+    LIBDEFLATE_VERSION_STRING,
+#elif defined(HAVE_LIBDEFLATE)
+    "yes",
+#else
+    "",
+#endif
+    page, opts->compression_level, opts->gamma, opts->invert,
+    opts->faxpect? FAX_MAX : 0,
+    opts->interlace, opts->filters, opts->strategy,
+    opts->backend? opts->backend : "",
+#ifdef INVERT_MINISWHITE
+    1,
+#else
+    0,
+#endif
+    opts->reduce, (ulg)opts->crop_x, (ulg)opts->crop_y,
+    (ulg)opts->crop_width, (ulg)opts->crop_height, opts->threads > 0,
+    (ulg)mem_budget (ctx, IDAT_BAND_SIZE, 8));
+  sha256_init (&s);
+  sha256_update (&s, buf, strlen ((char *)buf));
+  while ((n = fread (buf, 1, sizeof(buf), fp)) > 0)
+  {
+    sha256_update (&s, buf, n);
+    size += n;
+  }
+  if (ferror (fp))
+  {
+    fclose (fp);
+    return NULL;
+  }
+  fclose (fp);
+  sha256_final (&s, hex);
+  if (opts->stats)
+    ctx->stats.bytes_in = size;
+
+  entry = (char *) malloc (strlen (opts->cache) + 1 + 3 + 62 + 5);
+  if (entry == NULL)
+    return NULL;
+  sprintf (entry, "%s/%.2s/%s.png", opts->cache, hex, hex + 2);
+
+  return entry;
+}
+
+/* converts page of tiffname to a new cache entry */
+static int cache_store (ctx, tiffname, page, entry)
+  tiff2png_context *ctx;
+  char *tiffname;
+  int page;
+  char *entry;
+{
+  char *tmp, *slash;
+  FILE *png;
+  int fd, rc;
+
+  tmp = (char *) malloc (strlen (entry) + 8);
+  if (tmp == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "out of memory");
+    return 4;
+  }
+  strcpy (tmp, entry);
+  slash = strrchr (tmp, '/');
+  *slash = '\0';
+  (void) mkdir (ctx->opts.cache, 0777);
+  (void) mkdir (tmp, 0777);	/* the xx subdirectory */
+  *slash = '/';
+  sprintf (tmp + strlen (entry) - 4, ".XXXXXX");
+
+  fd = mkstemp (tmp);
+  png = (fd >= 0)? fdopen (fd, "wb") : NULL;
+  if (png == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "cache entry %s cannot be created", tmp);
+    if (fd >= 0)
+    {
+      close (fd);
+      unlink (tmp);
+    }
+    free (tmp);
+    return 1;
+  }
+  (void) fchmod (fd, 0644);	/* mkstemp() makes it private */
+
+  rc = tiff2png_convert_file (ctx, tiffname, entry, page, png);
+  if (fclose (png) != 0 && rc == 0)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "cache entry %s cannot be written", tmp);
+    rc = 1;
+  }
+  if (rc == 0 && rename (tmp, entry) != 0)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR,
+      "cache entry %s cannot be renamed to %s", tmp, entry);
+    rc = 1;
+  }
+  if (rc != 0)
+    unlink (tmp);
+  free (tmp);
+
+  return rc;
+}
+
+/* puts the cache entry in place as pngname:  a hard link to it if it isn't
+ * one already, or else a copy */
+static int cache_fetch (ctx, entry, pngname)
+  tiff2png_context *ctx;
+  char *entry, *pngname;
+{
+  struct stat est, pst;
+  FILE *in, *out;
+  uch buf[65536];
+  size_t n;
+  int ok;
+
+  if (stat (entry, &est) != 0)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "cache entry %s not found", entry);
+    return 1;
+  }
+  if (ctx->opts.stats)
+    ctx->stats.bytes_out = est.st_size;
+  if (stat (pngname, &pst) == 0)
+  {
+    if (pst.st_dev == est.st_dev && pst.st_ino == est.st_ino)
+      return 0;
+    if (ctx->opts.verbose)
+      fprintf (stderr, "tiff2png:  replacing %s\n", pngname);
+    unlink (pngname);
+  }
+  if (link (entry, pngname) == 0)
+    return 0;
+
+  in = fopen (entry, "rb");
+  if (in == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "cache entry %s cannot be read",
+      entry);
+    return 1;
+  }
+  out = fopen (pngname, "wb");
+  if (out == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "PNG file %s cannot be created",
+      pngname);
+    fclose (in);
+    return 1;
+  }
+  ok = TRUE;
+  while ((n = fread (buf, 1, sizeof(buf), in)) > 0)
+    if (fwrite (buf, 1, n, out) != n)
+      ok = FALSE;
+  if (ferror (in))
+    ok = FALSE;
+  fclose (in);
+  if (fclose (out) != 0)
+    ok = FALSE;
+  if (!ok)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "PNG file %s cannot be written",
+      pngname);
+    unlink (pngname);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* converts page of tiffname to pngname through the cache:  from the entry
+ * if there is one, or else into a new one */
+static int cache_convert (ctx, tiffname, pngname, page)
+  tiff2png_context *ctx;
+  char *tiffname, *pngname;
+  int page;
+{
+  stats_mark mark;
+  struct stat st;
+  char *entry;
+  int rc;
+
+  stats_start (ctx, &mark);
+  entry = cache_entry (ctx, tiffname, page);
+  stats_stop (ctx, &mark, &ctx->stats.decode_wall, &ctx->stats.decode_cpu);
+  if (entry == NULL)	/* let the conversion report what's wrong */
+    return tiff2png_convert_file (ctx, tiffname, pngname, page, NULL);
+
+  if (stat (entry, &st) == 0)
+  {
+    if (ctx->opts.verbose)
+      fprintf (stderr, "tiff2png:  %s is cached as %s\n", tiffname, entry);
+    rc = 0;
+  }
+  else
+    rc = cache_store (ctx, tiffname, page, entry);
+  if (rc == 0)
+  {
+    stats_start (ctx, &mark);
+    rc = cache_fetch (ctx, entry, pngname);
+    stats_stop (ctx, &mark, &ctx->stats.output_wall,
+      &ctx->stats.output_cpu);
+  }
+  free (entry);
+
+  return rc;
+}
+#endif /* HAVE_CACHE */
+
+/*----------------------------------------------------------------------------*/
+
+/* the library interface; see tiff2png.h */
+
+void tiff2png_options_init (opts)
+  tiff2png_options *opts;
+{
+  memset (opts, 0, sizeof(tiff2png_options));
+  opts->compression_level = -1;
+  opts->gamma = -1.0;
+  opts->filters = TIFF2PNG_DEFAULT;
+  opts->strategy = TIFF2PNG_DEFAULT;
+}
+
+tiff2png_context *tiff2png_context_create (opts, fn, arg)
+  tiff2png_options *opts;
+  tiff2png_message_fn fn;
+  void *arg;
+{
+  tiff2png_context *ctx;
+  deflate_backend *backend = NULL;
+
+  if (opts->backend)
+  {
+    for (backend = deflate_backends; backend->name; backend++)
+      if (strcmp (opts->backend, backend->name) == 0)
+        break;
+    if (backend->name == NULL)
+      return NULL;
+  }
+
+  ctx = (tiff2png_context *) calloc (1, sizeof(tiff2png_context));
+  if (ctx == NULL)
+    return NULL;
+  pthread_once (&context_once, context_init);
+
+  ctx->opts = *opts;
+  ctx->opts.backend = backend? backend->name : NULL;	/* not the caller's */
+  if (opts->cache && (ctx->opts.cache = strdup (opts->cache)) == NULL)
+  {
+    free (ctx);
+    return NULL;
+  }
+  ctx->backend = backend;
+  ctx->message = fn;
+  ctx->message_arg = arg;
+  pthread_mutex_init (&ctx->stats_lock, NULL);
+
+  return ctx;
+}
+
+void tiff2png_context_destroy (ctx)
+  tiff2png_context *ctx;
+{
+  pthread_mutex_destroy (&ctx->stats_lock);
+  free (ctx->opts.cache);
+  free (ctx);
+}
+
+int tiff2png_convert (ctx, tiffname, pngname, page)
+  tiff2png_context *ctx;
+  char *tiffname, *pngname;
+  int page;
+{
+  tiff2png_context *prev;
+  stats_mark total;
+  int rc;
+
+  ctx->error[0] = '\0';
+  stats_begin (ctx, &total);
+  prev = context_enter (ctx);
+#ifdef HAVE_CACHE
+  if (ctx->opts.cache && ctx->opts.nsizes == 0 &&
+      strcmp (tiffname, "-") != 0 && strcmp (pngname, "-") != 0)
+    rc = cache_convert (ctx, tiffname, pngname, page);
+  else
+#endif
+    rc = tiff2png_convert_file (ctx, tiffname, pngname, page, NULL);
+  context_enter (prev);
+  stats_end (ctx, &total);
+
+  return rc;
+}
+
+int tiff2png_convert_buffer (ctx, tiff, tiffsize, out, page)
+  tiff2png_context *ctx;
+  const void *tiff;
+  size_t tiffsize;
+  tiff2png_buffer *out;
+  int page;
+{
+  tiff2png_context *prev;
+  tiff_map *map;
+  TIFF *tif;
+  stats_mark total, mark;
+  int rc = 1;
+
+  ctx->error[0] = '\0';
+  stats_begin (ctx, &total);
+  out->size = 0;
+  map = tiff_map_memory (tiff, tiffsize);
+  if (map == NULL)
+  {
+    tiff2png_message (ctx, TIFF2PNG_ERROR, "out of memory");
+    return 4;
+  }
+
+  prev = context_enter (ctx);
+  if (ctx->opts.stats)
+    ctx->stats.bytes_in = tiffsize;
+  stats_start (ctx, &mark);
+  tif = tiff2png_open (ctx, "(buffer)", map, page);
+  stats_stop (ctx, &mark, &ctx->stats.decode_wall, &ctx->stats.decode_cpu);
+  if (tif)
+    rc = tiff2png_run (ctx, tif, map, "(buffer)", NULL, out, "(buffer)");
+  context_enter (prev);
+  stats_end (ctx, &total);
+  if (rc != 0)
+    out->size = 0;
+
+  return rc;
+}
+
+void tiff2png_buffer_free (out)
+  tiff2png_buffer *out;
+{
+  free (out->data);
+  out->data = NULL;
+  out->size = out->alloc = 0;
+}
+
+char *tiff2png_last_error (ctx)
+  tiff2png_context *ctx;
+{
+  return ctx->error;
+}
+
+tiff2png_stats *tiff2png_last_stats (ctx)
+  tiff2png_context *ctx;
+{
+  return &ctx->stats;
+}
+
+int tiff2png_count_pages (ctx, tiffname)
+  tiff2png_context *ctx;
+  char *tiffname;
+{
+  tiff2png_context *prev;
+  TIFF *tif;
+  int n = 0;
+
+  prev = context_enter (ctx);
+  tif = TIFFOpen (tiffname, "r");
+  if (tif)
+  {
+    n = TIFFNumberOfDirectories (tif);
+    TIFFClose (tif);
+  }
+  context_enter (prev);
+
+  return n;
+}
+
+int tiff2png_has_backend (name)
+  char *name;
+{
+  deflate_backend *backend;
+
+  for (backend = deflate_backends; backend->name; backend++)
+    if (strcmp (name, backend->name) == 0)
+      return TRUE;
+
+  return FALSE;
+}
@@ -0,0 +1,399 @@
+/*
+** mkcorpus.c - writes the synthetic TIFFs that "make bench" times tiff2png on
+**
+** Distributed under the same terms as tiff2png.c.
+*/
+
+/* Usage:  mkcorpus <dir> [<width> <height> <files>]
+ *
+ * Writes <files> images of each case of the matrix tiff2png handles into
+ * <dir>, as <case>-<n>.tif:  photometric interpretation (min-is-black,
+ * min-is-white, palette, RGB, YCbCr with JPEG compression, LogLuv), bits
+ * per sample (1, 2, 4, 8, 16, or 32-bit floats for LogLuv), contiguous
+ * or separated planes, strips or tiles, and no, LZW, Deflate or JPEG
+ * compression, wherever libtiff can write the combination.  Each line of
+ * <dir>/cases is the name of a case, its number of files and the bytes of
+ * uncompressed image data in them, for bench.sh.  The images are smooth
+ * gradients with a little noise, so that they compress somewhat like
+ * scans, and the same on every run. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tiffio.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#endif
+#ifndef FALSE
+#  define FALSE 0
+#endif
+
+#define TILE_SIZE 64		/* a multiple of 8, so tiles start on bytes */
+
+typedef unsigned char   uch;
+typedef unsigned long   ulg;
+
+/* one case of the matrix */
+
+typedef struct _bench_case {
+  char *kind;			/* see kinds[] */
+  int photometric;
+  int bps;
+  int spp;
+  int planar;
+  int tiled;
+  int compression;
+} bench_case;
+
+typedef struct _named_value {
+  char *name;
+  int value;
+} named_value;
+
+static named_value kinds[] = {
+  { "gray",	PHOTOMETRIC_MINISBLACK },
+  { "white",	PHOTOMETRIC_MINISWHITE },
+  { "palette",	PHOTOMETRIC_PALETTE },
+  { "rgb",	PHOTOMETRIC_RGB },
+  { "ycbcr",	PHOTOMETRIC_YCBCR },
+  { "logluv",	PHOTOMETRIC_LOGLUV },
+  { NULL,	0 }
+};
+
+static named_value compressions[] = {
+  { "none",	COMPRESSION_NONE },
+  { "lzw",	COMPRESSION_LZW },
+  { "deflate",	COMPRESSION_ADOBE_DEFLATE },
+  { "jpeg",	COMPRESSION_JPEG },
+  { "sgilog",	COMPRESSION_SGILOG },
+  { NULL,	0 }
+};
+
+static ulg seed;
+
+
+/* local prototypes */
+
+static int case_valid (bench_case *bc);
+static char *case_name (bench_case *bc, char *buf);
+static unsigned noise (void);
+static uch *make_plane (bench_case *bc, int plane, int width, int height,
+                        size_t *rowbytes);
+static int write_tiff (char *name, bench_case *bc, int width, int height);
+
+/*---------------------------------------------------------------------------*/
+
+/* whether libtiff (and tiff2png) can do a combination */
+static int case_valid (bc)
+  bench_case *bc;
+{
+  int p = bc->photometric, bps = bc->bps, c = bc->compression;
+
+  if ((bps == 32) != (p == PHOTOMETRIC_LOGLUV))
+    return FALSE;
+  if (c == COMPRESSION_SGILOG)
+    return (p == PHOTOMETRIC_LOGLUV && bc->planar == PLANARCONFIG_CONTIG);
+  if (p == PHOTOMETRIC_LOGLUV)
+    return FALSE;
+  if (p == PHOTOMETRIC_YCBCR)
+    return (bps == 8 && c == COMPRESSION_JPEG &&
+      bc->planar == PLANARCONFIG_CONTIG);
+  if (c == COMPRESSION_JPEG)
+    return (bps == 8 && p != PHOTOMETRIC_PALETTE &&
+      bc->planar == PLANARCONFIG_CONTIG);
+  if (p == PHOTOMETRIC_PALETTE && bps == 16)
+    return FALSE;
+  if (p == PHOTOMETRIC_RGB && bps < 8)
+    return FALSE;
+  if (bc->spp == 1 && bc->planar == PLANARCONFIG_SEPARATE)
+    return FALSE;
+
+  return TRUE;
+}
+
+static char *case_name (bc, buf)
+  bench_case *bc;
+  char *buf;
+{
+  named_value *nv;
+  char *comp = "?";
+
+  for (nv = compressions; nv->name; nv++)
+    if (nv->value == bc->compression)
+      comp = nv->name;
+  sprintf (buf, "%s-b%d-%s-%s-%s", bc->kind, bc->bps,
+    bc->planar == PLANARCONFIG_SEPARATE? "separate" : "contig",
+    bc->tiled? "tile" : "strip", comp);
+
+  return buf;
+}
+
+static unsigned noise ()
+{
+  seed = seed * 1103515245L + 12345L;
+  return (unsigned)(seed >> 16) & 0x7fff;
+}
+
+/* one plane (or all samples, for contiguous planes) of the image, packed as
+ * in the TIFF:  a gradient per sample, plus noise in the low bits */
+static uch *make_plane (bc, plane, width, height, rowbytes)
+  bench_case *bc;
+  int plane;
+  int width, height;
+  size_t *rowbytes;
+{
+  int nsamples = (bc->planar == PLANARCONFIG_SEPARATE)? 1 : bc->spp;
+  int bps = bc->bps;
+  ulg maxval = (1L << bps) - 1;
+  uch *buf;
+  ulg v;
+  size_t bit;
+  int x, y, s, sample;
+
+  if (bc->photometric == PHOTOMETRIC_LOGLUV)
+  {
+    float *f;
+
+    *rowbytes = (size_t)width * nsamples * sizeof(float);
+    buf = (uch *) malloc (*rowbytes * height);
+    if (buf == NULL)
+      return NULL;
+    f = (float *)buf;
+    for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+        for (s = 0; s < nsamples; s++)
+          *f++ = (float)(x + y + s * 17) / (width + height) +
+            (noise () % 64) / 4096.0f;
+    return buf;
+  }
+
+  *rowbytes = ((size_t)width * nsamples * bps + 7) / 8;
+  buf = (uch *) calloc (*rowbytes, height);
+  if (buf == NULL)
+    return NULL;
+
+  for (y = 0; y < height; y++)
+  {
+    bit = 0;
+    for (x = 0; x < width; x++)
+      for (s = 0; s < nsamples; s++)
+      {
+        sample = (nsamples == 1)? plane : s;
+        v = ((ulg)(x * (sample + 1) + y * (3 - sample % 3)) << 16) /
+          (width + height);
+        v = (v + noise () % 2048) & 0xffff;
+        v >>= 16 - bps;
+        if (bps == 1)
+          v = ((x / 8 + y / 8) % 5 == 0) ^ (noise () % 97 == 0);
+        if (v > maxval)
+          v = maxval;
+
+        if (bps == 16)
+          ((unsigned short *)(buf + y * *rowbytes))[bit / 16] =
+            (unsigned short)v;
+        else if (bps == 8)
+          buf[y * *rowbytes + bit / 8] = (uch)v;
+        else
+          buf[y * *rowbytes + bit / 8] |= (uch)(v << (8 - bps - bit % 8));
+        bit += bps;
+      }
+  }
+
+  return buf;
+}
+
+/* writes one image of a case; returns FALSE if libtiff wouldn't */
+static int write_tiff (name, bc, width, height)
+  char *name;
+  bench_case *bc;
+  int width, height;
+{
+  TIFF *tif;
+  int nplanes = (bc->planar == PLANARCONFIG_SEPARATE)? bc->spp : 1;
+  int nsamples = bc->spp / nplanes;	/* per pixel of a plane */
+  uch *planes[4], *tile = NULL;
+  size_t rowbytes = 0, tilerowbytes, xoff, n;
+  int plane, x, y, row;
+  int ok = TRUE;
+
+  tif = TIFFOpen (name, "w");
+  if (tif == NULL)
+    return FALSE;
+
+  TIFFSetField (tif, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField (tif, TIFFTAG_IMAGELENGTH, height);
+  TIFFSetField (tif, TIFFTAG_BITSPERSAMPLE, bc->bps);
+  TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, bc->spp);
+  TIFFSetField (tif, TIFFTAG_PLANARCONFIG, bc->planar);
+  TIFFSetField (tif, TIFFTAG_PHOTOMETRIC, bc->photometric);
+  TIFFSetField (tif, TIFFTAG_COMPRESSION, bc->compression);
+  TIFFSetField (tif, TIFFTAG_XRESOLUTION, 300.0);
+  TIFFSetField (tif, TIFFTAG_YRESOLUTION, 300.0);
+  TIFFSetField (tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
+  if (bc->photometric == PHOTOMETRIC_YCBCR)
+    TIFFSetField (tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+  if (bc->photometric == PHOTOMETRIC_LOGLUV)
+  {
+    TIFFSetField (tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    TIFFSetField (tif, TIFFTAG_SGILOGDATAFMT, SGILOGDATAFMT_FLOAT);
+  }
+  if (bc->photometric == PHOTOMETRIC_PALETTE)
+  {
+    unsigned short map[3][256];
+    int i, n = 1 << bc->bps;
+
+    for (i = 0; i < n; i++)
+    {
+      map[0][i] = (unsigned short)(i * 65535L / (n - 1));
+      map[1][i] = (unsigned short)((n - 1 - i) * 65535L / (n - 1));
+      map[2][i] = (unsigned short)((i * 37 % n) * 257);
+    }
+    TIFFSetField (tif, TIFFTAG_COLORMAP, map[0], map[1], map[2]);
+  }
+
+  memset (planes, 0, sizeof(planes));
+  for (plane = 0; plane < nplanes; plane++)
+  {
+    planes[plane] = make_plane (bc, plane, width, height, &rowbytes);
+    if (planes[plane] == NULL)
+      ok = FALSE;
+  }
+
+  if (!ok)
+    ;
+  else if (!bc->tiled)
+  {
+    TIFFSetField (tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize (tif, 0));
+    for (plane = 0; ok && plane < nplanes; plane++)
+      for (row = 0; ok && row < height; row++)
+        ok = (TIFFWriteScanline (tif, planes[plane] + row * rowbytes, row,
+          (tsample_t)plane) >= 0);
+  }
+  else
+  {
+    TIFFSetField (tif, TIFFTAG_TILEWIDTH, TILE_SIZE);
+    TIFFSetField (tif, TIFFTAG_TILELENGTH, TILE_SIZE);
+    tilerowbytes = (size_t)TILE_SIZE * nsamples * bc->bps / 8;
+    tile = (uch *) malloc (tilerowbytes * TILE_SIZE);
+    ok = (tile != NULL);
+    for (plane = 0; ok && plane < nplanes; plane++)
+      for (y = 0; ok && y < height; y += TILE_SIZE)
+        for (x = 0; ok && x < width; x += TILE_SIZE)
+        {
+          /* the tile is padded with zeros at the right and bottom edges */
+          memset (tile, 0, tilerowbytes * TILE_SIZE);
+          xoff = (size_t)x * nsamples * bc->bps / 8;
+          n = tilerowbytes;
+          if (xoff + n > rowbytes)
+            n = rowbytes - xoff;
+          for (row = 0; row < TILE_SIZE && y + row < height; row++)
+            memcpy (tile + row * tilerowbytes,
+              planes[plane] + (y + row) * rowbytes + xoff, n);
+          ok = (TIFFWriteTile (tif, tile, x, y, 0, (tsample_t)plane) >= 0);
+        }
+    free (tile);
+  }
+
+  for (plane = 0; plane < nplanes; plane++)
+    free (planes[plane]);
+  TIFFClose (tif);
+
+  return ok;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+main (argc, argv)
+  int argc;
+  char *argv[];
+{
+  static int depths[] = { 1, 2, 4, 8, 16, 32 };
+  char *dir;
+  char name[64], *path;
+  int width = 512, height = 512, nfiles = 2;
+  bench_case bc;
+  named_value *kind, *comp;
+  FILE *cases;
+  int d, planar, tiled, i;
+  int ncases = 0;
+  double raw;
+
+  if (argc != 2 && argc != 5)
+  {
+    fprintf (stderr, "Usage:  mkcorpus <dir> [<width> <height> <files>]\n");
+    return 1;
+  }
+  dir = argv[1];
+  if (argc == 5)
+  {
+    width = atoi (argv[2]);
+    height = atoi (argv[3]);
+    nfiles = atoi (argv[4]);
+    if (width < 1 || height < 1 || nfiles < 1)
+    {
+      fprintf (stderr, "mkcorpus error:  bad size or number of files\n");
+      return 1;
+    }
+  }
+
+  path = (char *) malloc (strlen (dir) + sizeof(name) + 16);
+  if (path == NULL)
+  {
+    fprintf (stderr, "mkcorpus error:  can't allocate memory for path\n");
+    return 4;
+  }
+  sprintf (path, "%s/cases", dir);
+  cases = fopen (path, "w");
+  if (cases == NULL)
+  {
+    fprintf (stderr, "mkcorpus error:  can't create %s\n", path);
+    return 1;
+  }
+
+  for (kind = kinds; kind->name; kind++)
+    for (d = 0; d < 6; d++)
+      for (planar = PLANARCONFIG_CONTIG; planar <= PLANARCONFIG_SEPARATE;
+           planar++)
+        for (tiled = FALSE; tiled <= TRUE; tiled++)
+          for (comp = compressions; comp->name; comp++)
+          {
+            bc.kind = kind->name;
+            bc.photometric = kind->value;
+            bc.bps = depths[d];
+            bc.spp = (bc.photometric == PHOTOMETRIC_RGB ||
+              bc.photometric == PHOTOMETRIC_YCBCR ||
+              bc.photometric == PHOTOMETRIC_LOGLUV)? 3 : 1;
+            bc.planar = planar;
+            bc.tiled = tiled;
+            bc.compression = comp->value;
+            if (!case_valid (&bc))
+              continue;
+
+            case_name (&bc, name);
+            for (i = 0; i < nfiles; i++)
+            {
+              /* the same pixels whatever the layout and compression */
+              seed = (ulg)((kind - kinds) * 1000 + bc.bps * 10 + i);
+              sprintf (path, "%s/%s-%d.tif", dir, name, i + 1);
+              if (!write_tiff (path, &bc, width, height))
+              {
+                fprintf (stderr, "mkcorpus error:  can't write %s\n", path);
+                fclose (cases);
+                return 1;
+              }
+            }
+            raw = (double)width * height * bc.spp * bc.bps / 8 * nfiles;
+            fprintf (cases, "%s %d %.0f\n", name, nfiles, raw);
+            ncases++;
+          }
+
+  fclose (cases);
+  free (path);
+  fprintf (stderr, "mkcorpus:  %d cases of %d file%s in %s\n", ncases,
+    nfiles, nfiles == 1? "" : "s", dir);
+
+  return 0;
+}
@@ -0,0 +1,481 @@
+/*
+** rowtest.c - checks tiff2png's row conversion kernels against the loop
+**             they replaced
+**
+** Distributed under the same terms as tiff2png.c.
+*/
+
+/* Usage:  rowtest
+ *
+ * Runs every row kernel (gray, gray+alpha, RGB and RGBA; 1, 2, 4, 8 and
+ * 16 bits; each inversion of the first and the other samples; either
+ * byte order of 16-bit samples) over rows of random bytes, of many widths
+ * and at every alignment, and compares what each writes with what the
+ * sample-at-a-time GET_LINE_SAMPLE loop of tiff2png 0.92 wrote for the
+ * same row.  That includes the table and SIMD unpacking of 1-, 2- and
+ * 4-bit samples and the SIMD byte swapping of 16-bit ones.
+ *
+ * It also counts runs of 2 to FAX_MAX pixels across and down the way
+ * -faxpect does, bit by bit, and compares those counts with what
+ * fax_across() and fax_down() make of the same rows, at odd widths too.
+ * Then it converts small faxes of n:1 and 1:n pixels with -faxpect, to
+ * check that tiff2png_run() gives the kernels buffers they can fill (which
+ * takes a build with -fsanitize=address to see for certain).
+ *
+ * Prints the first few differences and exits with 1 if there are any.
+ * "make check" runs it.
+ *
+ * The kernels are static, so the library is compiled into this program
+ * rather than linked with it. */
+
+#include "libtiff2png.c"
+
+#define MAX_COLS 4100		/* past a few SIMD blocks and tails */
+#define MAX_ERRORS 10
+
+/* the row widths tried:  every one up to 70, then a few longer ones */
+static const png_uint_32 widths[] = { 97, 128, 255, 1000, 4097 };
+
+/* the fax widths converted whole */
+static const png_uint_32 fax_widths[] = { 13, 29, 64, 101 };
+
+/* a PNG being read back from memory */
+typedef struct _png_mem {
+  uch *data;
+  size_t left;
+} png_mem;
+
+static int errors = 0;
+
+static void old_row (uch *tiffline, png_byte *pngline, png_uint_32 cols,
+                     int color_type, int spp, int bps, int invert,
+                     int miniswhite, int bigendian);
+static void check_row (int color_type, int spp, int bps, int invert,
+                       int miniswhite, int bigendian, png_uint_32 cols,
+                       int offset, uch *src);
+static void check_fax (int n, png_uint_32 cols, int flip, uch *src);
+static void check_counts (char *what, int n, png_uint_32 cols, int flip,
+                          png_byte *got, png_byte *want, size_t len,
+                          size_t limit);
+static void check_fax_image (int n, int down, png_uint_32 cols, uch *src);
+static void read_mem (png_structp png_ptr, png_bytep data, png_size_t length);
+
+/*---------------------------------------------------------------------------*/
+
+/* from tiff2png 0.92 */
+
+#define GET_LINE_SAMPLE \
+  { \
+    if (bitsleft == 0) \
+    { \
+      p_line++; \
+      bitsleft = 8; \
+    } \
+    bitsleft -= (bps >= 8) ? 8 : bps; \
+    sample = (*p_line >> bitsleft) & maxval; \
+    if (invert) \
+      sample = ~sample & maxval; \
+  }
+
+/* converts a row the way tiff2png 0.92 did (less -faxpect and the 16-bit
+ * debugging code), with invert for -invert and miniswhite for a
+ * PHOTOMETRIC_MINISWHITE image */
+static void old_row (tiffline, pngline, cols, color_type, spp, bps, invert,
+                     miniswhite, bigendian)
+  uch *tiffline;
+  png_byte *pngline;
+  png_uint_32 cols;
+  int color_type, spp, bps;
+  int invert, miniswhite, bigendian;
+{
+  uch *p_line = tiffline;
+  png_byte *p_png = pngline;
+  int bitsleft = 8;
+  int maxval = (1 << bps) - 1;
+  uch sample;
+  int sample16;
+  png_uint_32 col;
+  int i;
+
+  for (col = 0; col < cols; col++)
+  {
+    for (i = 0; i < spp; i++)
+    {
+      switch (bps)
+      {
+        case 16:
+          if (miniswhite && i == 0)
+          {
+            if (bigendian)
+            {
+              GET_LINE_SAMPLE
+              sample16 = (sample << 8);
+              GET_LINE_SAMPLE
+              sample16 |= sample;
+            }
+            else
+            {
+              GET_LINE_SAMPLE
+              sample16 = sample;
+              GET_LINE_SAMPLE
+              sample16 |= (((int)sample) << 8);
+            }
+            sample16 = maxval - sample16;
+            *p_png++ = (uch)((sample16 >> 8) & 0xff);
+            *p_png++ = (uch)(sample16 & 0xff);
+          }
+          else
+          {
+            if (bigendian)
+            {
+              GET_LINE_SAMPLE
+              *p_png++ = sample;
+              GET_LINE_SAMPLE
+              *p_png++ = sample;
+            }
+            else
+            {
+              GET_LINE_SAMPLE
+              p_png[1] = sample;
+              GET_LINE_SAMPLE
+              *p_png = sample;
+              p_png += 2;
+            }
+          }
+          break;
+
+        default:
+          GET_LINE_SAMPLE
+          if (miniswhite && i == 0)
+            sample = maxval - sample;
+          if (color_type == PNG_COLOR_TYPE_GRAY || bps == 8)
+            *p_png++ = sample;
+          else if (bps == 4)
+            *p_png++ = sample * 17;
+          else if (bps == 2)
+            *p_png++ = sample * 85;
+          else
+            *p_png++ = sample * 255;
+          break;
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* converts cols pixels of src, offset bytes into a buffer, with the kernel
+ * tiff2png would pick and with old_row(), and counts any difference */
+static void check_row (color_type, spp, bps, invert, miniswhite, bigendian,
+                       cols, offset, src)
+  int color_type, spp, bps;
+  int invert, miniswhite, bigendian;
+  png_uint_32 cols;
+  int offset;
+  uch *src;
+{
+  static png_byte want[MAX_COLS * 8], got[MAX_COLS * 8 + 16];
+  uch line[MAX_COLS * 8 + 16];
+  row_kernel kernel;
+  size_t n = (size_t)cols * spp * ((bps == 16)? 2 : 1);
+  size_t srcbytes = ((size_t)cols * spp * bps + 7) / 8;
+  size_t i;
+
+  kernel = row_kernel_lookup (color_type, spp, bps, invert != miniswhite,
+    invert, bigendian);
+  if (kernel == NULL)
+  {
+    printf ("rowtest:  no kernel for %d-bit color type %d, %d samples\n",
+      bps, color_type, spp);
+    errors++;
+    return;
+  }
+
+  memcpy (line + offset, src, srcbytes);
+  old_row (line + offset, want, cols, color_type, spp, bps, invert,
+    miniswhite, bigendian);
+  memset (got, 0xa5, sizeof(got));
+  (*kernel) (line + offset, got, cols);
+
+  for (i = 0; i < n + 16; i++)
+  {
+    if (i < n? got[i] == want[i] : got[i] == 0xa5)
+      continue;
+    if (++errors <= MAX_ERRORS)
+      printf ("rowtest:  %d-bit color type %d, invert %d, miniswhite %d, "
+        "%s-endian, %lu pixels at +%d:  byte %lu is %d, not %d\n", bps,
+        color_type, invert, miniswhite, bigendian? "big" : "little",
+        (ulg)cols, offset, (ulg)i, got[i], i < n? want[i] : 0xa5);
+    return;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* pixel i of a 1-bit row */
+#define FAX_PIXEL(row, i)	(((row)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+/* counts the runs of n pixels across the first row of src (cols pixels
+ * long) and down its first n rows, a pixel at a time, and compares the
+ * counts with what fax_across() and fax_down() write */
+static void check_fax (n, cols, flip, src)
+  int n;
+  png_uint_32 cols;
+  int flip;
+  uch *src;
+{
+  static png_byte want[MAX_COLS], got[MAX_COLS + 32];
+  size_t linebytes = ((size_t)cols + 7) / 8;
+  png_uint_32 width = cols / n, i;
+  int k;
+
+  for (i = 0; i < width; i++)
+    for (want[i] = 0, k = 0; k < n; k++)
+      want[i] += FAX_PIXEL (src, i * n + k) ^ (flip & 1);
+  memset (got, 0xa5, sizeof(got));
+  fax_across (src, got, width, n, flip);
+  check_counts ("across", n, cols, flip, got, want, width, width);
+
+  /* fax_down() may write up to a multiple of 8 pixels */
+  for (i = 0; i < cols; i++)
+    for (want[i] = 0, k = 0; k < n; k++)
+      want[i] += FAX_PIXEL (src + k * linebytes, i) ^ (flip & 1);
+  memset (got, 0xa5, sizeof(got));
+  for (k = 0; k < n; k++)
+    fax_down (src + k * linebytes, got, cols, k == 0, flip);
+  check_counts ("down", n, cols, flip, got, want, cols,
+    ((size_t)cols + 7) & ~(size_t)7);
+}
+
+/* compares len counts, with the canary bytes after the first limit */
+static void check_counts (what, n, cols, flip, got, want, len, limit)
+  char *what;
+  int n;
+  png_uint_32 cols;
+  int flip;
+  png_byte *got, *want;
+  size_t len, limit;
+{
+  size_t i;
+
+  for (i = 0; i < limit + 16; i++)
+  {
+    if (i < len? got[i] == want[i] : i < limit || got[i] == 0xa5)
+      continue;
+    if (++errors <= MAX_ERRORS)
+      printf ("rowtest:  fax %s by %d, flip %d, %lu pixels:  byte %lu is "
+        "%d, not %d\n", what, n, flip, (ulg)cols, (ulg)i, got[i],
+        i < len? want[i] : 0xa5);
+    return;
+  }
+}
+
+/* writes a 1-bit TIFF cols pixels wide of rows of src, with pixels n times
+ * taller than wide if down (else n times wider), converts it with -faxpect
+ * and checks the palette indices of the PNG */
+static void check_fax_image (n, down, cols, src)
+  int n, down;
+  png_uint_32 cols;
+  uch *src;
+{
+  static png_byte row[MAX_COLS];
+  char name[] = "rowtest.XXXXXX";
+  size_t linebytes = ((size_t)cols + 7) / 8;
+  png_uint_32 rows = down? 3 * n + 1 : 3;
+  png_uint_32 width = down? cols : cols / n, height = down? rows / n : rows;
+  png_uint_32 r, i;
+  tiff2png_options opts;
+  tiff2png_context *ctx;
+  tiff2png_buffer out;
+  png_structp png_ptr = NULL;
+  png_infop info_ptr = NULL;
+  png_mem mem;
+  uch *tiff = NULL;
+  long tiffsize = 0;
+  TIFF *tif;
+  FILE *fp;
+  int fd, k, count;
+
+  memset (&out, 0, sizeof(out));
+  fd = mkstemp (name);
+  if (fd < 0 || (tif = TIFFFdOpen (fd, name, "w")) == NULL)
+  {
+    printf ("rowtest:  can't write a TIFF in the current directory\n");
+    errors++;
+    return;
+  }
+  TIFFSetField (tif, TIFFTAG_IMAGEWIDTH, cols);
+  TIFFSetField (tif, TIFFTAG_IMAGELENGTH, rows);
+  TIFFSetField (tif, TIFFTAG_BITSPERSAMPLE, 1);
+  TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField (tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField (tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField (tif, TIFFTAG_ROWSPERSTRIP, rows);
+  TIFFSetField (tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
+  TIFFSetField (tif, TIFFTAG_XRESOLUTION, down? 200.0 : 200.0 * n);
+  TIFFSetField (tif, TIFFTAG_YRESOLUTION, down? 200.0 * n : 200.0);
+  for (r = 0; r < rows; r++)
+    TIFFWriteScanline (tif, src + r * linebytes, r, 0);
+  TIFFClose (tif);	/* and fd */
+
+  if ((fp = fopen (name, "rb")) != NULL)
+  {
+    fseek (fp, 0L, SEEK_END);
+    tiffsize = ftell (fp);
+    rewind (fp);
+    if (tiffsize > 0 && (tiff = (uch *) malloc (tiffsize)) != NULL &&
+        fread (tiff, 1, tiffsize, fp) != (size_t)tiffsize)
+    {
+      free (tiff);
+      tiff = NULL;
+    }
+    fclose (fp);
+  }
+  remove (name);
+
+  tiff2png_options_init (&opts);
+  opts.faxpect = TRUE;
+  ctx = tiff2png_context_create (&opts, NULL, NULL);
+  if (tiff == NULL || ctx == NULL ||
+      tiff2png_convert_buffer (ctx, tiff, tiffsize, &out, 0) != TIFF2PNG_OK)
+  {
+    printf ("rowtest:  fax %s by %d, %lu pixels:  conversion failed\n",
+      down? "down" : "across", n, (ulg)cols);
+    errors++;
+    goto done;
+  }
+
+  png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (png_ptr == NULL || (info_ptr = png_create_info_struct (png_ptr)) == NULL
+      || setjmp (png_jmpbuf (png_ptr)))
+  {
+    printf ("rowtest:  fax %s by %d, %lu pixels:  bad PNG\n",
+      down? "down" : "across", n, (ulg)cols);
+    errors++;
+    goto done;
+  }
+  mem.data = out.data;
+  mem.left = out.size;
+  png_set_read_fn (png_ptr, &mem, read_mem);
+  png_read_info (png_ptr, info_ptr);
+  if (png_get_image_width (png_ptr, info_ptr) != width ||
+      png_get_image_height (png_ptr, info_ptr) != height ||
+      png_get_color_type (png_ptr, info_ptr) != PNG_COLOR_TYPE_PALETTE)
+    png_error (png_ptr, "wrong size or type");
+  png_set_packing (png_ptr);	/* an index a byte */
+  png_read_update_info (png_ptr, info_ptr);
+
+  for (r = 0; r < height; r++)
+  {
+    png_read_row (png_ptr, row, NULL);
+    for (i = 0; i < width; i++)
+    {
+      for (count = 0, k = 0; k < n; k++)
+        count += down? FAX_PIXEL (src + (r * n + k) * linebytes, i) :
+          FAX_PIXEL (src + r * linebytes, i * n + k);
+      if (row[i] == count)
+        continue;
+      if (++errors <= MAX_ERRORS)
+        printf ("rowtest:  fax %s by %d, %lu pixels:  pixel %lu of row %lu "
+          "is %d, not %d\n", down? "down" : "across", n, (ulg)cols, (ulg)i,
+          (ulg)r, row[i], count);
+      goto done;
+    }
+  }
+
+done:
+  if (png_ptr != NULL)
+    png_destroy_read_struct (&png_ptr, info_ptr? &info_ptr : NULL, NULL);
+  tiff2png_buffer_free (&out);
+  if (ctx != NULL)
+    tiff2png_context_destroy (ctx);
+  free (tiff);
+}
+
+/* libpng's reader of the converted PNG in memory */
+static void read_mem (png_ptr, data, length)
+  png_structp png_ptr;
+  png_bytep data;
+  png_size_t length;
+{
+  png_mem *mem = (png_mem *) png_get_io_ptr (png_ptr);
+
+  if (length > mem->left)
+    png_error (png_ptr, "PNG is cut short");
+  memcpy (data, mem->data, length);
+  mem->data += length;
+  mem->left -= length;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+main (argc, argv)
+  int argc;
+  char *argv[];
+{
+  static const int color_types[] = {
+    PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB,
+    PNG_COLOR_TYPE_RGB_ALPHA
+  };
+  static const int spps[] = { 1, 2, 3, 4 };
+  static const int depths[] = { 1, 2, 4, 8, 16 };
+  static uch src[MAX_COLS * 16];
+  png_uint_32 cols;
+  ulg seed = 1, rows = 0;
+  int t, d, invert, miniswhite, bigendian, offset, w;
+  size_t i;
+
+  pthread_once (&fax_once, fax_init);
+
+  for (i = 0; i < sizeof(src); i++)
+  {
+    seed = (seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+    src[i] = (uch)(seed >> 16);
+  }
+
+  for (t = 0; t < 4; t++)
+    for (d = 0; d < 5; d++)
+      for (invert = 0; invert < 2; invert++)
+        for (miniswhite = 0; miniswhite < 2; miniswhite++)
+          for (bigendian = 0; bigendian < 2; bigendian++)
+          {
+            /* RGB has no MINISWHITE, and byte order is only for 16 bits */
+            if ((miniswhite && spps[t] > 2) || (bigendian && depths[d] < 16))
+              continue;
+            for (w = 0; w < 70 + (int)(sizeof(widths) / sizeof(widths[0]));
+                 w++)
+            {
+              cols = (w < 70)? w + 1 : widths[w - 70];
+              for (offset = 0; offset < 16; offset++, rows++)
+                check_row (color_types[t], spps[t], depths[d], invert,
+                  miniswhite, bigendian, cols, offset,
+                  src + (rows * 37) % (MAX_COLS * 8));
+            }
+          }
+
+  for (d = 2; d <= FAX_MAX; d++)
+    for (invert = 0; invert < 2; invert++)
+      for (w = 0; w < 70 + (int)(sizeof(widths) / sizeof(widths[0])); w++)
+      {
+        cols = (w < 70)? w + 1 : widths[w - 70];
+        for (offset = 0; offset < 16; offset++, rows++)
+          check_fax (d, cols, invert? 0xff : 0,
+            src + (rows * 37) % (MAX_COLS * 8));
+      }
+
+  for (d = 2; d <= FAX_MAX; d++)
+    for (w = 0; w < (int)(sizeof(fax_widths) / sizeof(fax_widths[0])); w++)
+    {
+      check_fax_image (d, FALSE, fax_widths[w], src + d * 100);
+      check_fax_image (d, TRUE, fax_widths[w], src + d * 100);
+    }
+
+  if (errors > 0)
+  {
+    printf ("rowtest:  %d of %lu rows differ\n", errors, rows);
+    return 1;
+  }
+  printf ("rowtest:  all %lu rows match\n", rows);
+  return 0;
+}
@@ -30,7 +30,7 @@
 **         add support for iCCP profiles (and autodetect sRGB?)
 **       / add support for text annotations
 **       \ incorporate Willem's remaining 0.82 changes
-**         check various "XXX" items (non-contiguous tiles? MINISWHITE RGB? ...)
+**         check various "XXX" items (MINISWHITE RGB? ...)
 **         create a man page
 **         [maybe switch to equivalent (OSS Certified) libpng or zlib license?]
 */
@@ -44,13 +44,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-#include "tiff.h"
 #include "tiffio.h"
 #include "png.h"
-
 #include "zlib.h"
 
+#include "tiff2png.h"
+
+#ifdef _WIN32	/* for binary stdin/stdout */
+#  include <fcntl.h>
+#  include <io.h>
+#else		/* for -serve and -cache */
+#  define HAVE_SERVE
+#  define HAVE_CACHE
+#  include <errno.h>
+#  include <signal.h>
+#  include <time.h>
+#  include <unistd.h>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <sys/un.h>
+#endif
+
 #ifdef _MSC_VER   /* works for MSVC 5.0; need finer tuning? */
 #  define strcasecmp _stricmp
 #endif
@@ -61,77 +77,108 @@
 #ifndef FALSE
 #  define FALSE 0
 #endif
-#ifndef NONE
-#  define NONE 0
-#endif
-
-#define MAXCOLORS 256
-
-#ifndef PHOTOMETRIC_DEPTH
-#  define PHOTOMETRIC_DEPTH 32768
-#endif
 
 #define DIR_SEP '/'		/* SJT: Unix-specific */
 
-typedef unsigned char  uch;
-typedef unsigned short ush;
-typedef unsigned long  ulg;
-
-typedef struct _jmpbuf_wrapper {
-  jmp_buf jmpbuf;
-} jmpbuf_wrapper;
-
-static jmpbuf_wrapper tiff2png_jmpbuf_struct;
+/* one input file of a batch run, and what became of it */
 
+typedef struct _batch_file {
+  char *tiffname;
+  char *pngname;
+  int page;			/* directory to convert (0 is the first) */
+  int status;
+} batch_file;
+
+/* the files of a batch run, handed out in order to whichever worker is idle
+ * next, so a single huge TIFF never holds up the rest of the queue */
+
+typedef struct _batch {
+  pthread_mutex_t lock;		/* protects next and stats */
+  batch_file *files;
+  int nfiles;
+  int next;			/* the next file to be taken */
+  tiff2png_options *opts;
+  FILE *stats;			/* where -stats records go */
+} batch;
+
+#ifdef HAVE_SERVE
+
+/* -serve:  a daemon converting on behalf of clients of a Unix domain socket,
+ * saving them the start-up of a tiff2png process per image.  -jobs workers
+ * each take one connection at a time, on which the client sends any number
+ * of requests, each a line of words optionally followed by data:
+ *
+ *   convert [<options>] <tiff> <png>	convert files (by the server's paths)
+ *   data [<options>] <n>		convert the <n> bytes of TIFF that
+ *					follow the line
+ *
+ * <options> are those of the command line that affect a conversion (-force,
+ * -compression, -threads, ...), on top of the server's own, plus -page <n>
+ * to convert the n-th page; the others (-cache, -jobs, -verbose, ...) are
+ * refused.  The answer is one line,
+ *
+ *   ok <ms> [<n>]			followed by the <n> bytes of PNG for data
+ *   error <status> <ms> <message>
+ *
+ * with the time the conversion took in milliseconds.  Each worker keeps its
+ * buffers from one request to the next. */
+
+#define SERVE_LINE 4096		/* longest request line */
+#define SERVE_WORDS 64		/* most words in a request */
+
+typedef struct _server {
+  int fd;			/* listening socket */
+  tiff2png_options *opts;	/* defaults for every request */
+} server;
+
+typedef struct _serve_buffers {
+  unsigned char *in;		/* TIFF of a data request */
+  size_t inalloc;
+  tiff2png_buffer out;		/* PNG of a data request */
+  char warning[256];		/* the last one, for a request that fails
+				 * without an error (a PNG not overwritten) */
+} serve_buffers;
+
+/* the options only main() takes, each with as many letters as it matches
+ * of it, which requests don't get to parse_option() */
+
+typedef struct _cli_option {
+  char *name;
+  int len;
+} cli_option;
+
+static cli_option cli_options[] = {
+  { "-help",	2 },
+  { "-verbose",	2 },
+  { "-destdir",	2 },
+  { "-pages",	2 },
+  { "-stats",	4 },
+  { "-sizes",	3 },
+  { "-cache",	3 },
+  { "-jobs",	2 },
+  { "-serve",	3 },
+  { NULL,	0 }
+};
+
+#endif /* HAVE_SERVE */
 
 /* local prototypes */
 
 static void usage (int rc);
-static void tiff2png_error_handler (png_structp png_ptr, png_const_charp msg);
-int tiff2png (char *tiffname, char *pngname, int verbose, int force,
-              int interlace_type, int png_compression_level, int invert,
-              int faxpect_option,
-              double gamma);
-
-
-/* macros to get and put bits out of the bytes */
-
-#define GET_LINE_SAMPLE \
-  { \
-    if (bitsleft == 0) \
-    { \
-      p_line++; \
-      bitsleft = 8; \
-    } \
-    bitsleft -= (bps >= 8) ? 8 : bps; \
-    sample = (*p_line >> bitsleft) & maxval; \
-    if (invert) \
-      sample = ~sample & maxval; \
-  }
-#define GET_STRIP_SAMPLE \
-  { \
-    if (getbitsleft == 0) \
-    { \
-      p_strip++; \
-      getbitsleft = 8; \
-    } \
-    getbitsleft -= (bps >= 8) ? 8 : bps; \
-    sample = (*p_strip >> getbitsleft) & maxval; \
-    if (invert) \
-      sample = ~sample & maxval; \
-  }
-#define PUT_LINE_SAMPLE \
-  { \
-    if (putbitsleft == 0) \
-    { \
-      p_line++; \
-      putbitsleft = 8; \
-    } \
-    putbitsleft -= (bps >= 8) ? 8 : bps; \
-    if (invert) \
-      sample = ~sample; \
-    *p_line |= ((sample & maxval) << putbitsleft); \
-  }
+static void *batch_worker (void *arg);
+static void print_stats (FILE *fp, batch_file *f, tiff2png_stats *st);
+static void print_json_string (FILE *fp, char *str);
+static int parse_pages (char *arg, int *first, int *last);
+static int parse_option (int argc, char *argv[], int *argn,
+                         tiff2png_options *opts, char **err);
+#ifdef HAVE_SERVE
+static int serve (char *path, tiff2png_options *opts, int jobs);
+static void *serve_worker (void *arg);
+static void serve_message (void *arg, int level, char *msg);
+static void serve_connection (server *srv, int fd, serve_buffers *bufs);
+static int serve_request (server *srv, char *line, FILE *in, FILE *out,
+                          serve_buffers *bufs);
+#endif
 
 /*----------------------------------------------------------------------------*/
 
@@ -163,9 +210,22 @@ static void usage (rc)
   fprintf (stderr,
     "Usage:  tiff2png [-verbose] [-force] [-destdir <dir>] [-compression <val>]"
     "\n                 [-gamma <val>] [-interlace] [-invert] "
-    "[-faxpect] "
-    "<file> [...]\n\n"
-    "Read each <file> and convert to PNG format"
+    "[-faxpect] [-reduce]\n"
+    "                 [-jobs <n>] [-threads <n>] [-filter <set>] "
+    "[-strategy <name>]"
+    "\n                 [-backend <name>] [-mmap] [-pages <range>] [-stats]"
+    "\n                 [-sizes <list>] [-crop <x>,<y>,<w>,<h>] "
+    "[-max-memory <n>]"
+#ifdef HAVE_CACHE
+    "\n                 [-cache <dir>]"
+#endif
+    " <file> [...]"
+#ifdef HAVE_SERVE
+    "\n        tiff2png [<options>] [-jobs <n>] -serve <socket>"
+#endif
+    "\n\n"
+    "Read each <file> (\"-\" for stdin, converted to stdout) and convert to"
+    "\nPNG format"
 #ifdef DESTDIR_IS_CURDIR
     " (in the current directory).\n"
 #else
@@ -181,1192 +241,601 @@ static void usage (rc)
     "   -interlace    write interlaced PNGs\n"
     "   -invert       invert grayscale images (swaps black/white)\n");
   fprintf (stderr,
-    "   -faxpect      convert fax with 2:1 aspect ratio to square pixels\n");
+    "   -faxpect      convert fax with 2:1 (or n:1 or 1:n) aspect ratio to\n"
+    "                 square pixels\n"
+    "   -reduce       write the smallest PNG type that holds the image exactly\n"
+    "                 (palette, gray, no alpha, fewer bits)\n"
+    "   -crop         convert only the <w> by <h> window at <x>,<y>, decoding\n"
+    "                 just the strips or tiles that cross it\n"
+    "   -max-memory   buffer no more than <n> bytes (or <n>K, M or G) of image\n"
+    "                 data per image, decoding tiles again or using temp files\n"
+    "                 as needed\n"
+    "   -jobs         convert up to <n> files at once (default 1)\n"
+    "   -threads      decode and compress each image with <n> threads\n"
+    "   -filter       PNG row filters to choose from:  none, sub, up, avg,\n"
+    "                 paeth (comma-separated), all, or auto (tried per image)\n"
+    "   -strategy     zlib strategy:  default, filtered, huffman, rle, fixed,\n"
+    "                 or auto (tried per image)\n"
+    "   -backend      deflate with zlib (default), "
+#ifdef HAVE_LIBDEFLATE
+    "libdeflate (faster), "
+#endif
+    "or\n"
+    "                 exhaustive (slowest, smallest)\n"
+    "   -mmap         read TIFFs through a memory mapping\n"
+    "   -pages        convert pages <n>, <n>-<m>, <n>- or all of each TIFF, to\n"
+    "                 <name>-NNN.png (converted side by side with -jobs)\n"
+    "   -stats        print a line of JSON per file with the time spent on\n"
+    "                 each phase, bytes in and out and peak buffer memory\n"
+    "                 (on stdout, or stderr if a PNG goes there)\n"
+    "   -sizes        write <name>-<n>.png no more than <n> pixels on a side\n"
+    "                 for each <n> of <list> (comma-separated; \"full\" for\n"
+    "                 <name>.png itself), all from one decoding of the TIFF\n"
+#ifdef HAVE_CACHE
+    "   -cache        reuse PNGs converted before from the same TIFF with the\n"
+    "                 same options, kept in <dir>; out-of-date PNGs are\n"
+    "                 replaced (hard links into <dir>, or copies)\n"
+#endif
+#ifdef HAVE_SERVE
+    "   -serve        convert for clients of Unix domain <socket> instead, on\n"
+    "                 -jobs workers (see tiff2png.c for the protocol)\n"
+#endif
+    );
 
   exit (rc);
 }
 
 /*----------------------------------------------------------------------------*/
 
-static void tiff2png_error_handler (png_ptr, msg)
-  png_structp png_ptr;
-  png_const_charp msg;
+/* converts files of the batch until there are none left, with a context of
+ * its own */
+static void *batch_worker (arg)
+  void *arg;
 {
-  jmpbuf_wrapper  *jmpbuf_ptr;
-
-  /* this function, aside from the extra step of retrieving the "error
-   * pointer" (below) and the fact that it exists within the application
-   * rather than within libpng, is essentially identical to libpng's
-   * default error handler.  The second point is critical:  since both
-   * setjmp() and longjmp() are called from the same code, they are
-   * guaranteed to have compatible notions of how big a jmp_buf is,
-   * regardless of whether _BSD_SOURCE or anything else has (or has not)
-   * been defined. */
-
-  fprintf (stderr, "tiff2png:  fatal libpng error: %s\n", msg);
-  fflush (stderr);
-
-  jmpbuf_ptr = png_get_error_ptr (png_ptr);
-  if (jmpbuf_ptr == NULL) {         /* we are completely hosed now */
-    fprintf (stderr,
-      "tiff2png:  EXTREMELY fatal error: jmpbuf unrecoverable; terminating.\n");
-    fflush (stderr);
-    exit (99);
+  batch *b = (batch *)arg;
+  tiff2png_context *ctx;
+  int i;
+
+  ctx = tiff2png_context_create (b->opts, NULL, NULL);
+  for (;;)
+  {
+    pthread_mutex_lock (&b->lock);
+    i = b->next++;
+    pthread_mutex_unlock (&b->lock);
+    if (i >= b->nfiles)
+      break;
+
+    if (ctx == NULL)
+    {
+      fprintf (stderr,
+        "tiff2png error:  can't allocate memory for conversion context\n");
+      b->files[i].status = TIFF2PNG_NOMEM;
+    }
+    else
+    {
+      b->files[i].status = tiff2png_convert (ctx, b->files[i].tiffname,
+        b->files[i].pngname, b->files[i].page);
+      if (b->opts->stats)
+      {
+        pthread_mutex_lock (&b->lock);
+        print_stats (b->stats, &b->files[i], tiff2png_last_stats (ctx));
+        pthread_mutex_unlock (&b->lock);
+      }
+    }
   }
+  if (ctx)
+    tiff2png_context_destroy (ctx);
 
-  longjmp (jmpbuf_ptr->jmpbuf, 1);
+  return NULL;
 }
 
-/*----------------------------------------------------------------------------*/
+/* prints the -stats record of a file as one line of JSON */
+static void print_stats (fp, f, st)
+  FILE *fp;
+  batch_file *f;
+  tiff2png_stats *st;
+{
+  fprintf (fp, "{\"file\":");
+  print_json_string (fp, f->tiffname);
+  fprintf (fp, ",\"page\":%d,\"png\":", f->page + 1);
+  print_json_string (fp, f->pngname);
+  fprintf (fp, ",\"status\":%d,\"wall\":%.6f,\"cpu\":%.6f", f->status,
+    st->wall, st->cpu);
+  fprintf (fp, ",\"decode\":{\"wall\":%.6f,\"cpu\":%.6f}",
+    st->decode_wall, st->decode_cpu);
+  fprintf (fp, ",\"convert\":{\"wall\":%.6f,\"cpu\":%.6f}",
+    st->convert_wall, st->convert_cpu);
+  fprintf (fp, ",\"deflate\":{\"wall\":%.6f,\"cpu\":%.6f}",
+    st->deflate_wall, st->deflate_cpu);
+  fprintf (fp, ",\"output\":{\"wall\":%.6f,\"cpu\":%.6f}",
+    st->output_wall, st->output_cpu);
+  fprintf (fp, ",\"bytes_in\":%llu,\"bytes_out\":%llu,"
+    "\"peak_memory\":%llu}\n", (unsigned long long)st->bytes_in,
+    (unsigned long long)st->bytes_out, (unsigned long long)st->peak_memory);
+  fflush (fp);
+}
 
-int
-tiff2png (tiffname, pngname, verbose, force, interlace_type,
-          png_compression_level, _invert, faxpect_option, gamma)
-  char *tiffname, *pngname;
-  int verbose, force, interlace_type, png_compression_level, _invert;
-  int faxpect_option;
-  double gamma;
+static void print_json_string (fp, str)
+  FILE *fp;
+  char *str;
 {
-  static TIFF *tif = NULL;				/* TIFF */
-  ush bps, spp, planar;
-  ush photometric, tiff_compression_method;
-  int bigendian;
-  int maxval;
-  static int colors = 0;
-  static int halfcols = 0;
-  int cols, rows;
-  int row;
-  register int col;
-  static uch *tiffstrip = NULL;
-  uch *tiffline;
-
-  size_t stripsz;
-  static size_t tilesz = 0L;
-  uch *tifftile; /* FAP 20020610 - Add variables to support tiled images */
-  ush tiled;
-  uint32 tile_width, tile_height;   /* typedef'd in tiff.h */
-  static int num_tilesX = 0;
-
-  register uch *p_strip, *p_line;
-  register uch sample;
-#ifdef INVERT_MINISWHITE
-  int sample16;
-#endif
-  register int bitsleft;
-  register int getbitsleft;
-  register int putbitsleft;
-  float xres, yres, ratio;
-#ifdef GRR_16BIT_DEBUG
-  uch msb_max, lsb_max;
-  uch msb_min, lsb_min;
-  int s16_max, s16_min;
-#endif
+  unsigned char c;
 
-  static FILE *png = NULL;				/* PNG */
-  png_struct *png_ptr;
-  png_info *info_ptr;
-  png_byte *pngline;
-  png_byte *p_png;
-  png_color palette[MAXCOLORS];
-  static png_uint_32 width;
-  int bit_depth = 0;
-  int color_type = -1;
-  int tiff_color_type;
-  int pass;
-  static png_uint_32 res_x_half=0L, res_x=0L, res_y=0L;
-  static int unit_type = 0;
-
-  unsigned short *redcolormap;
-  unsigned short *greencolormap;
-  unsigned short *bluecolormap;
-  static int have_res = FALSE;
-  static int invert;
-  int faxpect;
-  long i, n;
-
-
-  /* first figure out whether this machine is big- or little-endian */
+  putc ('"', fp);
+  for (; (c = (unsigned char)*str) != '\0'; str++)
   {
-    union { int32 i; char c[4]; } endian_tester;
-
-    endian_tester.i = 1;
-    bigendian = (endian_tester.c[0] == 0);
+    if (c == '"' || c == '\\')
+      fprintf (fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf (fp, "\\u%04x", c);
+    else
+      putc (c, fp);
   }
+  putc ('"', fp);
+}
 
-/*
-  tilesz = 0L;
-  num_tilesX = 0;
- */
-  invert = _invert;
+/*----------------------------------------------------------------------------*/
+
+/* parses a -pages range, counting from 1:  "all", "<n>", "<n>-" or
+ * "<n>-<m>", with *last 0 for "to the end"; returns FALSE if it's none */
+static int parse_pages (arg, first, last)
+  char *arg;
+  int *first, *last;
+{
+  char *end;
 
-  tif = TIFFOpen (tiffname, "r");
-  if (tif == NULL)
+  if (strcmp (arg, "all") == 0)
   {
-    fprintf (stderr, "tiff2png error:  TIFF file %s not found\n", tiffname);
-    return 1;
+    *first = 1;
+    *last = 0;
+    return TRUE;
   }
-
-  if (!force)
+  *first = (int) strtol (arg, &end, 10);
+  if (end == arg || *first < 1)
+    return FALSE;
+  if (*end == '\0')
   {
-    png = fopen (pngname, "rb");
-    if (png)
-    {
-      fprintf (stderr, "tiff2png warning:  PNG file %s exists: skipping\n",
-        pngname);
-      fclose (png);
-      TIFFClose (tif);
-      return 1;
-    }
+    *last = *first;
+    return TRUE;
   }
-
-  png = fopen (pngname, "wb");
-  if (png == NULL)
+  if (*end++ != '-')
+    return FALSE;
+  if (*end == '\0')
   {
-    fprintf (stderr, "tiff2png error:  PNG file %s cannot be created\n",
-      pngname);
-    TIFFClose (tif);
-    return 1;
+    *last = 0;
+    return TRUE;
   }
+  *last = (int) strtol (end, &arg, 10);
+  return (arg != end && *arg == '\0' && *last >= *first);
+}
 
-  if (verbose)
-    fprintf (stderr, "\ntiff2png:  converting %s to %s\n", tiffname, pngname);
-
-
-  /* start PNG preparation */
+/*----------------------------------------------------------------------------*/
 
-  png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING,
-    &tiff2png_jmpbuf_struct, tiff2png_error_handler, NULL);
-  if (!png_ptr)
+/* parses the conversion option at argv[*argn] (and its value, leaving *argn
+ * on it) into opts, for the command line and for -serve requests alike.
+ * Returns 1 if it was one, 0 if it wasn't, or -1 if its value was missing
+ * (*err NULL) or bad (*err a message format taking the value). */
+static int parse_option (argc, argv, argn, opts, err)
+  int argc;
+  char *argv[];
+  int *argn;
+  tiff2png_options *opts;
+  char **err;
+{
+  char *arg = argv[*argn];
+  char *val = NULL;
+
+  *err = NULL;
+  if (strncmp (arg, "-force", 3) == 0)
+    opts->force = TRUE;
+  else if (strncmp (arg, "-interlace", 4) == 0)
+    opts->interlace = TRUE;
+  else if (strncmp (arg, "-invert", 4) == 0)
+    opts->invert = TRUE;
+  else if (strncmp (arg, "-faxpect", 3) == 0)
+    opts->faxpect = TRUE;
+  else if (strncmp (arg, "-mmap", 3) == 0)
+    opts->use_mmap = TRUE;
+  else if (strncmp (arg, "-reduce", 3) == 0)
+    opts->reduce = TRUE;
+  else if (strncmp (arg, "-backend", 2) == 0 ||
+           strncmp (arg, "-crop", 3) == 0 ||
+           strncmp (arg, "-compression", 2) == 0 ||
+           strncmp (arg, "-gamma", 2) == 0 ||
+           strncmp (arg, "-max-memory", 3) == 0 ||
+           strncmp (arg, "-filter", 3) == 0 ||
+           strncmp (arg, "-strategy", 4) == 0 ||
+           strncmp (arg, "-threads", 2) == 0)
   {
-    fprintf (stderr,
-      "tiff2png error:  cannot allocate libpng main struct (%s)\n", pngname);
-    TIFFClose (tif);
-    fclose (png);
-    return 4;
+    if (*argn + 1 >= argc)
+      return -1;
+    val = argv[++*argn];
   }
+  else
+    return 0;
+  if (val == NULL)
+    return 1;
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
+  if (arg[1] == 'b')
   {
-    fprintf (stderr,
-      "tiff2png error:  cannot allocate libpng info struct (%s)\n", pngname);
-    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-    TIFFClose (tif);
-    fclose (png);
-    return 4;
+    opts->backend = val;
+    if (!tiff2png_has_backend (val))
+      *err = "unknown deflate backend \"%s\"";
   }
+  else if (arg[1] == 'c' && arg[2] == 'r')
+  {
+    unsigned long x, y, w, h;
+    char c;
 
-  if (setjmp (tiff2png_jmpbuf_struct.jmpbuf))
+    if (sscanf (val, "%lu,%lu,%lu,%lu%c", &x, &y, &w, &h, &c) != 4 ||
+        w == 0 || h == 0 || x > 0xffffffffUL || y > 0xffffffffUL ||
+        w > 0xffffffffUL || h > 0xffffffffUL)
+      *err = "crop window must be <x>,<y>,<width>,<height>";
+    else
+    {
+      opts->crop_x = x;
+      opts->crop_y = y;
+      opts->crop_width = w;
+      opts->crop_height = h;
+    }
+  }
+  else if (arg[1] == 'c')
   {
-    fprintf (stderr, "tiff2png error:  libpng returns error condition (%s)\n",
-      pngname);
-    png_destroy_write_struct (&png_ptr, &info_ptr);
-    TIFFClose (tif);
-    fclose (png);
-    return 1;
+    opts->compression_level = -1;
+    sscanf (val, "%d", &opts->compression_level);
+    if (opts->compression_level < 0 || opts->compression_level > 9)
+      *err = "compression level must be between 0 and 9";
   }
+  else if (arg[1] == 'm')
+  {
+    unsigned long n = 0;
+    char unit = 0, c;
+    int shift;
 
-  png_init_io (png_ptr, png);
+    if (sscanf (val, "%lu%c%c", &n, &unit, &c) > 2 || n == 0)
+      unit = '?';
+    switch (unit)
+    {
+      case 'g': case 'G':	shift = 30;	break;
+      case 'm': case 'M':	shift = 20;	break;
+      case 'k': case 'K':	shift = 10;	break;
+      case 0:			shift = 0;	break;
+      default:			shift = -1;	break;
+    }
+    /* (a limit that wrapped around to 0 would be no limit at all) */
+    if (shift < 0 || (uint64_t)n > UINT64_MAX >> shift)
+      *err = "memory limit must be a number of bytes, or of K, M or G";
+    else
+      opts->max_memory = (uint64_t)n << shift;
+  }
+  else if (arg[1] == 'g')
+  {
+    opts->gamma = -1.0;
+    sscanf (val, "%lf", &opts->gamma);
+    if (opts->gamma <= 0.0)
+      *err = "gamma value must be greater than zero";
+  }
+  else if (arg[1] == 'f')
+  {
+    opts->filters = tiff2png_parse_filters (val);
+    if (opts->filters == 0)
+      *err = "unknown filter in \"%s\"";
+  }
+  else if (arg[1] == 's')
+  {
+    opts->strategy = tiff2png_parse_strategy (val);
+    if (opts->strategy == TIFF2PNG_DEFAULT)
+      *err = "unknown zlib strategy \"%s\"";
+  }
+  else
+  {
+    opts->threads = 0;
+    sscanf (val, "%d", &opts->threads);
+    if (opts->threads < 1)
+      *err = "number of threads must be at least 1";
+  }
 
+  return *err? -1 : 1;
+}
 
-  /* get TIFF header info */
+#ifdef HAVE_SERVE
+/*----------------------------------------------------------------------------*/
 
-  if (verbose)
+/* listens on the socket at path and serves requests with jobs workers until
+ * killed; returns only if the socket can't be set up */
+static int serve (path, opts, jobs)
+  char *path;
+  tiff2png_options *opts;
+  int jobs;
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  server srv;
+  pthread_t *workers;
+  int nworkers = 0;
+  int i;
+
+  if (strlen (path) >= sizeof(addr.sun_path))
   {
-    int byteswapped = TIFFIsByteSwapped(tif);   /* why no TIFFIsBigEndian()?? */
-
-    fprintf (stderr, "tiff2png:  ");
-    TIFFPrintDirectory (tif, stderr, TIFFPRINT_NONE);
-    fprintf (stderr, "tiff2png:  byte order = %s\n",
-      ((bigendian && byteswapped) || (!bigendian && !byteswapped))?
-      "little-endian (Intel)" : "big-endian (Motorola)");
-    fprintf (stderr, "tiff2png:  this machine is %s-endian\n",
-      bigendian? "big" : "little");
+    fprintf (stderr, "tiff2png error:  socket name %s is too long\n", path);
+    return 1;
   }
-
-  if (! TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric))
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  /* a socket left behind by an earlier server is in the way of bind() */
+  if (stat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (path);
+
+  srv.fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (srv.fd < 0 ||
+      bind (srv.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen (srv.fd, 64) != 0)
   {
-    fprintf (stderr,
-      "tiff2png error:  photometric could not be retrieved (%s)\n", tiffname);
-    png_destroy_write_struct (&png_ptr, &info_ptr);
-    TIFFClose (tif);
-    fclose (png);
+    fprintf (stderr, "tiff2png error:  can't listen on %s: %s\n", path,
+      strerror (errno));
+    if (srv.fd >= 0)
+      close (srv.fd);
     return 1;
   }
-  if (! TIFFGetField (tif, TIFFTAG_BITSPERSAMPLE, &bps))
-    bps = 1;
-  if (! TIFFGetField (tif, TIFFTAG_SAMPLESPERPIXEL, &spp))
-    spp = 1;
-  if (! TIFFGetField (tif, TIFFTAG_PLANARCONFIG, &planar))
-    planar = 1;
+  srv.opts = opts;
 
-  tiled = TIFFIsTiled(tif); /* FAP 20020610 - get tiled flag */
+  /* a client hanging up shouldn't take the server with it */
+  signal (SIGPIPE, SIG_IGN);
 
-  (void) TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &cols);
-  (void) TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &rows);
-  width = cols;
+  if (opts->verbose)
+    fprintf (stderr, "tiff2png:  serving on %s with %d worker%s\n", path,
+      jobs, jobs == 1? "" : "s");
 
-  ratio = 0.0;
-
-  if (TIFFGetField (tif, TIFFTAG_XRESOLUTION, &xres) &&
-      TIFFGetField (tif, TIFFTAG_YRESOLUTION, &yres) &&  /* no default value */
-      (xres != 0.0) && (yres != 0.0))
+  workers = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+  if (workers)
   {
-    uint16 resunit;   /* typedef'd in tiff.h */
-
-    have_res = TRUE;
-    ratio = xres / yres;
-    if (verbose)
-    {
-      fprintf (stderr, "tiff2png:  aspect ratio (hor/vert) = %g (%g / %g)\n",
-        ratio, xres, yres);
-      if (0.95 < ratio && ratio < 1.05)
-        fprintf (stderr, "tiff2png:  near-unity aspect ratio\n");
-      else if (1.90 < ratio && ratio < 2.10)
-        fprintf (stderr, "tiff2png:  near-2X aspect ratio\n");
-      else
-        fprintf (stderr, "tiff2png:  non-square, non-2X pixels\n");
-    }
+    while (nworkers < jobs &&
+           pthread_create (&workers[nworkers], NULL, serve_worker, &srv) == 0)
+      nworkers++;
+  }
+  if (nworkers == 0)
+    serve_worker (&srv);
+  for (i = 0; i < nworkers; i++)
+    pthread_join (workers[i], NULL);
+  free(workers);
+
+  close (srv.fd);
+  unlink (path);
+  return 1;
+}
 
-#if 0
-    /* GRR: this should be fine and works sometimes, but occasionally it
-     *  seems to cause a segfault--which may be more related to Linux 2.2.10
-     *  and/or SMP and/or heavy CPU loading.  Disabled for now. */
-    (void) TIFFGetFieldDefaulted (tif, TIFFTAG_RESOLUTIONUNIT, &resunit);
-#else
-    if (! TIFFGetField (tif, TIFFTAG_RESOLUTIONUNIT, &resunit))
-      resunit = RESUNIT_INCH;  /* default (see libtiff tif_dir.c) */
-#endif
+/* takes connections one at a time until the socket fails */
+static void *serve_worker (arg)
+  void *arg;
+{
+  server *srv = (server *)arg;
+  serve_buffers bufs;
+  int fd;
 
-    /* convert from TIFF data (floats) to PNG data (unsigned longs) */
-    switch (resunit)
+  memset (&bufs, 0, sizeof(bufs));
+  for (;;)
+  {
+    fd = accept (srv->fd, NULL, NULL);
+    if (fd < 0)
     {
-      case RESUNIT_CENTIMETER:
-        res_x_half = (png_uint_32)(50.0*xres + 0.5);
-        res_x = (png_uint_32)(100.0*xres + 0.5);
-        res_y = (png_uint_32)(100.0*yres + 0.5);
-        unit_type = PNG_RESOLUTION_METER;
-        break;
-      case RESUNIT_INCH:
-        res_x_half = (png_uint_32)(0.5*39.37*xres + 0.5);
-        res_x = (png_uint_32)(39.37*xres + 0.5);
-        res_y = (png_uint_32)(39.37*yres + 0.5);
-        unit_type = PNG_RESOLUTION_METER;
-        break;
-/*    case RESUNIT_NONE:   */
-      default:
-        res_x_half = (png_uint_32)(50.0*xres + 0.5);
-        res_x = (png_uint_32)(100.0*xres + 0.5);
-        res_y = (png_uint_32)(100.0*yres + 0.5);
-        unit_type = PNG_RESOLUTION_UNKNOWN;
-        break;
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf (stderr, "tiff2png error:  accept failed: %s\n",
+        strerror (errno));
+      break;
     }
+    serve_connection (srv, fd, &bufs);
   }
+  free (bufs.in);
+  tiff2png_buffer_free (&bufs.out);
 
-  if (verbose)
-  {
-    fprintf (stderr, "tiff2png:  %dx%dx%d image\n", cols, rows, bps * spp);
-    fprintf (stderr, "tiff2png:  %d bit%s/sample, %d sample%s/pixel\n",
-      bps, bps == 1? "" : "s", spp, spp == 1? "" : "s");
-  }
+  return NULL;
+}
 
-  /* detect tiff filetype */
+/* logs the messages of a request like any others, keeping its warnings */
+static void serve_message (arg, level, msg)
+  void *arg;
+  int level;
+  char *msg;
+{
+  serve_buffers *bufs = (serve_buffers *)arg;
 
-  maxval = (1 << bps) - 1;
-  if (verbose)
-    fprintf (stderr, "tiff2png:  maxval=%d\n", maxval);
+  fprintf (stderr, "tiff2png %s:  %s\n",
+    level == TIFF2PNG_ERROR? "error" : "warning", msg);
+  if (level == TIFF2PNG_WARNING)
+    sprintf (bufs->warning, "%.*s", (int)sizeof(bufs->warning) - 1, msg);
+}
 
-  switch (photometric)
+/* answers the requests of one client until it hangs up */
+static void serve_connection (srv, fd, bufs)
+  server *srv;
+  int fd;
+  serve_buffers *bufs;
+{
+  char line[SERVE_LINE];
+  FILE *in, *out;
+  int wfd;
+
+  in = fdopen (fd, "rb");
+  wfd = dup (fd);
+  out = (wfd < 0)? NULL : fdopen (wfd, "wb");
+  if (in == NULL || out == NULL)
   {
-    case PHOTOMETRIC_MINISWHITE:
-    case PHOTOMETRIC_MINISBLACK:
-      if (verbose)
-	fprintf (stderr, "tiff2png:  %d graylevels (min = %s)\n", maxval + 1,
-	  photometric == PHOTOMETRIC_MINISBLACK? "black" : "white");
-      if (spp == 1) /* no alpha */
-      {
-	color_type = PNG_COLOR_TYPE_GRAY;
-	if (verbose)
-	  fprintf (stderr, "tiff2png:  color type = grayscale\n");
-	bit_depth = bps;
-      }
-      else /* must be alpha */
-      {
-	color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-	if (verbose)
-	  fprintf (stderr, "tiff2png:  color type = grayscale + alpha\n");
-	if (bps <= 8)
-	  bit_depth = 8;
-	else
-	  bit_depth = bps;
-      }
-      break;
+    if (in)
+      fclose (in);
+    else
+      close (fd);
+    if (out)
+      fclose (out);
+    else if (wfd >= 0)
+      close (wfd);
+    return;
+  }
 
-    case PHOTOMETRIC_PALETTE:
+  while (fgets (line, sizeof(line), in))
+  {
+    if (strchr (line, '\n') == NULL && !feof (in))
     {
-      int palette_8bit; /* set iff all color values in TIFF palette are < 256 */
-
-      color_type = PNG_COLOR_TYPE_PALETTE;
-      if (verbose)
-	fprintf (stderr, "tiff2png:  color type = paletted\n");
-
-      if (! TIFFGetField (tif, TIFFTAG_COLORMAP, &redcolormap, &greencolormap,
-          &bluecolormap))
-      {
-	fprintf (stderr,
-          "tiff2png error:  cannot retrieve TIFF colormaps (%s)\n", tiffname);
-        png_destroy_write_struct (&png_ptr, &info_ptr);
-        TIFFClose (tif);
-        fclose (png);
-	return 1;
-      }
-      colors = maxval + 1;
-      if (colors > MAXCOLORS)
-      {
-	fprintf (stderr,
-          "tiff2png error:  palette too large (%d colors) (%s)\n", colors,
-          tiffname);
-        png_destroy_write_struct (&png_ptr, &info_ptr);
-        TIFFClose (tif);
-        fclose (png);
-	return 1;
-      }
-      /* max PNG palette-size is 8 bits, you could convert to full-color */
-      if (bps >= 8) 
-	bit_depth = 8;
-      else
-	bit_depth = bps;
-
-      /* PLTE chunk */
-      /* TIFF palettes contain 16-bit shorts, while PNG palettes are 8-bit */
-      /* Some broken (??) software puts 8-bit values in the shorts, which would
-         make the palette come out all zeros, which isn't good. We check... */
-      palette_8bit = 1;
-      for (i = 0 ; i < colors ; i++)
-      {
-        if ( redcolormap[i] > 255   || 
-             greencolormap[i] > 255 ||
-             bluecolormap[i] > 255)
-        {
-           palette_8bit = 0;
-           break;
-        }
-      }	
-      if (palette_8bit && verbose)
-        fprintf(stderr, "tiff2png warning:  assuming 8-bit palette values\n");
-
-      for (i = 0 ; i < colors ; i++)
-      {
-        if (invert)
-        {
-          if (palette_8bit)
-          {
-            palette[i].red   = ~((png_byte) redcolormap[i]);
-            palette[i].green = ~((png_byte) greencolormap[i]);
-            palette[i].blue  = ~((png_byte) bluecolormap[i]);
-          }
-          else
-          {
-            palette[i].red   = ~((png_byte) (redcolormap[i] >> 8));
-            palette[i].green = ~((png_byte) (greencolormap[i] >> 8));
-            palette[i].blue  = ~((png_byte) (bluecolormap[i] >> 8));
-          }
-        }
-        else
-        {
-          if (palette_8bit)
-          {
-	    palette[i].red   = (png_byte) redcolormap[i];
-	    palette[i].green = (png_byte) greencolormap[i];
-	    palette[i].blue  = (png_byte) bluecolormap[i];
-          }
-          else
-          {
-	    palette[i].red   = (png_byte) (redcolormap[i] >> 8);
-	    palette[i].green = (png_byte) (greencolormap[i] >> 8);
-	    palette[i].blue  = (png_byte) (bluecolormap[i] >> 8);
-          }
-        }
-      }
-      /* prevent index data (pixel values) from being inverted (-> garbage) */
-      invert = FALSE;
+      fprintf (out, "error 1 0 request line too long\n");
       break;
     }
-
-    case PHOTOMETRIC_YCBCR:
-      /* GRR 20001110:  lifted from tiff2ps in libtiff 3.5.4 */
-      TIFFGetField(tif, TIFFTAG_COMPRESSION, &tiff_compression_method);
-      if (tiff_compression_method == COMPRESSION_JPEG &&
-          planar == PLANARCONFIG_CONTIG)
-      {
-        /* can rely on libjpeg to convert to RGB */
-        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
-        photometric = PHOTOMETRIC_RGB;
-        if (verbose)
-          fprintf (stderr,
-            "tiff2png:  original color type = YCbCr with JPEG compression\n");
-      }
-      else
-      {
-        fprintf (stderr,
-          "tiff2png error:  don't know how to handle PHOTOMETRIC_YCBCR with\n"
-          "  compression %d (%sJPEG) and planar config %d (%scontiguous)\n"
-          "  (%s)\n", tiff_compression_method,
-          tiff_compression_method == COMPRESSION_JPEG? "" : "not ",
-          planar, planar == PLANARCONFIG_CONTIG? "" : "not ", tiffname);
-        png_destroy_write_struct (&png_ptr, &info_ptr);
-        TIFFClose (tif);
-        fclose (png);
-        return 1;
-      }
-      /* fall thru... */
-
-    case PHOTOMETRIC_RGB:
-      if (spp == 3)
-      {
-	color_type = PNG_COLOR_TYPE_RGB;
-	if (verbose)
-	  fprintf (stderr, "tiff2png:  color type = truecolor\n");
-      }
-      else
-      {
-	color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-	if (verbose)
-	  fprintf (stderr, "tiff2png:  color type = truecolor + alpha\n");
-      }
-      if (bps <= 8)
-	bit_depth = 8;
-      else
-	bit_depth = bps;
-      break;
-
-    case PHOTOMETRIC_LOGL:
-    case PHOTOMETRIC_LOGLUV:
-      /* GRR 20001110:  lifted from tiff2ps from libtiff 3.5.4 */
-      TIFFGetField(tif, TIFFTAG_COMPRESSION, &tiff_compression_method);
-      if (tiff_compression_method != COMPRESSION_SGILOG &&
-          tiff_compression_method != COMPRESSION_SGILOG24)
-      {
-        fprintf (stderr,
-          "tiff2png error:  don't know how to handle PHOTOMETRIC_LOGL%s with\n"
-          "  compression %d (not SGILOG) (%s)\n",
-          photometric == PHOTOMETRIC_LOGLUV? "UV" : "",
-          tiff_compression_method, tiffname);
-        png_destroy_write_struct (&png_ptr, &info_ptr);
-        TIFFClose (tif);
-        fclose (png);
-        return 1;
-      }
-      /* rely on library to convert to RGB/greyscale */
-#ifdef LIBTIFF_HAS_16BIT_INTEGER_FORMAT
-      if (bps > 8)
-      {
-        /* SGILOGDATAFMT_16BIT converts to a floating-point luminance value;
-         *  U,V are left as such.  SGILOGDATAFMT_16BIT_INT doesn't exist. */
-        TIFFSetField(tif, TIFFTAG_SGILOGDATAFMT, SGILOGDATAFMT_16BIT_INT);
-        bit_depth = bps = 16;
-      }
-      else
-#endif
-      {
-        /* SGILOGDATAFMT_8BIT converts to normal grayscale or RGB format */
-        TIFFSetField(tif, TIFFTAG_SGILOGDATAFMT, SGILOGDATAFMT_8BIT);
-        bit_depth = bps = 8;
-      }
-      if (photometric == PHOTOMETRIC_LOGL)
-      {
-        photometric = PHOTOMETRIC_MINISBLACK;
-        color_type = PNG_COLOR_TYPE_GRAY;
-        if (verbose)
-        {
-          fprintf (stderr,
-            "tiff2png:  original color type = logL with SGILOG compression\n");
-          fprintf (stderr, "tiff2png:  color type = grayscale\n");
-        }
-      }
-      else
-      {
-        photometric = PHOTOMETRIC_RGB;
-        color_type = PNG_COLOR_TYPE_RGB;
-        if (verbose)
-        {
-          fprintf (stderr,
-           "tiff2png:  original color type = logLUV with SGILOG compression\n");
-          fprintf (stderr, "tiff2png:  color type = truecolor\n");
-        }
-      }
+    if (!serve_request (srv, line, in, out, bufs) || fflush (out) != 0)
       break;
-
-/*
-    case PHOTOMETRIC_YCBCR:
-    case PHOTOMETRIC_LOGL:
-    case PHOTOMETRIC_LOGLUV:
- */
-    case PHOTOMETRIC_MASK:
-    case PHOTOMETRIC_SEPARATED:
-    case PHOTOMETRIC_CIELAB:
-    case PHOTOMETRIC_DEPTH:
-    {
-      fprintf (stderr,
-        "tiff2png error:  don't know how to handle %s (%s)\n",
-/*
-        photometric == PHOTOMETRIC_YCBCR?     "PHOTOMETRIC_YCBCR" :
-        photometric == PHOTOMETRIC_LOGL?      "PHOTOMETRIC_LOGL" :
-        photometric == PHOTOMETRIC_LOGLUV?    "PHOTOMETRIC_LOGLUV" :
- */
-        photometric == PHOTOMETRIC_MASK?      "PHOTOMETRIC_MASK" :
-        photometric == PHOTOMETRIC_SEPARATED? "PHOTOMETRIC_SEPARATED" :
-        photometric == PHOTOMETRIC_CIELAB?    "PHOTOMETRIC_CIELAB" :
-        photometric == PHOTOMETRIC_DEPTH?     "PHOTOMETRIC_DEPTH" :
-                                              "unknown photometric",
-        tiffname);
-      png_destroy_write_struct (&png_ptr, &info_ptr);
-      TIFFClose (tif);
-      fclose (png);
-      return 1;
-    }
-
-    default:
-    {
-      fprintf (stderr, "tiff2png error:  unknown photometric (%d) (%s)\n",
-        photometric, tiffname);
-      png_destroy_write_struct (&png_ptr, &info_ptr);
-      TIFFClose (tif);
-      fclose (png);
-      return 1;
-    }
   }
-  tiff_color_type = color_type;
-
-  if (verbose)
-    fprintf (stderr, "tiff2png:  bit depth = %d\n", bit_depth);
 
-  faxpect = faxpect_option;
-  if (faxpect && (!have_res || ratio < 1.90 || ratio > 2.10))
-  {
-    fprintf (stderr,
-     "tiff2png:  aspect ratio is out of range: skipping -faxpect conversion\n");
-    faxpect = FALSE;
-  }
+  fclose (in);
+  fclose (out);
+}
 
-  if (faxpect && (color_type != PNG_COLOR_TYPE_GRAY || bit_depth != 1))
+/* answers one request; returns FALSE if the connection is no good anymore */
+static int serve_request (srv, line, in, out, bufs)
+  server *srv;
+  char *line;
+  FILE *in, *out;
+  serve_buffers *bufs;
+{
+  char *words[SERVE_WORDS];
+  int nwords = 0;
+  int argn, rc, k, page = 0;
+  int data;
+  size_t n = 0;
+  char *err, *save, *end;
+  tiff2png_options opts;
+  tiff2png_context *ctx;
+  struct timespec t0, t1;
+  double ms;
+
+  for (words[0] = strtok_r (line, " \t\r\n", &save); words[nwords];
+       words[nwords] = strtok_r (NULL, " \t\r\n", &save))
   {
-    fprintf (stderr,
-      "tiff2png:  only B&W (1-bit grayscale) images supported for -faxpect\n");
-    faxpect = FALSE;
+    if (++nwords == SERVE_WORDS)
+    {
+      fprintf (out, "error 1 0 too many words in request\n");
+      return FALSE;
+    }
   }
+  if (nwords == 0)
+    return TRUE;
 
-  /* reduce width of fax by 2X by converting 1-bit grayscale to 2-bit, 3-color
-   * palette */
-  if (faxpect)
+  /* the data comes first, so that the connection stays in step whatever
+   * may be wrong with the rest of the request */
+  data = (strcmp (words[0], "data") == 0);
+  if (data)
   {
-    width = halfcols = cols / 2;
-    color_type = PNG_COLOR_TYPE_PALETTE;
-    palette[0].red = palette[0].green = palette[0].blue = 0;	/* both 0 */
-    palette[1].red = palette[1].green = palette[1].blue = 127;	/* 0,1 or 1,0 */
-    palette[2].red = palette[2].green = palette[2].blue = 255;	/* both 1 */
-    colors = 3;
-    bit_depth = 2;
-    res_x = res_x_half;
-    if (verbose)
+    n = (size_t) strtoul (words[nwords - 1], &end, 10);
+    if (nwords < 2 || end == words[nwords - 1] || *end != '\0')
     {
-      fprintf (stderr, "tiff2png:  new width = %u pixels\n", width);
-      fprintf (stderr, "tiff2png:  new color type = paletted\n");
-      fprintf (stderr, "tiff2png:  new bit depth = %d\n", bit_depth);
+      fprintf (out, "error 1 0 data request without a size\n");
+      return FALSE;
     }
-  }
-
-  /* put parameter info in png-chunks */
-
-  png_set_IHDR(png_ptr, info_ptr, width, rows, bit_depth, color_type,
-    interlace_type, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-  if (png_compression_level != -1)
-    png_set_compression_level(png_ptr, png_compression_level);
-
-  if (color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_PLTE(png_ptr, info_ptr, palette, colors);
+    if (n > bufs->inalloc)
+    {
+      unsigned char *p = (unsigned char *)realloc(bufs->in, n);
 
-  /* gAMA chunk */
-  if (gamma != -1.0)
-  {
-    if (verbose)
-      fprintf (stderr, "tiff2png:  gamma = %f\n", gamma);
-    png_set_gAMA(png_ptr, info_ptr, gamma);
+      if (p == NULL)
+      {
+        fprintf (out, "error 4 0 can't allocate memory for %lu bytes\n",
+          (unsigned long)n);
+        return FALSE;
+      }
+      bufs->in = p;
+      bufs->inalloc = n;
+    }
+    if (fread (bufs->in, 1, n, in) != n)
+      return FALSE;
   }
-
-  /* pHYs chunk */
-  if (have_res)
-    png_set_pHYs (png_ptr, info_ptr, res_x, res_y, unit_type);
-
-  png_write_info (png_ptr, info_ptr);
-  png_set_packing (png_ptr);
-
-
-  /* allocate space for one line (or row of tiles) of TIFF image */
-
-  tiffline = NULL;
-  tifftile = NULL;
-  tiffstrip = NULL;
-
-  if (!tiled)      /* strip-based TIFF */
+  else if (strcmp (words[0], "convert") != 0)
   {
-    if (planar == 1) /* contiguous picture */
-      tiffline = (uch*) malloc(TIFFScanlineSize(tif));
-    else /* separated planes */
-      tiffline = (uch*) malloc(TIFFScanlineSize(tif) * spp);
+    fprintf (out, "error 1 0 unknown request \"%s\"\n", words[0]);
+    return TRUE;
   }
-  else
-  {
-    /* FAP 20020610 - tiled support - allocate space for one "row" of tiles */
-
-    TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tile_width);
-    TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_height);
-
-    num_tilesX = (width+tile_width-1)/tile_width;
 
-    if (planar == 1)
+  opts = *srv->opts;
+  for (argn = 1; argn < nwords && words[argn][0] == '-' &&
+       words[argn][1] != '\0'; argn++)
+  {
+    if (strcmp (words[argn], "-page") == 0 && argn + 1 < nwords)
     {
-      tilesz = TIFFTileSize(tif);
-      tifftile = (uch*) malloc(tilesz);
-      if (tifftile == NULL)
+      page = atoi (words[++argn]) - 1;
+      if (page < 0)
       {
-        fprintf (stderr,
-          "tiff2png error:  can't allocate memory for TIFF tile buffer (%s)\n",
-          tiffname);
-        png_destroy_write_struct (&png_ptr, &info_ptr);
-        TIFFClose (tif);
-        fclose (png);
-        return 4;
+        fprintf (out, "error 1 0 bad page \"%s\"\n", words[argn]);
+        return TRUE;
       }
-      stripsz = (tile_width*num_tilesX) * tile_height * spp;
-      tiffstrip = (uch*) malloc(stripsz);
-      tiffline = tiffstrip; /* just set the line to the top of the strip.
-                             * we'll move it through below. */
+      continue;
     }
-    else
+    for (k = 0; cli_options[k].name != NULL; k++)
+      if (strncmp (words[argn], cli_options[k].name, cli_options[k].len) == 0)
+        break;
+    if (cli_options[k].name != NULL)
     {
-      fprintf (stderr,
-        "tiff2png error: can't handle tiled separated-plane TIFF format (%s)\n",
-        tiffname);
-      png_destroy_write_struct (&png_ptr, &info_ptr);
-      TIFFClose (tif);
-      fclose (png);
-      return 5;
+      fprintf (out, "error 1 0 option not allowed in requests: \"%s\"\n",
+        words[argn]);
+      return TRUE;
+    }
+    rc = parse_option (nwords, words, &argn, &opts, &err);
+    if (rc <= 0)
+    {
+      if (err)
+      {
+        fprintf (out, "error 1 0 ");
+        fprintf (out, err, words[argn]);
+        fprintf (out, "\n");
+      }
+      else
+        fprintf (out, "error 1 0 bad option \"%s\"\n", words[argn]);
+      return TRUE;
     }
   }
-
-  if (tiffline == NULL)
+  if (nwords - argn != (data? 1 : 2))
   {
-    fprintf (stderr,
-      "tiff2png error:  can't allocate memory for TIFF scanline buffer (%s)\n",
-      tiffname);
-    png_destroy_write_struct (&png_ptr, &info_ptr);
-    TIFFClose (tif);
-    fclose (png);
-    if (tiled && planar == 1)
-      free(tifftile);
-    return 4;
+    fprintf (out, "error 1 0 usage: convert [<options>] <tiff> <png> or "
+      "data [<options>] <n>\n");
+    return TRUE;
   }
-
-  if (planar != 1) /* in case we must combine more planes into one */
+  if (!data && (strcmp (words[argn], "-") == 0 ||
+      strcmp (words[argn + 1], "-") == 0))
   {
-    tiffstrip = (uch*) malloc(TIFFScanlineSize(tif));
-    if (tiffstrip == NULL)
-    {
-      fprintf (stderr,
-        "tiff2png error:  can't allocate memory for TIFF strip buffer (%s)\n",
-        tiffname);
-      png_destroy_write_struct (&png_ptr, &info_ptr);
-      TIFFClose (tif);
-      free(tiffline);
-      fclose (png);
-      return 4;
-    }
+    fprintf (out, "error 1 0 stdin and stdout are the server's own\n");
+    return TRUE;
   }
 
-
-  /* allocate space for one line of PNG image */
-  /* max: 3 color channels plus one alpha channel, 16 bit => 8 bytes/pixel */
-
-  pngline = (uch *) malloc (cols * 8);
-  if (pngline == NULL)
+  ctx = tiff2png_context_create (&opts, serve_message, bufs);
+  if (ctx == NULL)
   {
-    fprintf (stderr,
-      "tiff2png error:  can't allocate memory for PNG row buffer (%s)\n",
-      tiffname);
-    png_destroy_write_struct (&png_ptr, &info_ptr);
-    TIFFClose (tif);
-    free(tiffline);
-    if (tiled && planar == 1)
-      free(tifftile);
-    else if (planar != 1)
-      free(tiffstrip);
-    fclose (png);
-    return 4;
+    fprintf (out, "error 4 0 can't allocate memory for conversion context\n");
+    return TRUE;
   }
 
-
-#ifdef GRR_16BIT_DEBUG
-  msb_max = lsb_max = 0;
-  msb_min = lsb_min = 255;
-  s16_max = 0;
-  s16_min = 65535;
-#endif
-
-  for (pass = 0 ; pass < png_set_interlace_handling (png_ptr) ; pass++)
-  {
-    for (row = 0; row < rows; row++)
-    {
-      if (planar == 1) /* contiguous picture */
-      {
-        if (!tiled)
-        {
-	  if (TIFFReadScanline (tif, tiffline, row, 0) < 0)
-	  {
-            fprintf (stderr, "tiff2png error:  bad data read on line %d (%s)\n",
-              row, tiffname);
-            png_destroy_write_struct (&png_ptr, &info_ptr);
-            TIFFClose (tif);
-            free(tiffline);
-            fclose (png);
-	    return 1;
-	  }
-        }
-        else /* tiled */
-        {
-          int col, ok=1, r;
-          int tileno;
-          /* FAP 20020610 - Read in one row of tiles and hand out the data one
-                            scanline at a time so the code below doesn't need
-                            to change */
-          /* Is it time for a new strip? */
-          if ((row % tile_height) == 0)
-          {
-            for (col = 0; ok && col < num_tilesX; col += 1 )
-            {
-              tileno = col+(row/tile_height)*num_tilesX;
-/*            fprintf(stderr,"\nRow:%d Col:%d Tile No: %d ",row,col,tileno); */
-              /* read the tile into an RGB array */
-              if (!TIFFReadEncodedTile(tif, tileno, tifftile, tilesz))
-              {
-                ok = 0;
-                break;
-              }
-
-              /* copy this tile into the row buffer */
-              for (r = 0; r < (int) tile_height; r++)
-              {
-                void* dest;
-                void* src;
-
-                dest = tiffstrip + (r * tile_width * num_tilesX * spp)
-                                 + (col * tile_width * spp);
-                src  = tifftile + (r * tile_width * spp);
-/*              if (row == 0) fprintf(stderr, "\ndest: %p src:%p", dest,src); */
-                memcpy(dest, src, (tile_width * spp));
-              }
-            }
-            tiffline = tiffstrip; /* set tileline to top of strip */
-/*          fprintf(stderr, "\ntiffline:%p", tiffline); */
-          }
-          else
-          {
-            tiffline = tiffstrip +
-              ((row % tile_height) * ((tile_width * num_tilesX) * spp));
-/*          fprintf(stderr,"\ntiffline:%p %d",tiffline,(tiffline-tiffstrip)); */
-          }
-        } /* end if (tiled) */
-      }
-      else /* separated planes, then combine more strips into one line */
-      {
-        ush s;
-
-        /* XXX:  this assumes strips; are separated-plane tiles possible? */
-
-        p_line = tiffline;
-	for (n = 0; n < (cols/8 * bps*spp); n++)
-	  *p_line++ = '\0';
-
-	for (s = 0; s < spp; s++)
-        {
-          p_strip = tiffstrip;
-          getbitsleft = 8;
-          p_line = tiffline;
-          putbitsleft = 8;
-
-	  if (TIFFReadScanline(tif, tiffstrip, row, s) < 0)
-	  {
-            fprintf (stderr, "tiff2png error:  bad data read on line %d (%s)\n",
-              row, tiffname);
-            png_destroy_write_struct (&png_ptr, &info_ptr);
-            TIFFClose (tif);
-            free(tiffline);
-            free(tiffstrip);
-            fclose (png);
-	    return 1;
-	  }
-
-	  p_strip = (uch *)tiffstrip;
-	  sample = '\0';
-          for (i = 0 ; i < s ; i++)
-            PUT_LINE_SAMPLE
-	  for (n = 0; n < cols; n++)
-	  {
-	    GET_STRIP_SAMPLE
-	    PUT_LINE_SAMPLE
-	    sample = '\0';
-	    for (i = 0 ; i < (spp-1) ; i++)
-	      PUT_LINE_SAMPLE
-	  }
-	} /* end for-loop (s) */
-      } /* end if (planar/contiguous) */
-
-      p_line = tiffline;
-      bitsleft = 8;
-      p_png = pngline;
-
-      /* convert from tiff-line to png-line */
-
-      switch (tiff_color_type)
-      {
-        case PNG_COLOR_TYPE_GRAY:		/* we know spp == 1 */
-	  for (col = cols; col > 0; --col)
-	  {
-            switch (bps)
-	    {
-              case 16:
-#ifdef INVERT_MINISWHITE
-		if (photometric == PHOTOMETRIC_MINISWHITE)
-		{
-                  if (bigendian)		/* same as PNG order */
-                  {
-		    GET_LINE_SAMPLE
-		    sample16 = sample;
-		    sample16 <<= 8;
-		    GET_LINE_SAMPLE
-		    sample16 |= sample;
-                  }
-                  else				/* reverse of PNG */
-                  {
-		    GET_LINE_SAMPLE
-		    sample16 = sample;
-#ifdef GRR_16BIT_DEBUG
-                    if (msb_max < sample)
-                      msb_max = sample;
-                    if (msb_min > sample)
-                      msb_min = sample;
-#endif
-		    GET_LINE_SAMPLE
-		    sample16 |= (((int)sample) << 8);
-#ifdef GRR_16BIT_DEBUG
-                    if (lsb_max < sample)
-                      lsb_max = sample;
-                    if (lsb_min > sample)
-                      lsb_min = sample;
-#endif
-                  }
-		  sample16 = maxval - sample16;
-#ifdef GRR_16BIT_DEBUG
-                  if (s16_max < sample16)
-                    s16_max = sample16;
-                  if (s16_min > sample16)
-                    s16_min = sample16;
-#endif
-		  *p_png++ = (uch)((sample16 >> 8) & 0xff);
-	  	  *p_png++ = (uch)(sample16 & 0xff);
-		}
-		else /* not PHOTOMETRIC_MINISWHITE */
-#endif /* INVERT_MINISWHITE */
-		{
-                  if (bigendian)
-                  {
-		    GET_LINE_SAMPLE
-		    *p_png++ = sample;
-		    GET_LINE_SAMPLE
-		    *p_png++ = sample;
-                  }
-                  else
-                  {
-                    GET_LINE_SAMPLE
-                    p_png[1] = sample;
-                    GET_LINE_SAMPLE
-                    *p_png = sample;
-                    p_png += 2;
-                  }
-                } /* ? PHOTOMETRIC_MINISWHITE */
-		break;
-
-              case 8:
-              case 4:
-              case 2:
-              case 1:
-		GET_LINE_SAMPLE
-#ifdef INVERT_MINISWHITE
-		if (photometric == PHOTOMETRIC_MINISWHITE)
-		  sample = maxval - sample;
-#endif
-	        *p_png++ = sample;
-		break;
-
-            } /* end switch (bps) */
-	  }
-          /* note that this actually converts 1-bit grayscale to 2-bit indexed
-           * data, where 0 = black, 1 = half-gray (127), and 2 = white */
-          if (faxpect)
-          {
-	    png_byte *p_png2;
-
-	    p_png = pngline;
-	    p_png2 = pngline;
-	    for (col = halfcols; col > 0; --col)
-            {
-	      *p_png++ = p_png2[0] + p_png2[1];
-	      p_png2 += 2;
-            }
-          }
-	  break;
-
-/*
-        XXX BUG:  this doesn't check for associated vs. unassociated alpha
-
-	GRR PSEUDO-FIX 20001109:  from tiff2ps.c:
-	     TIFFGetFieldDefaulted(tif, TIFFTAG_EXTRASAMPLES,
-	       &extrasamples, &sampleinfo);
-	     if (extrasamples > 1) {
-	       warn&die:  unknown extra-sample type
-	     } else if (sampleinfo[0] == EXTRASAMPLE_ASSOCALPHA) {
-	       warn&die or warn & do (lossy) conversion of gray/RGB samples
-	     } else if (sampleinfo[0] == EXTRASAMPLE_UNSPECIFIED) {
-	       warn but continue (assume unassociated alpha)
-	     } else if (sampleinfo[0] == EXTRASAMPLE_UNASSALPHA) {
-	       much happiness
-	     } else {
-	       warn&die:  unknown extra-sample type
-	     }
- */
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-	  for (col = 0; col < cols; col++)
-	  {
-            for (i = 0 ; i < spp ; i++)
-            {
-              switch (bps)
-	      {
-                case 16:
-#ifdef INVERT_MINISWHITE	/* GRR 20000122:  XXX 16-bit case not tested */
-		  if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-		  {
-                    if (bigendian)
-                    {
-		      GET_LINE_SAMPLE
-		      sample16 = (sample << 8);
-		      GET_LINE_SAMPLE
-		      sample16 |= sample;
-                    }
-                    else
-                    {
-		      GET_LINE_SAMPLE
-		      sample16 = sample;
-		      GET_LINE_SAMPLE
-		      sample16 |= (((int)sample) << 8);
-                    }
-		    sample16 = maxval - sample16;
-		    *p_png++ = (uch)((sample16 >> 8) & 0xff);
-	  	    *p_png++ = (uch)(sample16 & 0xff);
-		  }
-		  else
-#endif
-		  {
-                    if (bigendian)
-                    {
-		      GET_LINE_SAMPLE
-		      *p_png++ = sample;
-		      GET_LINE_SAMPLE
-		      *p_png++ = sample;
-                    }
-                    else
-                    {
-                      GET_LINE_SAMPLE
-                      p_png[1] = sample;
-                      GET_LINE_SAMPLE
-                      *p_png = sample;
-                      p_png += 2;
-                    }
-		  }
-		  break;
-
-                case 8:
-		  GET_LINE_SAMPLE
-#ifdef INVERT_MINISWHITE
-		  if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-		    sample = maxval - sample;
-#endif
-	          *p_png++ = sample;
-		  break;
-
-                case 4:
-		  GET_LINE_SAMPLE
-#ifdef INVERT_MINISWHITE
-		  if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-		    sample = maxval - sample;
-#endif
-	          *p_png++ = sample * 17;	/* was 16 */
-		  break;
-
-                case 2:
-		  GET_LINE_SAMPLE
-#ifdef INVERT_MINISWHITE
-		  if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-		    sample = maxval - sample;
-#endif
-	          *p_png++ = sample * 85;	/* was 64 */
-		  break;
-
-                case 1:
-		  GET_LINE_SAMPLE
-#ifdef INVERT_MINISWHITE
-		  if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-		    sample = maxval - sample;
-#endif
-	          *p_png++ = sample * 255;	/* was 128...oops */
-		  break;
-
-              } /* end switch */
-            }
-	  }
-	  break;
-
-        case PNG_COLOR_TYPE_RGB:
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-	  for (col = 0; col < cols; col++)
-	  {
-            /* process for red, green and blue (and when applicable alpha) */
-            for (i = 0 ; i < spp ; i++)
-            {
-              switch (bps)
-	      {
-                case 16:
-                  /* XXX:  do we need INVERT_MINISWHITE support here, too, or
-		   *       is that only for grayscale? */
-                  if (bigendian)
-                  {
-		    GET_LINE_SAMPLE
-		    *p_png++ = sample;
-		    GET_LINE_SAMPLE
-		    *p_png++ = sample;
-		  }
-		  else
-		  {
-		    GET_LINE_SAMPLE
-		    p_png[1] = sample;
-		    GET_LINE_SAMPLE
-		    *p_png = sample;
-		    p_png += 2;
-		  }
-		  break;
-
-                case 8:
-		  GET_LINE_SAMPLE
-	          *p_png++ = sample;
-		  break;
-
-                /* XXX:  how common are these three cases? */
-
-                case 4:
-		  GET_LINE_SAMPLE
-	          *p_png++ = sample * 17;	/* was 16 */
-		  break;
-
-                case 2:
-		  GET_LINE_SAMPLE
-	          *p_png++ = sample * 85;	/* was 64 */
-		  break;
-
-                case 1:
-		  GET_LINE_SAMPLE
-	          *p_png++ = sample * 255;	/* was 128 */
-		  break;
-
-              } /* end switch */
-		
-            }
-	  }
-	  break;
-  
-        case PNG_COLOR_TYPE_PALETTE:
-	  for (col = 0; col < cols; col++)
-	  {
-	    GET_LINE_SAMPLE
-            *p_png++ = sample;
-	  }
-	  break;
-  
-	default:
-	{
-          fprintf (stderr, "tiff2png error:  unknown photometric (%d) (%s)\n",
-            photometric, tiffname);
-          png_destroy_write_struct (&png_ptr, &info_ptr);
-          TIFFClose (tif);
-          free (tiffline);
-          if (tiled && planar == 1)
-            free(tifftile);
-          else if (planar != 1)
-            free(tiffstrip);
-          fclose (png);
-	  return 1;
-	}
-
-      } /* end switch (tiff_color_type) */
-
-#ifdef GRR_16BIT_DEBUG
-      if (verbose && bps == 16 && row == 0)
-      {
-        fprintf (stderr, "DEBUG:  hex contents of first row sent to libpng:\n");
-        p_png = pngline;
-        for (col = cols; col > 0; --col, p_png += 2)
-          fprintf (stderr, "   %02x %02x", p_png[0], p_png[1]);
-        fprintf (stderr, "\n");
-        fprintf (stderr, "DEBUG:  end of first row sent to libpng\n");
-        fflush (stderr);
-      }
-#endif
-
-      png_write_row (png_ptr, pngline);
-
-    } /* end for-loop (row) */
-  } /* end for-loop (pass) */
-
-  TIFFClose(tif);
-
-  png_write_end (png_ptr, info_ptr);
-  fclose (png);
-
-  png_destroy_write_struct (&png_ptr, &info_ptr);
-
-  free(tiffline);
-  if (tiled && planar == 1)
-    free(tifftile);
-  else if (planar != 1)
-    free(tiffstrip);
-
-#ifdef GRR_16BIT_DEBUG
-  if (verbose && bps == 16)
+  bufs->warning[0] = '\0';
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  if (data)
+    rc = tiff2png_convert_buffer (ctx, bufs->in, n, &bufs->out, page);
+  else
+    rc = tiff2png_convert (ctx, words[argn], words[argn + 1], page);
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+  if (rc != 0)
+    fprintf (out, "error %d %.3f %s\n", rc, ms,
+      *tiff2png_last_error (ctx)? tiff2png_last_error (ctx) :
+      *bufs->warning? bufs->warning : "conversion failed");
+  else if (data)
   {
-    fprintf (stderr, "tiff2png:  range of most significant bytes  = %u-%u\n",
-      msb_min, msb_max);
-    fprintf (stderr, "tiff2png:  range of least significant bytes = %u-%u\n",
-      lsb_min, lsb_max);
-    fprintf (stderr, "tiff2png:  range of 16-bit integer values   = %u-%u\n",
-      s16_min, s16_max);
+    fprintf (out, "ok %.3f %lu\n", ms, (unsigned long)bufs->out.size);
+    fwrite (bufs->out.data, 1, bufs->out.size, out);
   }
-#endif
-
-  if (verbose)
-    fprintf (stderr, "\n");
+  else
+    fprintf (out, "ok %.3f\n", ms);
+  tiff2png_context_destroy (ctx);
 
-  return 0;
+  return TRUE;
 }
 
+#endif /* HAVE_SERVE */
+
 /*----------------------------------------------------------------------------*/
 
 int
@@ -1381,18 +850,30 @@ main (argc, argv)
   int destlen = 0;
   int len;
   int argn = 1;
-  int compression_level = -1;
-  int interlace_type = PNG_INTERLACE_NONE;
   int verbose = FALSE;
-  int force = FALSE;
-  int invert = FALSE;
-  int faxpect = FALSE;
-  double gamma = -1.0;
+  int jobs = 1;
+  int pages = FALSE;
+  char *serve_path = NULL;
+  int first_page = 1, last_page = 0;	/* -pages range; 0 is the last page */
+  int page, npages, nalloc;
+  int nfiles, nfailed, rc;
+  batch_file *files;
+  tiff2png_options opts;
+  tiff2png_context *ctx;
+  char *err;
+  batch b;
+  pthread_t *workers;
+  int nworkers;
+  int i;
 
 
 #ifdef __EMX__
   _wildcard(&argc, &argv);   /* Unix-like globbing for OS/2 and DOS */
 #endif
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);	/* for "-" */
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
 
   /* debug */
 
@@ -1406,58 +887,106 @@ main (argc, argv)
   if (argn == argc)
     usage (0);
 
+  tiff2png_options_init (&opts);
+
   while (argn < argc && argv[argn][0] == '-' && argv[argn][1] != '\0')
   {
     if (strncmp (argv[argn], "-help", 2) == 0)
       usage (0);
     else if (strncmp (argv[argn], "-verbose", 2) == 0)
-      verbose = TRUE;
-    else if (strncmp (argv[argn], "-compression", 2) == 0)
+      verbose = opts.verbose = TRUE;
+    else if (strncmp (argv[argn], "-destdir", 2) == 0)
     {
       if (++argn < argc)
-	sscanf (argv[argn], "%d", &compression_level);
+	destdir = argv[argn];
       else
 	usage (1);
-      if (compression_level < 0 || compression_level > 9)
+    }
+    else if (strncmp (argv[argn], "-pages", 2) == 0)
+    {
+      if (++argn < argc)
+	pages = TRUE;
+      else
+	usage (1);
+      if (!parse_pages (argv[argn], &first_page, &last_page))
       {
         fprintf (stderr,
-          "tiff2png error:  compression level must be between 0 and 9\n");
+          "tiff2png error:  bad page range \"%s\"\n", argv[argn]);
 	usage (1);
       }
     }
-    else if (strncmp (argv[argn], "-destdir", 2) == 0)
+    else if (strncmp (argv[argn], "-stats", 4) == 0)
+      opts.stats = TRUE;
+    else if (strncmp (argv[argn], "-sizes", 3) == 0)
     {
       if (++argn < argc)
-	destdir = argv[argn];
+	opts.nsizes = tiff2png_parse_sizes (argv[argn], opts.sizes);
+      else
+	usage (1);
+      if (opts.nsizes == 0)
+      {
+        fprintf (stderr,
+          "tiff2png error:  bad list of sizes \"%s\"\n", argv[argn]);
+	usage (1);
+      }
+    }
+#ifdef HAVE_CACHE
+    else if (strncmp (argv[argn], "-cache", 3) == 0)
+    {
+      if (++argn < argc)
+	opts.cache = argv[argn];
       else
 	usage (1);
     }
-    else if (strncmp (argv[argn], "-force", 3) == 0)
-      force = TRUE;
-    else if (strncmp (argv[argn], "-gamma", 2) == 0)
+#endif
+    else if (strncmp (argv[argn], "-jobs", 2) == 0)
     {
       if (++argn < argc)
-	sscanf (argv[argn], "%lf", &gamma);
+	sscanf (argv[argn], "%d", &jobs);
       else
 	usage (1);
-      if (gamma <= 0.0)
+      if (jobs < 1)
       {
         fprintf (stderr,
-          "tiff2png error:  gamma value must be greater than zero\n");
+          "tiff2png error:  number of jobs must be at least 1\n");
 	usage (1);
       }
     }
-    else if (strncmp (argv[argn], "-interlace", 4) == 0)
-      interlace_type = PNG_INTERLACE_ADAM7;
-    else if (strncmp (argv[argn], "-invert", 4) == 0)
-      invert = TRUE;
-    else if (strncmp (argv[argn], "-faxpect", 3) == 0)
-      faxpect = TRUE;
-    else
+#ifdef HAVE_SERVE
+    else if (strncmp (argv[argn], "-serve", 3) == 0)
+    {
+      if (++argn < argc)
+	serve_path = argv[argn];
+      else
+	usage (1);
+    }
+#endif
+    else if ((rc = parse_option (argc, argv, &argn, &opts, &err)) < 0)
+    {
+      if (err == NULL)
+	usage (1);
+      fprintf (stderr, "tiff2png error:  ");
+      fprintf (stderr, err, argv[argn]);
+      fprintf (stderr, "\n");
+      usage (1);
+    }
+    else if (rc == 0)
       usage (1);
     argn++;
   }
 
+#ifdef HAVE_SERVE
+  if (serve_path)
+  {
+    if (argn < argc || pages)
+    {
+      fprintf (stderr,
+        "tiff2png error:  -serve takes no files (or -pages)\n");
+      usage (1);
+    }
+    return serve (serve_path, &opts, jobs);
+  }
+#endif
 
 #ifdef DESTDIR_IS_CURDIR
   /* SJT: I like always writing to the current directory. */
@@ -1477,9 +1006,50 @@ main (argc, argv)
 	destlen--;
   }
 
-  while (argn < argc)
+  ctx = tiff2png_context_create (&opts, NULL, NULL);	/* for -pages */
+  if (ctx == NULL)
+  {
+    fprintf (stderr,
+      "tiff2png error:  can't allocate memory for conversion context\n");
+    return 4;
+  }
+
+  /* with -pages, each page of a file is a job of its own, so that the pages
+   * of one long document are converted side by side with -jobs */
+  nfiles = 0;
+  nalloc = argc - argn;
+  files = (batch_file *)calloc(nalloc, sizeof(batch_file));
+  if (files == NULL)
+  {
+    fprintf (stderr,
+      "tiff2png error:  can't allocate memory for file list\n");
+    return 4;
+  }
+
+  for (; argn < argc; argn++)
   {
     tiffname = argv[argn];
+    if (strcmp(tiffname, "-") == 0)		/* stdin is converted to stdout */
+    {
+      if (pages)
+      {
+        fprintf (stderr,
+          "tiff2png error:  -pages can't write stdin to stdout\n");
+        return 4;
+      }
+      pngname = (char *)malloc(2);
+      if (pngname == NULL)
+      {
+        fprintf (stderr,
+          "tiff2png error:  can't allocate memory for pngname buffer\n");
+        return 4;
+      }
+      strcpy(pngname, "-");
+      files[nfiles].tiffname = tiffname;
+      files[nfiles].pngname = pngname;
+      nfiles++;
+      continue;
+    }
     if (destdir)
     {
       basename = strrchr(argv[argn], DIR_SEP);
@@ -1517,12 +1087,118 @@ main (argc, argv)
     else
       strcpy(pngname+len, ".png");
 
-    tiff2png(tiffname, pngname, verbose, force, interlace_type,
-      compression_level, invert, faxpect, gamma);
+    if (!pages)
+    {
+      files[nfiles].tiffname = tiffname;
+      files[nfiles].pngname = pngname;
+      nfiles++;
+      continue;
+    }
+
+    /* name-NNN.png for each page in range; a file that can't be opened or
+     * hasn't got the first page still gets one job, to report the error */
+    {
+      int count = tiff2png_count_pages (ctx, tiffname);
+
+      if (last_page != 0 && last_page < count)
+        count = last_page;
+      npages = (count >= first_page)? count - first_page + 1 : 1;
+    }
+
+    if (nfiles + npages > nalloc)
+    {
+      batch_file *more;
+
+      nalloc = nfiles + npages + (argc - argn);
+      more = (batch_file *)realloc(files, nalloc * sizeof(batch_file));
+      if (more == NULL)
+      {
+        fprintf (stderr,
+          "tiff2png error:  can't allocate memory for file list\n");
+        return 4;
+      }
+      files = more;
+    }
 
+    len = strlen(pngname) - 4;		/* without ".png" */
+    for (page = first_page - 1; npages > 0; page++, npages--)
+    {
+      files[nfiles].tiffname = tiffname;
+      files[nfiles].pngname = (char *)malloc(len + 16);
+      if (files[nfiles].pngname == NULL)
+      {
+        fprintf (stderr,
+          "tiff2png error:  can't allocate memory for pngname buffer\n");
+        return 4;
+      }
+      sprintf(files[nfiles].pngname, "%.*s-%03d.png", len, pngname,
+        page + 1);
+      files[nfiles].page = page;
+      files[nfiles].status = 0;
+      nfiles++;
+    }
     free(pngname);
-    argn++;
   }
 
-  return 0;
+  tiff2png_context_destroy (ctx);
+
+  /* hand the files out to -jobs workers, each with a context of its own.
+   * With -jobs 1 (or if no thread can be started) everything simply runs
+   * in order, right here. */
+
+  pthread_mutex_init (&b.lock, NULL);
+  b.files = files;
+  b.nfiles = nfiles;
+  b.next = 0;
+  b.opts = &opts;
+  b.stats = stdout;
+  for (i = 0; i < nfiles; i++)
+    if (strcmp (files[i].pngname, "-") == 0)
+      b.stats = stderr;
+
+  nworkers = 0;
+  workers = NULL;
+  if (jobs > 1 && nfiles > 1)
+    workers = (pthread_t *)malloc((jobs < nfiles? jobs : nfiles) *
+      sizeof(pthread_t));
+  if (workers)
+  {
+    while (nworkers < jobs && nworkers < nfiles &&
+           pthread_create (&workers[nworkers], NULL, batch_worker, &b) == 0)
+      nworkers++;
+  }
+  if (nworkers == 0)
+    batch_worker (&b);
+  for (i = 0; i < nworkers; i++)
+    pthread_join (workers[i], NULL);
+  free(workers);
+  pthread_mutex_destroy (&b.lock);
+
+  /* report what happened to each file; the exit status is the worst one */
+
+  rc = 0;
+  nfailed = 0;
+  for (i = 0; i < nfiles; i++)
+  {
+    if (files[i].status != 0)
+    {
+      if (pages)
+        fprintf (stderr, "tiff2png:  %s page %d failed (status %d)\n",
+          files[i].tiffname, files[i].page + 1, files[i].status);
+      else
+        fprintf (stderr, "tiff2png:  %s failed (status %d)\n",
+          files[i].tiffname, files[i].status);
+      nfailed++;
+      if (files[i].status > rc)
+        rc = files[i].status;
+    }
+    free(files[i].pngname);
+  }
+  if (nfailed || verbose)
+    fprintf (stderr, "tiff2png:  %d of %d file%s converted\n",
+      nfiles - nfailed, nfiles, nfiles == 1? "" : "s");
+
+  free(files);
+
+  return rc;
 }
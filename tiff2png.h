@@ -0,0 +1,156 @@
+/*
+** tiff2png.h - the TIFF-to-PNG conversion library behind tiff2png
+**
+** Copyright 1996,2000 Willem van Schaik, Calgary (willem@schaik.com)
+** Copyright 1999-2002 Greg Roelofs (newt@pobox.com)
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted,
+** provided that the above copyright notice appear in all copies and that
+** both that copyright notice and this permission notice appear in
+** supporting documentation.
+**
+** This file is provided AS IS with no warranties of any kind.  The author
+** shall have no liability with respect to the infringement of copyrights,
+** trade secrets or any patents by this file or any part thereof.  In no
+** event will the author be liable for any lost revenue or profits or
+** other special, indirect and consequential damages.
+*/
+
+/* Conversions are done through a context, which holds the options and
+ * collects the messages of whatever conversion it is running, including
+ * those of libtiff and libpng.  A context converts one file at a time, but
+ * any number of them can be busy at once on different threads:  there is
+ * no global state apart from libtiff's message handlers, which are taken
+ * over (and passed on for anybody else's TIFF handles) by the first
+ * context created.  Under -verbose, the details of each conversion are
+ * still printed to stderr. */
+
+#ifndef TIFF2PNG_H
+#define TIFF2PNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* filters and strategy settings besides the PNG_FILTER_* masks and the zlib
+ * Z_* strategies themselves */
+#define TIFF2PNG_DEFAULT	-1	/* whatever libpng would pick */
+#define TIFF2PNG_AUTO		-2	/* picked per image from a trial run */
+
+/* kinds of message passed to a tiff2png_message_fn */
+#define TIFF2PNG_WARNING	1
+#define TIFF2PNG_ERROR		2
+
+/* the most sizes -sizes can write at once */
+#define TIFF2PNG_MAX_SIZES	8
+
+/* return values of tiff2png_convert() and tiff2png_convert_buffer() */
+#define TIFF2PNG_OK		0
+#define TIFF2PNG_FAILED		1	/* bad or unsupported input, I/O */
+#define TIFF2PNG_NOMEM		4	/* out of memory */
+
+typedef struct _tiff2png_options {
+  int verbose;			/* describe each conversion on stderr */
+  int force;			/* overwrite existing PNGs */
+  int interlace;		/* write Adam7-interlaced PNGs */
+  int compression_level;	/* zlib level 0-9, or -1 for the default */
+  int invert;			/* swap black and white */
+  int faxpect;			/* square up faxes of n:1 or 1:n pixels */
+  int reduce;			/* write the smallest lossless PNG type */
+  double gamma;			/* gAMA to write, or -1.0 for none */
+  int threads;			/* decode and compress on this many, or 0 */
+  int filters;			/* PNG_FILTER_* mask, TIFF2PNG_DEFAULT or _AUTO */
+  int strategy;			/* Z_* strategy, TIFF2PNG_DEFAULT or _AUTO */
+  char *backend;		/* deflate backend, or NULL for libpng's zlib */
+  int use_mmap;			/* read TIFFs through a memory mapping */
+  uint64_t max_memory;		/* most bytes of image data to buffer for a
+				 * conversion (see tiff2png_stats), or 0
+				 * for no limit */
+  int stats;			/* measure conversions (see tiff2png_stats) */
+  char *cache;			/* directory of earlier conversions to reuse,
+				 * or NULL (not for stdin, stdout, buffers
+				 * or -sizes) */
+  int nsizes;			/* how many of sizes[] to write, or 0 for
+				 * just the full size */
+  uint32_t crop_x, crop_y;	/* with crop_width > 0, convert only the */
+  uint32_t crop_width, crop_height;	/*  window of the image at x,y of
+					 *  this size (clipped to the image) */
+  int sizes[TIFF2PNG_MAX_SIZES];	/* longest side of each PNG in pixels,
+					 * or 0 for the full size; the others
+					 * go to name-SIZE.png beside name.png */
+} tiff2png_options;
+
+/* where the time of a conversion went, with opts->stats.  Times are in
+ * seconds:  wall-clock times are those of the converting thread, CPU times
+ * those of all of the threads working for it.  Output is not counted in
+ * deflate, although libpng writes the PNG as it compresses. */
+typedef struct _tiff2png_stats {
+  double wall, cpu;			/* the whole conversion */
+  double decode_wall, decode_cpu;	/* reading and decompressing the TIFF */
+  double convert_wall, convert_cpu;	/* turning TIFF rows into PNG rows */
+  double deflate_wall, deflate_cpu;	/* filtering and deflating them */
+  double output_wall, output_cpu;	/* writing the PNG */
+  uint64_t bytes_in;			/* size of the TIFF */
+  uint64_t bytes_out;			/* size of the PNG (or PNGs) */
+  uint64_t peak_memory;		/* most bytes of image data buffered at
+					 * once, not counting libtiff's, libpng's
+					 * and zlib's own */
+} tiff2png_stats;
+
+typedef struct _tiff2png_context tiff2png_context;
+
+/* a PNG converted in memory.  data is malloc()ed and grown as needed, so a
+ * buffer that starts out all zeros can be used for one conversion after
+ * another without being freed in between. */
+typedef struct _tiff2png_buffer {
+  unsigned char *data;
+  size_t size;			/* bytes of PNG in data */
+  size_t alloc;			/* bytes allocated for data */
+} tiff2png_buffer;
+
+/* gets the warnings and errors of a context's conversions, one line each
+ * without a newline; without one they go to stderr */
+typedef void (*tiff2png_message_fn) (void *arg, int level, char *msg);
+
+/* fills in the defaults, as for tiff2png without options */
+void tiff2png_options_init (tiff2png_options *opts);
+
+/* the context keeps a copy of opts; returns NULL if there's no memory or
+ * opts->backend names no backend compiled in */
+tiff2png_context *tiff2png_context_create (tiff2png_options *opts,
+                                           tiff2png_message_fn fn, void *arg);
+void tiff2png_context_destroy (tiff2png_context *ctx);
+
+/* converts page (0 for the first) of tiffname to pngname; "-" is stdin or
+ * stdout.  Returns one of the TIFF2PNG_* codes above. */
+int tiff2png_convert (tiff2png_context *ctx, char *tiffname, char *pngname,
+                      int page);
+
+/* converts page of the TIFF in tiff[0..tiffsize-1] to a PNG in out, without
+ * any file I/O (short of the temporary file an interlaced image of more
+ * than 256 MB is kept in).  The TIFF is read in place.  Returns one of the
+ * TIFF2PNG_* codes, with out->size 0 if the conversion failed. */
+int tiff2png_convert_buffer (tiff2png_context *ctx, const void *tiff,
+                             size_t tiffsize, tiff2png_buffer *out, int page);
+void tiff2png_buffer_free (tiff2png_buffer *out);
+
+/* the first error of the last conversion, which is what stopped it, or ""
+ * if it went through */
+char *tiff2png_last_error (tiff2png_context *ctx);
+
+/* the stats of the last conversion, all zeros without opts->stats */
+tiff2png_stats *tiff2png_last_stats (tiff2png_context *ctx);
+
+/* number of pages (directories) in tiffname, or 0 if it can't be read */
+int tiff2png_count_pages (tiff2png_context *ctx, char *tiffname);
+
+/* parse the names used by the -filter, -strategy and -backend options:
+ * filters return a mask, TIFF2PNG_AUTO or 0 if unknown, strategies a zlib
+ * strategy, TIFF2PNG_AUTO or TIFF2PNG_DEFAULT if unknown.  -sizes fills in
+ * up to TIFF2PNG_MAX_SIZES sizes and returns how many, or 0 if bad. */
+int tiff2png_parse_filters (char *arg);
+int tiff2png_parse_strategy (char *arg);
+int tiff2png_parse_sizes (char *arg, int *sizes);
+int tiff2png_has_backend (char *name);
+
+#endif /* TIFF2PNG_H */